@@ -8,1206 +8,7798 @@
 #include <cstdlib>
 #include <ctime>
 #include <string>
+#include <bitset>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <cstdarg>
+#include <new>
+#include <sstream>
+#include <iterator>
+#include <memory>
+#include <cstddef>
+#include <climits>
+#include <charconv>
 
 // Platform-specific includes
 #ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <windows.h>
+#include <psapi.h>
 #include <conio.h>
+#pragma comment(lib, "ws2_32.lib")
 #else
 #include <ncurses.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+extern char **environ;
 #endif
 using namespace std;
 
-// Constants
-const int FIELD_WIDTH = 12, FIELD_HEIGHT = 22, TETROMINO_SIZE = 4;
-const wstring TETROMINOS[7] = {
-    L"..X...X...X...X.", L"..X..XX...X.....", L".....XX..XX.....",
-    L"..X..XX..X......", L".X...XX...X.....", L".X...X...XX.....", L"..X...X..XX....."};
-
-// Structure to hold score information
-struct HighScore
+// Builds with TETRIS_ALLOC_CHECK count every heap allocation, so that
+// --alloc-check and --marathon can prove the steady-state game loop never
+// allocates; the game itself keeps the C library's allocator. With glibc,
+// malloc, calloc and realloc are counted, which also covers strdup, stdio
+// buffers and the C library; elsewhere only operator new is. Fuzz builds
+// leave malloc to the sanitizers.
+atomic<long long> heapAllocations{0};
+
+#ifdef TETRIS_ALLOC_CHECK
+const bool ALLOCATIONS_COUNTED = true;
+#if defined(__GLIBC__) && !defined(TETRIS_FUZZ)
+#define TETRIS_COUNT_MALLOC
+extern "C"
 {
-    string playerName;
-    int score;
-};
+    void *__libc_malloc(size_t size);
+    void *__libc_calloc(size_t count, size_t size);
+    void *__libc_realloc(void *block, size_t size);
 
-void ClearScreen()
+    void *malloc(size_t size) noexcept
+    {
+        heapAllocations.fetch_add(1, memory_order_relaxed);
+        return __libc_malloc(size);
+    }
+    void *calloc(size_t count, size_t size) noexcept
+    {
+        heapAllocations.fetch_add(1, memory_order_relaxed);
+        return __libc_calloc(count, size);
+    }
+    void *realloc(void *block, size_t size) noexcept
+    {
+        heapAllocations.fetch_add(1, memory_order_relaxed);
+        return __libc_realloc(block, size);
+    }
+}
+#endif
+
+void *operator new(size_t size)
 {
-#ifdef _WIN32
-    system("cls");
-#else
-    clear();
+#ifndef TETRIS_COUNT_MALLOC
+    heapAllocations.fetch_add(1, memory_order_relaxed);
 #endif
+    if (void *block = malloc(size ? size : 1))
+        return block;
+    throw bad_alloc();
 }
-void SetCursorPosition(int x, int y)
-{
-#ifdef _WIN32
-    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-    COORD coord = {(SHORT)x, (SHORT)y};
-    SetConsoleCursorPosition(hConsole, coord);
+// GCC cannot see that these pair with the operator new above.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void *block) noexcept { free(block); }
+void operator delete(void *block, size_t) noexcept { free(block); }
+#pragma GCC diagnostic pop
 #else
-    printf("\033[%d;%dH", y + 1, x + 1);
+const bool ALLOCATIONS_COUNTED = false;
 #endif
-}
 
-#ifdef _WIN32
-void FlushInputBuffer()
+// Constants
+const int FIELD_WIDTH = 12, FIELD_HEIGHT = 22, TETROMINO_SIZE = 4;
+// Spawn orientation of each piece. Other rotations turn the piece inside
+// its own box (4x4 for I, 3x3 at the top left for the rest, none for O),
+// so every piece turns about the same centre as in the Super Rotation System.
+const wstring TETROMINOS[7] = {
+    L"....XXXX........", L".X..XXX.........", L".XX..XX.........",
+    L"XX...XX.........", L".XX.XX..........", L"..X.XXX.........", L"X...XXX........."};
+const char PIECE_NAMES[] = "ITOZSLJ"; // letter for each entry of TETROMINOS
+const int PIECE_I = 0, PIECE_T = 1, PIECE_O = 2;
+
+const int TICK_MS = 10; // length of one simulation step
+
+// Gravity is kept in 1/65536 rows per tick. At 20G (20 rows per 60 Hz
+// frame) or more a new piece lands as soon as it appears.
+const int GRAVITY_ROW = 1 << 16;
+const int GRAVITY_20G = 20 * 60 * TICK_MS * GRAVITY_ROW / 1000;
+const int GRAVITY_LEVELS = 19; // levels past the table use its last entry
+
+enum SpinType : uint8_t
+{
+    SPIN_NONE,
+    SPIN_MINI,
+    SPIN_FULL
+};
+
+// Scoring, levels, gravity and lock timing as data, shared by the game and
+// the solver. A ruleset is picked or parsed once at startup (see
+// LoadRuleset) and not changed afterwards; the game reads the fields
+// directly. The defaults are the "cluster-gravity" rules.
+struct Ruleset
 {
-    // Flush the console input buffer
-    FlushConsoleInputBuffer(GetStdHandle(STD_INPUT_HANDLE));
+    char name[32] = "cluster-gravity";
+    int lineScores[5] = {0, 100, 300, 500, 800};
+    int tspinScores[4] = {400, 800, 1200, 1600}; // by lines cleared, including none
+    int miniTspinScores[3] = {100, 200, 400};
+    int lockBonus = 10;
+    int linesPerLevel = 5;
+    int garbageLines[5] = {0, 0, 1, 2, 4}; // rows sent to an opponent in versus mode
+    int tspinGarbage[4] = {0, 2, 4, 6};
+    bool clusterGravity = true; // floating clusters fall after a clear
+    bool cascade = false;       // rows completed by falling clusters clear too, as a chain
+    int chainBonus = 50;        // per chain step after the first, times the step and the level
+    // The guideline curve of (0.8 - (level - 1) * 0.007) ^ (level - 1)
+    // seconds per row, reaching 20G at level 19
+    int gravity[GRAVITY_LEVELS] = {655,   826,    1061,   1386,   1845,  2501,  3455,
+                                   4864,  6981,   10216,  15249,  23225, 36101, 57290,
+                                   92845, 153712, 260055, 449758, GRAVITY_20G};
+    int lockDelay = 50;      // ticks a landed piece waits before it locks
+    int lockResets = 15;     // shifts and turns that restart the lock delay
+    int softDropFactor = 20; // soft drop speed as a multiple of gravity
+
+    int LineClearScore(int lines, int level, SpinType spin = SPIN_NONE) const
+    {
+        if (spin == SPIN_FULL)
+            return tspinScores[min(lines, 3)] * level;
+        if (spin == SPIN_MINI)
+            return miniTspinScores[min(lines, 2)] * level;
+        return lineScores[min(lines, 4)] * level;
+    }
 
-    // Also clear any remaining characters in the buffer
-    while (_kbhit())
+    // A clear made by clusters falling after the first one; chain counts
+    // the clears of one lock, from 1.
+    int ChainScore(int lines, int level, int chain) const
     {
-        _getch();
+        return LineClearScore(lines, level) + chainBonus * (chain - 1) * level;
     }
-}
-#endif
 
-#ifdef _WIN32
-class ConsoleBuffer
+    int GarbageLines(int lines, SpinType spin) const
+    {
+        return spin == SPIN_FULL ? tspinGarbage[min(lines, 3)] : garbageLines[min(lines, 4)];
+    }
+
+    int Gravity(int level) const
+    {
+        return gravity[max(1, min(level, GRAVITY_LEVELS)) - 1];
+    }
+
+    // Fingerprint of everything that affects play, so versus peers can
+    // check they agree.
+    uint32_t Checksum() const
+    {
+        uint32_t hash = 2166136261u;
+        auto mix = [&hash](const int *values, int count)
+        {
+            for (int i = 0; i < count; i++)
+                hash = (hash ^ (uint32_t)values[i]) * 16777619u;
+        };
+        mix(lineScores, 5);
+        mix(tspinScores, 4);
+        mix(miniTspinScores, 3);
+        mix(&lockBonus, 1);
+        mix(&linesPerLevel, 1);
+        mix(garbageLines, 5);
+        mix(tspinGarbage, 4);
+        int cluster = clusterGravity, chains[2] = {cascade, chainBonus};
+        mix(&cluster, 1);
+        mix(chains, 2);
+        mix(gravity, GRAVITY_LEVELS);
+        mix(&lockDelay, 1);
+        mix(&lockResets, 1);
+        mix(&softDropFactor, 1);
+        return hash;
+    }
+};
+
+// The rulesets every build knows by name; false for an unknown name.
+bool BuiltinRuleset(const string &name, Ruleset &rules)
 {
-private:
-    HANDLE hConsole;
-    CHAR_INFO *buffer;
-    COORD bufferSize;
-    COORD bufferCoord;
-    SMALL_RECT writeRegion;
-    vector<vector<bool>> dirtyCells;
+    rules = Ruleset();
+    if (name == "cluster-gravity")
+        return true;
+    if (name == "classic")
+    {
+        // Plain line clears and ten lines a level
+        snprintf(rules.name, sizeof(rules.name), "classic");
+        rules.clusterGravity = false;
+        rules.linesPerLevel = 10;
+        return true;
+    }
+    if (name == "cascade")
+    {
+        // Cluster gravity that keeps clearing until the board is stable
+        snprintf(rules.name, sizeof(rules.name), "cascade");
+        rules.cascade = true;
+        return true;
+    }
+    return false;
+}
 
-public:
-    ConsoleBuffer(int width, int height) : bufferSize({(SHORT)width, (SHORT)height}),
-                                           dirtyCells(height, vector<bool>(width, true))
+// Reads exactly count integers, all at least minimum.
+bool ReadRuleValues(istringstream &in, int *values, int count, int minimum = 0)
+{
+    for (int i = 0; i < count; i++)
     {
-        hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-        bufferCoord = {0, 0};
-        writeRegion = {0, 0, (SHORT)(width - 1), (SHORT)(height - 1)};
-        buffer = new CHAR_INFO[width * height];
-        Clear();
+        if (!(in >> values[i]) || values[i] < minimum)
+            return false;
     }
+    return true;
+}
 
-    ~ConsoleBuffer()
+// Picks a built-in ruleset by name or reads a ruleset file. File format
+// (everything after '#' is ignored; times are in ms):
+//   base classic                    start from a built-in ruleset (default cluster-gravity);
+//                                   only as the first setting, since it replaces them all
+//   name spring-event               shown with the game
+//   line-scores 0 100 300 500 800   points for 0 to 4 lines, times the level
+//   tspin-scores 400 800 1200 1600  T-spins by lines cleared, times the level
+//   mini-tspin-scores 100 200 400
+//   lock-bonus 10                   points per piece locked, times the level
+//   lines-per-level 5
+//   garbage 0 0 1 2 4               versus rows sent for 0 to 4 lines
+//   tspin-garbage 0 2 4 6
+//   cluster-gravity 1               floating clusters fall after a clear
+//   cascade 1                       rows they complete clear too, as a chain
+//   chain-bonus 50                  per chain step after the first, times step and level
+//   gravity-ms 1000 793 618 ...     time per row from level 1 on, 0 for 20G;
+//                                   the last value holds for higher levels
+//   lock-delay 500
+//   lock-resets 15
+//   soft-drop-factor 20
+bool LoadRuleset(const char *nameOrPath, Ruleset &rules)
+{
+    if (BuiltinRuleset(nameOrPath, rules))
+        return true;
+    ifstream file(nameOrPath);
+    if (!file.is_open())
     {
-        delete[] buffer;
+        cerr << "Unknown ruleset " << nameOrPath << " (built in: classic, cluster-gravity, cascade)\n";
+        return false;
     }
 
-    void Clear(char fillChar = ' ', WORD attributes = 0)
+    snprintf(rules.name, sizeof(rules.name), "%s", nameOrPath);
+    string line;
+    bool first = true;
+    for (int lineNumber = 1; getline(file, line); lineNumber++)
     {
-        for (int i = 0; i < bufferSize.X * bufferSize.Y; i++)
+        istringstream in(line.substr(0, line.find('#')));
+        string keyword, text;
+        if (!(in >> keyword))
+            continue;
+        int value = 0;
+        bool ok = true;
+        if (keyword == "base" && !first)
         {
-            buffer[i].Char.UnicodeChar = fillChar;
-            buffer[i].Attributes = attributes;
+            cerr << nameOrPath << ":" << lineNumber << ": base has to be the first setting, or it undoes the ones before\n";
+            return false;
         }
-        // Mark all cells as dirty
-        for (auto &row : dirtyCells)
+        first = false;
+        if (keyword == "base")
         {
-            fill(row.begin(), row.end(), true);
+            char name[sizeof(rules.name)];
+            memcpy(name, rules.name, sizeof(name));
+            ok = (in >> text) && BuiltinRuleset(text, rules);
+            memcpy(rules.name, name, sizeof(name));
         }
-    }
-
-    void Write(int x, int y, const char *text, WORD attributes)
-    {
-        for (int i = 0; text[i] != '\0'; i++)
+        else if (keyword == "name" && (in >> text))
+            snprintf(rules.name, sizeof(rules.name), "%s", text.c_str());
+        else if (keyword == "line-scores")
+            ok = ReadRuleValues(in, rules.lineScores, 5);
+        else if (keyword == "tspin-scores")
+            ok = ReadRuleValues(in, rules.tspinScores, 4);
+        else if (keyword == "mini-tspin-scores")
+            ok = ReadRuleValues(in, rules.miniTspinScores, 3);
+        else if (keyword == "lock-bonus")
+            ok = ReadRuleValues(in, &rules.lockBonus, 1);
+        else if (keyword == "lines-per-level")
+            ok = ReadRuleValues(in, &rules.linesPerLevel, 1, 1);
+        else if (keyword == "garbage")
+            ok = ReadRuleValues(in, rules.garbageLines, 5);
+        else if (keyword == "tspin-garbage")
+            ok = ReadRuleValues(in, rules.tspinGarbage, 4);
+        else if (keyword == "cluster-gravity" && (ok = ReadRuleValues(in, &value, 1)))
+            rules.clusterGravity = value != 0;
+        else if (keyword == "cascade" && (ok = ReadRuleValues(in, &value, 1)))
+            rules.cascade = value != 0;
+        else if (keyword == "chain-bonus")
+            ok = ReadRuleValues(in, &rules.chainBonus, 1);
+        else if (keyword == "gravity-ms")
         {
-            if (x + i < bufferSize.X && y < bufferSize.Y)
+            int count = 0;
+            while (count < GRAVITY_LEVELS && (in >> value) && value >= 0)
             {
-                int index = y * bufferSize.X + x + i;
-                buffer[index].Char.UnicodeChar = text[i];
-                buffer[index].Attributes = attributes;
-                dirtyCells[y][x + i] = true;
+                long long perTick = value == 0 ? GRAVITY_20G : (long long)GRAVITY_ROW * TICK_MS / value;
+                rules.gravity[count++] = (int)max(1LL, min<long long>(perTick, GRAVITY_20G));
             }
+            ok = count > 0;
+            for (int level = count; ok && level < GRAVITY_LEVELS; level++)
+                rules.gravity[level] = rules.gravity[count - 1];
+        }
+        else if (keyword == "lock-delay" && (ok = ReadRuleValues(in, &value, 1)))
+            rules.lockDelay = max(value / TICK_MS, 1);
+        else if (keyword == "lock-resets")
+            ok = ReadRuleValues(in, &rules.lockResets, 1);
+        else if (keyword == "soft-drop-factor")
+            ok = ReadRuleValues(in, &rules.softDropFactor, 1, 1);
+        else
+            ok = false;
+        if (!ok)
+        {
+            cerr << nameOrPath << ":" << lineNumber << ": cannot read \"" << line << "\"\n";
+            return false;
         }
     }
+    return true;
+}
 
-    void Fill(int x, int y, int width, int height, char fillChar, WORD attributes)
+// Small deterministic generator (xorshift) for piece order and garbage
+// holes, so a game plays out identically from its seed on every machine.
+int NextRandom(uint32_t &state, int range)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state % range;
+}
+
+// Bit masks of every piece in every rotation, built once from TETROMINOS.
+// rows[piece][rotation][py] has bit px set when the cell is a block, so a
+// whole piece row can be tested against a field row with a single AND.
+struct PieceMaskTable
+{
+    uint8_t rows[7][4][TETROMINO_SIZE];
+    uint16_t shape[7][4]; // 4x4 mask moved to the top-left corner
+    int8_t left[7][4], top[7][4];
+    int8_t bottom[7][4][TETROMINO_SIZE]; // lowest block in each column, -1 if none
+
+    PieceMaskTable()
     {
-        for (int i = y; i < y + height && i < bufferSize.Y; i++)
+        for (int p = 0; p < 7; p++)
         {
-            for (int j = x; j < x + width && j < bufferSize.X; j++)
+            for (int r = 0; r < 4; r++)
             {
-                int index = i * bufferSize.X + j;
-                buffer[index].Char.UnicodeChar = fillChar;
-                buffer[index].Attributes = attributes;
-                dirtyCells[i][j] = true;
+                // Turn each block clockwise r times inside the piece's box
+                int box = p == PIECE_I ? 4 : p == PIECE_O ? 0 : 3;
+                int minX = TETROMINO_SIZE, minY = TETROMINO_SIZE;
+                memset(rows[p][r], 0, TETROMINO_SIZE);
+                for (int i = 0; i < TETROMINO_SIZE * TETROMINO_SIZE; i++)
+                {
+                    if (TETROMINOS[p][i] == L'.')
+                        continue;
+                    int px = i % TETROMINO_SIZE, py = i / TETROMINO_SIZE;
+                    for (int turn = 0; box > 0 && turn < r; turn++)
+                    {
+                        int turned = box - 1 - py;
+                        py = px;
+                        px = turned;
+                    }
+                    rows[p][r][py] |= 1 << px;
+                    minX = min(minX, px);
+                    minY = min(minY, py);
+                }
+                for (int px = 0; px < TETROMINO_SIZE; px++)
+                {
+                    bottom[p][r][px] = -1;
+                    for (int py = 0; py < TETROMINO_SIZE; py++)
+                    {
+                        if (rows[p][r][py] & (1 << px))
+                            bottom[p][r][px] = py;
+                    }
+                }
+                left[p][r] = minX;
+                top[p][r] = minY;
+                shape[p][r] = 0;
+                for (int py = minY; py < TETROMINO_SIZE; py++)
+                {
+                    shape[p][r] |= (rows[p][r][py] >> minX) << ((py - minY) * TETROMINO_SIZE);
+                }
             }
         }
     }
-
-    void Draw()
+};
+const PieceMaskTable PIECE_MASKS;
+
+// Super Rotation System wall kicks: the offsets (x, y) tried in order when
+// a piece turns, indexed by [I or not][rotation before][clockwise,
+// counter-clockwise]. y points up as in the published tables. The first
+// offset that fits wins; if none does, the piece stays where it is.
+const int8_t SRS_KICKS[2][4][2][5][2] = {
+    // J, L, S, T, Z (O only ever needs the first test)
+    {{{{0, 0}, {-1, 0}, {-1, 1}, {0, -2}, {-1, -2}}, {{0, 0}, {1, 0}, {1, 1}, {0, -2}, {1, -2}}},
+     {{{0, 0}, {1, 0}, {1, -1}, {0, 2}, {1, 2}}, {{0, 0}, {1, 0}, {1, -1}, {0, 2}, {1, 2}}},
+     {{{0, 0}, {1, 0}, {1, 1}, {0, -2}, {1, -2}}, {{0, 0}, {-1, 0}, {-1, 1}, {0, -2}, {-1, -2}}},
+     {{{0, 0}, {-1, 0}, {-1, -1}, {0, 2}, {-1, 2}}, {{0, 0}, {-1, 0}, {-1, -1}, {0, 2}, {-1, 2}}}},
+    // I
+    {{{{0, 0}, {-2, 0}, {1, 0}, {-2, -1}, {1, 2}}, {{0, 0}, {-1, 0}, {2, 0}, {-1, 2}, {2, -1}}},
+     {{{0, 0}, {-1, 0}, {2, 0}, {-1, 2}, {2, -1}}, {{0, 0}, {2, 0}, {-1, 0}, {2, 1}, {-1, -2}}},
+     {{{0, 0}, {2, 0}, {-1, 0}, {2, 1}, {-1, -2}}, {{0, 0}, {1, 0}, {-2, 0}, {1, -2}, {-2, 1}}},
+     {{{0, 0}, {1, 0}, {-2, 0}, {1, -2}, {-2, 1}}, {{0, 0}, {-2, 0}, {1, 0}, {-2, -1}, {1, 2}}}}};
+const int KICK_TESTS = 5;
+
+// Turns a piece by direction (1 clockwise, -1 counter-clockwise) with wall
+// kicks. fits(x, y, rotation) is the caller's collision test, so the game
+// and the move generator share the rules. On success moves posX/posY and
+// returns the kick test used; returns -1 when the piece cannot turn.
+template <class FitsT>
+int KickRotate(int piece, int rotation, int direction, int &posX, int &posY, FitsT fits)
+{
+    int from = rotation & 3, to = (rotation + direction) & 3;
+    const int8_t(&kicks)[5][2] = SRS_KICKS[piece == PIECE_I][from][direction < 0];
+    for (int test = 0; test < KICK_TESTS; test++)
     {
-        // Only write the dirty regions to console
-        vector<SMALL_RECT> dirtyRegions;
-        // Simple implementation - could be optimized further
-        // by merging adjacent dirty regions
-
-        // For now, we'll just write the entire buffer
-        WriteConsoleOutput(hConsole, buffer, bufferSize, bufferCoord, &writeRegion);
-
-        // Clear dirty flags
-        for (auto &row : dirtyCells)
+        if (fits(posX + kicks[test][0], posY - kicks[test][1], to))
         {
-            fill(row.begin(), row.end(), false);
+            posX += kicks[test][0];
+            posY -= kicks[test][1];
+            return test;
         }
     }
-};
-#endif
-
-void ShowGameInstructions()
-{
-    ClearScreen();
-
-#ifdef _WIN32
-    // Windows version using console API
-    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
-    GetConsoleScreenBufferInfo(hConsole, &csbi);
-    int consoleWidth = csbi.srWindow.Right - csbi.srWindow.Left + 1;
-    int consoleHeight = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
-
-    // Game Title
-    SetConsoleTextAttribute(hConsole, FOREGROUND_BLUE | FOREGROUND_GREEN | FOREGROUND_INTENSITY);
-    cout << string(consoleWidth / 2 - 10, ' ') << "     TETRIS GAME    \n\n";
-
-    // Instruction box
-    SetConsoleTextAttribute(hConsole, FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_INTENSITY);
-    cout << string(consoleWidth / 2 - 20, ' ') << "                HOW TO PLAY                 \n";
+    return -1;
+}
 
-    // Instruction lines
-    vector<string> instructions = {
-        "  - Arrange the falling blocks to complete lines",
-        "  - Complete lines to earn points and level up",
-        "  - The game speeds up as you progress levels",
-        "  - Game ends when blocks reach the top",
-        "",
-        "  CONTROLS:",
-        "  LEFT_ARROW, RIGHT_ARROW : Move block left/right",
-        "  UP_ARROW : Rotate block",
-        "  DOWN_ARROW : Soft drop (move down faster)",
-        "  SPACE: Hard drop (instant drop)",
-        "  S : Pause game",
-        "  Ctrl + C : Quit game"};
+// T-spin corners: the four cells diagonal to the centre of a T, clockwise
+// from the top left of its box. In rotation r the T points towards corners
+// r and r + 1.
+const int8_t T_CORNERS[4][2] = {{0, 0}, {2, 0}, {2, 2}, {0, 2}};
 
-    for (const auto &line : instructions)
+// Which T_CORNERS are blocked for a T at (posX, posY), one bit each, given
+// occupancy rows in Board::Row form; rows off the field count as blocked.
+uint8_t BlockedCorners(const uint64_t *rows, int height, int posX, int posY)
+{
+    uint8_t blocked = 0;
+    for (int i = 0; i < 4; i++)
     {
-        cout << string(consoleWidth / 2 - 20, ' ') << line << "\n";
+        int y = posY + T_CORNERS[i][1];
+        if (y < 0 || y >= height || (rows[y] >> (posX + T_CORNERS[i][0] + TETROMINO_SIZE) & 1))
+            blocked |= 1 << i;
     }
+    return blocked;
+}
 
-    // Prompt to continue
-    SetConsoleTextAttribute(hConsole, FOREGROUND_GREEN | FOREGROUND_INTENSITY);
-    cout << "\n"
-         << string(consoleWidth / 2 - 15, ' ')
-         << "Press any key to return to the game...";
+// A T that last moved by turning is a T-spin when three corners are
+// blocked: a full one when both corners it points to are, or when it got
+// there with the last kick test, otherwise a mini.
+SpinType ClassifySpin(int piece, bool rotated, int kick, uint8_t blockedCorners, int rotation)
+{
+    if (piece != PIECE_T || !rotated || __builtin_popcount(blockedCorners) < 3)
+        return SPIN_NONE;
+    int front = 1 << (rotation & 3) | 1 << ((rotation + 1) & 3);
+    if ((blockedCorners & front) == front || kick == KICK_TESTS - 1)
+        return SPIN_FULL;
+    return SPIN_MINI;
+}
 
-    _getch();                                            // Wait for any key press
-    SetConsoleTextAttribute(hConsole, csbi.wAttributes); // Restore original colors
+// Screen offsets (x, y) of the four blocks of each piece in the preview
+// panel, worked out once so Draw never rotates a preview piece. box is the
+// spawn rotation centred in the NEXT and HOLD boxes; compact is the flattest
+// rotation, used for the rest of the queue.
+struct PreviewSpriteTable
+{
+    int8_t box[7][4][2], compact[7][4][2];
 
-#else
-    // Linux version using ncurses
-    initscr();
-    start_color();
-    init_pair(15, COLOR_CYAN, COLOR_BLACK);
-    init_pair(16, COLOR_YELLOW, COLOR_BLACK);
-    init_pair(17, COLOR_GREEN, COLOR_BLACK);
+    PreviewSpriteTable()
+    {
+        for (int p = 0; p < 7; p++)
+        {
+            int flattest = 0, flattestHeight = TETROMINO_SIZE + 1;
+            for (int r = 0; r < 4; r++)
+            {
+                int height = 0;
+                for (int py = 0; py < TETROMINO_SIZE; py++)
+                    height += PIECE_MASKS.rows[p][r][py] != 0;
+                if (height < flattestHeight)
+                {
+                    flattest = r;
+                    flattestHeight = height;
+                }
+            }
 
-    // Game Title
-    attron(COLOR_PAIR(15) | A_BOLD);
-    mvprintw(2, COLS / 2 - 10, "     TETRIS GAME    ");
-    attroff(COLOR_PAIR(15) | A_BOLD);
+            int boxCount = 0, compactCount = 0;
+            for (int py = 0; py < TETROMINO_SIZE; py++)
+            {
+                for (int px = 0; px < TETROMINO_SIZE; px++)
+                {
+                    if (PIECE_MASKS.rows[p][0][py] & (1 << px))
+                    {
+                        box[p][boxCount][0] = (px - 1) * 2;
+                        box[p][boxCount++][1] = py - 1;
+                    }
+                    if (PIECE_MASKS.rows[p][flattest][py] & (1 << px))
+                    {
+                        compact[p][compactCount][0] = (px - PIECE_MASKS.left[p][flattest]) * 2;
+                        compact[p][compactCount++][1] = py - PIECE_MASKS.top[p][flattest];
+                    }
+                }
+            }
+        }
+    }
+};
+const PreviewSpriteTable PREVIEW_SPRITES;
+
+// The playing field: walls around the edge, 0 for empty cells and 1-7 for
+// blocks of each piece colour. It is a flat array so the whole board can be
+// copied cheaply by the solver and the game logic shares one implementation.
+// The dimensions (walls included) are template parameters so every variant
+// gets collision and full-row tests with compile-time bounds and masks.
+//
+// Alongside the colours each row keeps an occupancy bit mask, shifted left by
+// TETROMINO_SIZE with every bit outside the field set, so a piece row can be
+// tested against it with one AND even when the piece box hangs off an edge.
+// Each column keeps one too (bit y for row y), which answers "how far can
+// this piece drop" with one count-trailing-zeros per piece column.
+template <int W, int H>
+class Board
+{
+public:
+    static const int FIELD_WIDTH = W, FIELD_HEIGHT = H;
+    static_assert(W + 2 * TETROMINO_SIZE <= 64, "row masks must fit in 64 bits");
+    static_assert(H <= 64, "column masks must fit in 64 bits");
 
-    // Instruction box
-    attron(COLOR_PAIR(16));
-    mvprintw(7, COLS / 2 - 20, "                HOW TO PLAY                 ");
+    static const uint64_t INTERIOR_MASK = ((1ULL << (W - 2)) - 1) << (TETROMINO_SIZE + 1);
+    static const uint64_t EMPTY_ROW = ~INTERIOR_MASK;
+    static const uint64_t OUTSIDE_MASK = ~(((1ULL << W) - 1) << TETROMINO_SIZE);
 
-    // Instruction lines
-    vector<string> instructions = {
-        "  - Arrange the falling blocks to complete lines",
-        "  - Complete lines to earn points and level up",
-        "  - The game speeds up as you progress levels",
-        "  - Game ends when blocks reach the top",
-        "",
-        "  CONTROLS:",
-        "  LEFT_KEY, RIGHT_KEY : Move block left/right",
-        "  UP_KEY : Rotate block",
-        "  DOWN_KEY : Soft drop (move down faster)",
-        "  SPACE: Hard drop (instant drop)",
-        "  S : Pause game",
-        "  Ctrl+C : Quit game"};
+private:
+    uint8_t cells[H][W];
+    uint64_t rows[H];
+    uint64_t columns[W];
 
-    for (size_t i = 0; i < instructions.size(); i++)
+    // After rows moved as a block, the column masks are rebuilt from them.
+    void RebuildColumns()
     {
-        mvprintw(9 + i, COLS / 2 - 20, "%-42s", instructions[i].c_str());
+        for (int x = 0; x < W; x++)
+        {
+            uint64_t bit = 1ULL << (x + TETROMINO_SIZE), column = 0;
+            for (int y = 0; y < H; y++)
+            {
+                if (rows[y] & bit)
+                    column |= 1ULL << y;
+            }
+            columns[x] = column;
+        }
     }
 
-    // Prompt to continue
-    attron(COLOR_PAIR(17) | A_BOLD);
-    mvprintw(LINES - 4, COLS / 2 - 15, "Press any key to return to the game...");
-    attroff(COLOR_PAIR(17) | A_BOLD);
-
-    refresh();
-    getch();
-    endwin();
-#endif
-}
-
-// Function to read high scores from file
-vector<HighScore> readHighScores()
-{
-    vector<HighScore> scores;
-    ifstream file("Score.txt");
-
-    if (file.is_open())
+    // After the rows in cleared (bit y for row y) were removed, drops them
+    // from the interior column masks too: the rows above each one move
+    // down a bit and an empty row comes in under the top wall.
+    void RemoveFromColumns(uint64_t cleared)
     {
-        HighScore temp;
-        while (file >> temp.playerName >> temp.score)
+        for (; cleared; cleared &= cleared - 1)
         {
-            scores.push_back(temp);
+            int y = __builtin_ctzll(cleared); // top down, so lower rows keep their bits
+            uint64_t above = (1ULL << y) - 2;
+            for (int x = 1; x < W - 1; x++)
+                columns[x] = (columns[x] & ~(above | 1ULL << y)) | (columns[x] & above) << 1;
         }
-        file.close();
     }
 
-    // Sort in descending order
-    sort(scores.begin(), scores.end(), [](const HighScore &a, const HighScore &b)
-         { return a.score > b.score; });
+public:
+    Board()
+    {
+        for (int x = 0; x < W; x++)
+            columns[x] = 0;
+        for (int y = 0; y < H; y++)
+        {
+            rows[y] = OUTSIDE_MASK;
+            for (int x = 0; x < W; x++)
+            {
+                bool isBorder = x == 0 || x == W - 1 || y == 0 || y == H - 1;
+                cells[y][x] = 0;
+                Set(y, x, isBorder ? 8 : 0);
+            }
+        }
+    }
+
+    const uint8_t *operator[](int y) const { return cells[y]; }
+    uint64_t Row(int y) const { return rows[y]; }
+    uint64_t Column(int x) const { return columns[x]; }
+
+    void Set(int y, int x, int value)
+    {
+        uint64_t bit = 1ULL << (x + TETROMINO_SIZE);
+        cells[y][x] = value;
+        rows[y] = value != 0 ? rows[y] | bit : rows[y] & ~bit;
+        columns[x] = value != 0 ? columns[x] | 1ULL << y : columns[x] & ~(1ULL << y);
+    }
+
+    // Rows a piece that fits at (posX, posY) can fall before it rests: for
+    // each of its columns, the gap between its lowest block there and the
+    // next filled cell below. The floor guarantees there is one.
+    int DropDistance(int piece, int rotation, int posX, int posY) const
+    {
+        const int8_t *bottom = PIECE_MASKS.bottom[piece][rotation & 3];
+        int distance = H;
+        for (int px = 0; px < TETROMINO_SIZE; px++)
+        {
+            if (bottom[px] < 0)
+                continue;
+            uint64_t below = columns[posX + px] >> (posY + bottom[px] + 1);
+            distance = min(distance, __builtin_ctzll(below));
+        }
+        return distance;
+    }
+
+    bool DoesPieceFit(int piece, int rotation, int posX, int posY) const
+    {
+        if (posX < -TETROMINO_SIZE || posX >= W)
+            return false;
+        const uint8_t *mask = PIECE_MASKS.rows[piece][rotation & 3];
+        for (int py = 0; py < TETROMINO_SIZE; py++)
+        {
+            if (mask[py] == 0)
+                continue;
+            int fy = posY + py;
+            if (fy < 0 || fy >= H)
+                return false;
+            if (rows[fy] & ((uint64_t)mask[py] << (posX + TETROMINO_SIZE)))
+                return false;
+        }
+        return true;
+    }
+
+    void LockPiece(int piece, int rotation, int posX, int posY)
+    {
+        const uint8_t *mask = PIECE_MASKS.rows[piece][rotation & 3];
+        for (int py = 0; py < TETROMINO_SIZE; py++)
+        {
+            for (int px = 0; px < TETROMINO_SIZE; px++)
+            {
+                if (mask[py] & (1 << px))
+                    Set(posY + py, posX + px, piece + 1);
+            }
+        }
+    }
+
+    // Bit y set for each row that locking the piece there would complete.
+    uint64_t RowsCompletedBy(int piece, int rotation, int posX, int posY) const
+    {
+        const uint8_t *mask = PIECE_MASKS.rows[piece][rotation & 3];
+        uint64_t completed = 0;
+        for (int py = 0; py < TETROMINO_SIZE; py++)
+        {
+            uint64_t row = rows[posY + py] | (uint64_t)mask[py] << (posX + TETROMINO_SIZE);
+            if (mask[py] != 0 && (row & INTERIOR_MASK) == INTERIOR_MASK)
+                completed |= 1ULL << (posY + py);
+        }
+        return completed;
+    }
+
+    // T-spin corners blocked around a T at (posX, posY); see ClassifySpin.
+    uint8_t BlockedCorners(int posX, int posY) const
+    {
+        return ::BlockedCorners(rows, H, posX, posY);
+    }
+
+    // Removes every complete row, moving the rows above down, and returns
+    // how many were removed. Rows that end up next to a removed one, where
+    // clusters may have lost support, are added to seams (bit y for row y).
+    int ClearLines(uint64_t *seams = nullptr)
+    {
+        int linesClearedThisTurn = 0;
+        uint64_t cleared = 0;
+        int target = H - 2;
+        for (int y = H - 2; y >= 1; y--)
+        {
+            if ((rows[y] & INTERIOR_MASK) == INTERIOR_MASK)
+            {
+                linesClearedThisTurn++;
+                cleared |= 1ULL << y;
+                if (seams)
+                    *seams |= 3ULL << target; // the rows that will meet across the gap
+                continue;
+            }
+            if (target != y)
+            {
+                memcpy(cells[target], cells[y], W);
+                rows[target] = rows[y];
+            }
+            target--;
+        }
+        for (; target >= 1; target--)
+        {
+            memset(cells[target] + 1, 0, W - 2);
+            rows[target] = EMPTY_ROW;
+        }
+        if (linesClearedThisTurn > 0)
+            RemoveFromColumns(cleared);
+        return linesClearedThisTurn;
+    }
+
+    int FilledCells() const
+    {
+        int count = 0;
+        for (int y = 1; y < H - 1; y++)
+            count += __builtin_popcountll(rows[y] & INTERIOR_MASK);
+        return count;
+    }
+
+    bool IsEmpty() const
+    {
+        for (int y = 1; y < H - 1; y++)
+        {
+            if (rows[y] & INTERIOR_MASK)
+                return false;
+        }
+        return true;
+    }
+
+    // Pushes the stack up and fills the bottom rows with garbage: solid rows
+    // in the wall colour with one hole in column hole. Returns false when
+    // blocks are pushed out of the top.
+    bool AddGarbage(int count, int hole)
+    {
+        count = min(count, H - 2);
+        bool fits = true;
+        for (int y = 1; y <= count; y++)
+        {
+            if (rows[y] & INTERIOR_MASK)
+                fits = false;
+        }
+        for (int y = 1; y + count < H - 1; y++)
+        {
+            memcpy(cells[y], cells[y + count], W);
+            rows[y] = rows[y + count];
+        }
+        RebuildColumns();
+        for (int y = H - 1 - count; y < H - 1; y++)
+        {
+            for (int x = 1; x < W - 1; x++)
+                Set(y, x, x == hole ? 0 : 8);
+        }
+        return fits;
+    }
+
+    // Drops floating clusters of same-coloured blocks (AppleGravity). A
+    // cluster falls as one piece until any block of it lands, and since a
+    // fall can leave the clusters above unsupported, passes repeat until
+    // one moves nothing. Returns whether anything fell.
+    bool ApplyGravity()
+    {
+        // Scratch space has compile-time size, so settling never allocates.
+        // Cells are marked visited when queued, which bounds the queue by the
+        // field size and finds the same clusters as checking them on removal.
+        bool visited[H][W];
+        pair<int, int> cluster[W * H];
+        pair<int, int> toVisit[W * H];
+
+        bool fell = false;
+        for (bool moved = true; moved; fell |= moved)
+        {
+            moved = false;
+            memset(visited, 0, sizeof(visited));
+
+            // Process from bottom to top (skip borders)
+            for (int y = H - 2; y >= 1; y--)
+            {
+                for (int x = 1; x < W - 1; x++)
+                {
+                    if (cells[y][x] == 0 || visited[y][x])
+                        continue;
+                    int pieceID = cells[y][x];
+                    int clusterSize = 0, head = 0, tail = 0;
+                    toVisit[tail++] = make_pair(y, x);
+                    visited[y][x] = true;
+
+                    // Find all connected blocks of the same type
+                    while (head < tail)
+                    {
+                        pair<int, int> current = toVisit[head++];
+                        int cy = current.first;
+                        int cx = current.second;
+                        cluster[clusterSize++] = current;
+
+                        // Check all 4-directional neighbors
+                        const int dy[4] = {-1, 1, 0, 0}, dx[4] = {0, 0, -1, 1};
+                        for (int d = 0; d < 4; d++)
+                        {
+                            int ny = cy + dy[d], nx = cx + dx[d];
+                            if (ny < 1 || ny >= H - 1 || nx < 1 || nx >= W - 1)
+                                continue;
+                            if (visited[ny][nx] || cells[ny][nx] != pieceID)
+                                continue;
+                            visited[ny][nx] = true;
+                            toVisit[tail++] = make_pair(ny, nx);
+                        }
+                    }
+
+                    // The cluster floats unless a block rests on the floor or
+                    // on another colour; a same-coloured block below is part
+                    // of the cluster itself
+                    bool isFloating = true;
+                    for (int i = 0; i < clusterSize && isFloating; i++)
+                    {
+                        int belowY = cluster[i].first + 1, belowX = cluster[i].second;
+                        if (belowY >= H - 1 || (cells[belowY][belowX] != 0 && cells[belowY][belowX] != pieceID))
+                            isFloating = false;
+                    }
+                    if (!isFloating)
+                        continue;
+
+                    // Lift the cluster out, so its own blocks do not stop it,
+                    // and drop it as far as its lowest landing block allows
+                    for (int i = 0; i < clusterSize; i++)
+                        Set(cluster[i].first, cluster[i].second, 0);
+                    int maxDrop = H;
+                    for (int i = 0; i < clusterSize; i++)
+                    {
+                        int drop = 0;
+                        while (cluster[i].first + drop + 1 < H - 1 &&
+                               cells[cluster[i].first + drop + 1][cluster[i].second] == 0)
+                        {
+                            drop++;
+                        }
+                        maxDrop = min(maxDrop, drop);
+                    }
+                    for (int i = 0; i < clusterSize; i++)
+                    {
+                        int newY = cluster[i].first + maxDrop;
+                        Set(newY, cluster[i].second, pieceID);
+                        visited[newY][cluster[i].second] = true;
+                    }
+                    moved = true;
+                }
+            }
+        }
+        return fell;
+    }
+
+    // Cascade rules: starting from a settled board that has just lost the
+    // rows next to seams, drops the clusters that lost support, clears the
+    // rows their falls complete and repeats until nothing moves, calling
+    // onClear with the rows of each further clear. Instead of rescanning the
+    // board every round it keeps a worklist of cells whose cluster may
+    // float, as a bit mask per row over the affected columns: seams start
+    // it and every fall adds the cells resting on the ones it left.
+    // Returns whether anything fell.
+    template <class OnClear>
+    bool Cascade(uint64_t seams, OnClear onClear)
+    {
+        uint64_t pending[H] = {};
+        for (bool fell = false;; fell = true)
+        {
+            for (int y = 1; y < H - 1; y++)
+            {
+                if (seams >> y & 1)
+                    pending[y] |= Occupied(y) & INTERIOR_BITS;
+            }
+            if (!SettlePending(pending))
+                return fell;
+            seams = 0;
+            int lines = ClearLines(&seams);
+            if (lines == 0)
+                return true;
+            onClear(lines);
+        }
+    }
+
+private:
+    static const uint64_t INTERIOR_BITS = ((1ULL << (W - 2)) - 1) << 1;
+
+    // Filled cells of row y, bit x for column x, walls included.
+    uint64_t Occupied(int y) const { return rows[y] >> TETROMINO_SIZE & ((1ULL << W) - 1); }
+
+    uint64_t ColourMask(int y, int colour) const
+    {
+        uint64_t mask = 0;
+        for (int x = 1; x < W - 1; x++)
+            mask |= uint64_t(cells[y][x] == colour) << x;
+        return mask;
+    }
+
+    // Drops every floating cluster with a cell in pending, lowest first so
+    // clusters land on settled ground; returns whether any fell. Clusters
+    // are flood filled a row mask at a time.
+    bool SettlePending(uint64_t (&pending)[H])
+    {
+        bool moved = false;
+        for (int y = H - 2; y >= 1;)
+        {
+            if (pending[y] == 0)
+            {
+                y--;
+                continue;
+            }
+            int x = __builtin_ctzll(pending[y]), colour = cells[y][x], below = cells[y + 1][x];
+            if (y == H - 2 || (below != 0 && below != colour))
+            {
+                pending[y] &= pending[y] - 1; // resting on the floor or another colour
+                continue;
+            }
+            uint64_t cluster[H] = {}, same[H];
+            uint64_t known = 1ULL << y; // rows whose same-colour mask is in same
+            same[y] = ColourMask(y, colour);
+            cluster[y] = 1ULL << x;
+            int top = y, bottom = y;
+            for (bool grew = true; grew;)
+            {
+                grew = false;
+                for (int row = max(top - 1, 1); row <= min(bottom + 1, H - 2); row++)
+                {
+                    if (!(known >> row & 1))
+                    {
+                        same[row] = ColourMask(row, colour);
+                        known |= 1ULL << row;
+                    }
+                    uint64_t fill = (cluster[row] | cluster[row - 1] | cluster[row + 1]) & same[row];
+                    for (uint64_t wider = fill; (wider = (fill | fill << 1 | fill >> 1) & same[row]) != fill;)
+                        fill = wider;
+                    if (fill != cluster[row])
+                    {
+                        cluster[row] = fill;
+                        top = min(top, row);
+                        bottom = max(bottom, row);
+                        grew = true;
+                    }
+                }
+            }
+
+            // It floats unless a block rests on the floor or another colour
+            bool isFloating = true;
+            for (int row = top; row <= bottom; row++)
+            {
+                pending[row] &= ~cluster[row];
+                if (cluster[row] & Occupied(row + 1) & ~cluster[row + 1])
+                    isFloating = false;
+            }
+            if (!isFloating)
+                continue;
+
+            // Lift it out and drop it as far as its first landing block
+            // allows, read off the column masks
+            for (int row = top; row <= bottom; row++)
+            {
+                for (uint64_t bits = cluster[row]; bits; bits &= bits - 1)
+                    Set(row, __builtin_ctzll(bits), 0);
+            }
+            int drop = H;
+            for (int row = top; row <= bottom; row++)
+            {
+                for (uint64_t bits = cluster[row]; bits; bits &= bits - 1)
+                    drop = min(drop, __builtin_ctzll(columns[__builtin_ctzll(bits)] >> (row + 1)));
+            }
+            for (int row = bottom; row >= top; row--)
+            {
+                for (uint64_t bits = cluster[row]; bits; bits &= bits - 1)
+                    Set(row + drop, __builtin_ctzll(bits), colour);
+            }
+
+            // Whatever rested on a cell it left may float now
+            for (int row = max(top, 2); row <= bottom; row++)
+                pending[row - 1] |= cluster[row] & ~Occupied(row) & Occupied(row - 1);
+            y = max(y, bottom);
+            moved = true;
+        }
+        return moved;
+    }
+};
+
+// Keys a placement can be reached with, in the order MOVE_NAMES spells them.
+enum Move : uint8_t
+{
+    MOVE_LEFT,
+    MOVE_RIGHT,
+    MOVE_ROTATE, // clockwise
+    MOVE_ROTATE_CCW,
+    MOVE_SOFT_DROP,
+    MOVE_HARD_DROP,
+    MOVE_HOLD
+};
+const char MOVE_NAMES[] = "<>^zv_h";
+
+// A resting place found by MoveGenerator and the length of its key sequence.
+struct Placement
+{
+    int x, y, rotation;
+    int keyCount;
+    int state;
+    SpinType spin; // T-spin made by the last key, when it is a rotation
+};
+
+// Enumerates every final resting place of a piece that is reachable from its
+// current state with the game's own controls (left, right, both rotations
+// with their wall kicks, soft drop and hard drop), including tucks, slides
+// under overhangs and kicked T-spins. A breadth-first search over
+// (x, y, rotation) finds the shortest key sequence for each one.
+template <class BoardT>
+class MoveGenerator
+{
+private:
+    static const int FIELD_WIDTH = BoardT::FIELD_WIDTH, FIELD_HEIGHT = BoardT::FIELD_HEIGHT;
+
+    // x and y may go up to TETROMINO_SIZE - 1 cells past the left/top edge
+    // because the 4x4 piece box has empty columns and rows.
+    static const int MIN_POS = -(TETROMINO_SIZE - 1);
+    static const int SPAN_X = FIELD_WIDTH - MIN_POS;
+    static const int SPAN_Y = FIELD_HEIGHT - MIN_POS;
+    static const int STATE_COUNT = SPAN_X * SPAN_Y * 4;
+
+    // Occupancy masks copied from Board::Row, so off-board cells collide like
+    // walls do in DoesPieceFit.
+    uint64_t rows[FIELD_HEIGHT];
+    // Lazily filled per (x, rotation): bit (y - MIN_POS) is set when the piece
+    // fits there, which turns both collision tests and hard-drop landing
+    // searches into bit operations.
+    uint64_t columnFits[SPAN_X * 4];
+    bitset<SPAN_X * 4> columnReady;
+    bitset<STATE_COUNT> visited;
+    int16_t parent[STATE_COUNT];
+    uint8_t parentMove[STATE_COUNT];
+    uint16_t depth[STATE_COUNT];
+    // Best T-spin any rotation into a resting state makes, and that rotation.
+    // The search may first reach the state by a shift or a drop and only
+    // later find a kick into it.
+    uint8_t spinAt[STATE_COUNT];
+    int16_t spinParent[STATE_COUNT];
+    uint8_t spinMove[STATE_COUNT];
+    int16_t queue[STATE_COUNT];
+    vector<Placement> placements;
+    vector<uint32_t> footprints;
+    int piece;
+
+    static int StateIndex(int x, int y, int r)
+    {
+        return ((y - MIN_POS) * SPAN_X + (x - MIN_POS)) * 4 + r;
+    }
+
+    static_assert(SPAN_Y <= 64, "column fit masks hold one bit per row");
+
+    bool FitsSlow(int x, int y, int r) const
+    {
+        const uint8_t *mask = PIECE_MASKS.rows[piece][r];
+        for (int py = 0; py < TETROMINO_SIZE; py++)
+        {
+            if (mask[py] == 0)
+                continue;
+            int fy = y + py;
+            if (fy < 0 || fy >= FIELD_HEIGHT)
+                return false;
+            if (rows[fy] & ((uint64_t)mask[py] << (x + TETROMINO_SIZE)))
+                return false;
+        }
+        return true;
+    }
+
+    uint64_t ColumnFits(int x, int r)
+    {
+        int c = (x - MIN_POS) * 4 + r;
+        if (!columnReady[c])
+        {
+            uint64_t bits = 0;
+            for (int y = MIN_POS; y < FIELD_HEIGHT; y++)
+            {
+                if (FitsSlow(x, y, r))
+                    bits |= 1ULL << (y - MIN_POS);
+            }
+            columnFits[c] = bits;
+            columnReady[c] = true;
+        }
+        return columnFits[c];
+    }
+
+    bool Fits(int x, int y, int r)
+    {
+        return (ColumnFits(x, r) >> (y - MIN_POS)) & 1;
+    }
+
+    // Lowest row reachable by dropping straight down from y (which must fit).
+    int Landing(int x, int y, int r)
+    {
+        uint64_t blocked = ~ColumnFits(x, r) >> (y - MIN_POS);
+        return y + __builtin_ctzll(blocked) - 1;
+    }
+
+    static bool InRange(int x, int y)
+    {
+        return x >= MIN_POS && x < FIELD_WIDTH && y >= MIN_POS && y < FIELD_HEIGHT;
+    }
+
+    void Visit(int from, Move move, int x, int y, int r, int &tail)
+    {
+        if (!InRange(x, y))
+            return;
+        int s = StateIndex(x, y, r);
+        if (visited[s] || !Fits(x, y, r))
+            return;
+        visited[s] = true;
+        parent[s] = from;
+        parentMove[s] = move;
+        depth[s] = depth[from] + 1;
+        spinAt[s] = SPIN_NONE;
+        queue[tail++] = s;
+    }
+
+    void VisitRotation(int from, Move move, int x, int y, int r, int &tail)
+    {
+        int direction = move == MOVE_ROTATE ? 1 : -1;
+        int kick = KickRotate(piece, r, direction, x, y, [this](int kx, int ky, int kr)
+                              { return InRange(kx, ky) && Fits(kx, ky, kr); });
+        if (kick < 0)
+            return;
+        int to = (r + direction) & 3;
+        Visit(from, move, x, y, to, tail);
+        if (piece == PIECE_T && Landing(x, y, to) == y)
+        {
+            int s = StateIndex(x, y, to);
+            SpinType spin = ClassifySpin(piece, true, kick, BlockedCorners(rows, FIELD_HEIGHT, x, y), to);
+            if (spin > spinAt[s])
+            {
+                spinAt[s] = spin;
+                spinParent[s] = from;
+                spinMove[s] = move;
+            }
+        }
+    }
+
+public:
+    MoveGenerator()
+    {
+        placements.reserve(STATE_COUNT / 4);
+        footprints.reserve(STATE_COUNT / 4);
+    }
+
+    const vector<Placement> &Generate(const BoardT &field, int pieceIndex,
+                                      int startX, int startY, int startRotation)
+    {
+        for (int y = 0; y < FIELD_HEIGHT; y++)
+            rows[y] = field.Row(y);
+        return Search(pieceIndex, startX, startY, startRotation);
+    }
+
+private:
+    const vector<Placement> &Search(int pieceIndex, int startX, int startY, int startRotation)
+    {
+        piece = pieceIndex;
+        visited.reset();
+        columnReady.reset();
+        placements.clear();
+        footprints.clear();
+
+        startRotation &= 3;
+        if (!Fits(startX, startY, startRotation))
+            return placements;
+
+        int head = 0, tail = 0;
+        int start = StateIndex(startX, startY, startRotation);
+        visited[start] = true;
+        parent[start] = -1;
+        depth[start] = 0;
+        spinAt[start] = SPIN_NONE;
+        queue[tail++] = start;
+
+        while (head < tail)
+        {
+            int s = queue[head++];
+            int r = s & 3;
+            int cell = s >> 2;
+            int x = cell % SPAN_X + MIN_POS;
+            int y = cell / SPAN_X + MIN_POS;
+
+            int landing = Landing(x, y, r);
+            if (landing == y)
+            {
+                // Resting state: keep the first (shortest) path to each footprint,
+                // since different rotations of symmetric pieces can cover the same cells.
+                uint32_t footprint = PIECE_MASKS.shape[piece][r] |
+                                     (uint32_t)(uint8_t)(x + PIECE_MASKS.left[piece][r]) << 16 |
+                                     (uint32_t)(uint8_t)(y + PIECE_MASKS.top[piece][r]) << 24;
+                if (find(footprints.begin(), footprints.end(), footprint) == footprints.end())
+                {
+                    footprints.push_back(footprint);
+                    placements.push_back({x, y, r, depth[s], s, SPIN_NONE});
+                }
+            }
+
+            Visit(s, MOVE_LEFT, x - 1, y, r, tail);
+            Visit(s, MOVE_RIGHT, x + 1, y, r, tail);
+            VisitRotation(s, MOVE_ROTATE, x, y, r, tail);
+            VisitRotation(s, MOVE_ROTATE_CCW, x, y, r, tail);
+            Visit(s, MOVE_SOFT_DROP, x, y + 1, r, tail);
+            if (landing > y + 1)
+                Visit(s, MOVE_HARD_DROP, x, landing, r, tail);
+        }
+
+        // Every rotation into a state is known only now. A T-spin placement
+        // ends with the rotation that makes it, even if that path is longer.
+        for (Placement &placement : placements)
+        {
+            placement.spin = (SpinType)spinAt[placement.state];
+            if (placement.spin != SPIN_NONE)
+                placement.keyCount = depth[spinParent[placement.state]] + 1;
+        }
+        return placements;
+    }
+
+public:
+    // Writes the key sequence leading to a placement from the last search.
+    void GetKeys(const Placement &placement, vector<Move> &keys) const
+    {
+        keys.resize(placement.keyCount);
+        int s = placement.state;
+        int last = placement.keyCount - 1;
+        if (placement.spin != SPIN_NONE && last >= 0)
+        {
+            keys[last--] = (Move)spinMove[s];
+            s = spinParent[s];
+        }
+        for (int i = last; i >= 0; i--)
+        {
+            keys[i] = (Move)parentMove[s];
+            s = parent[s];
+        }
+    }
+};
+
+// Structure to hold score information
+struct HighScore
+{
+    string playerName;
+    int score;
+};
+
+void ClearScreen()
+{
+#ifdef _WIN32
+    system("cls");
+#else
+    clear();
+#endif
+}
+void SetCursorPosition(int x, int y)
+{
+#ifdef _WIN32
+    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+    COORD coord = {(SHORT)x, (SHORT)y};
+    SetConsoleCursorPosition(hConsole, coord);
+#else
+    printf("\033[%d;%dH", y + 1, x + 1);
+#endif
+}
+
+// Health and performance counters for running cabinets, scraped through
+// MetricsServer. The game only ever adds to them with relaxed atomic
+// increments; the server thread reads them when asked.
+class Histogram
+{
+public:
+    static const int BUCKETS = 12;
+    // Bucket upper bounds in microseconds
+    static constexpr uint32_t BOUNDS[BUCKETS] = {250,   500,   1000,  2000,   4000,   8000,
+                                                 16000, 33000, 66000, 125000, 250000, 1000000};
+
+private:
+    atomic<uint64_t> counts[BUCKETS + 1] = {};
+    atomic<uint64_t> sumMicros{0};
+
+public:
+    void Observe(uint64_t micros)
+    {
+        int bucket = 0;
+        while (bucket < BUCKETS && micros > BOUNDS[bucket])
+            bucket++;
+        counts[bucket].fetch_add(1, memory_order_relaxed);
+        sumMicros.fetch_add(micros, memory_order_relaxed);
+    }
+
+    // Appends the histogram in the Prometheus text format, in seconds.
+    void Write(string &out, const char *name, const char *help) const
+    {
+        char line[160];
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+        out += line;
+        uint64_t total = 0;
+        for (int bucket = 0; bucket <= BUCKETS; bucket++)
+        {
+            total += counts[bucket].load(memory_order_relaxed);
+            if (bucket < BUCKETS)
+                snprintf(line, sizeof(line), "%s_bucket{le=\"%g\"} %llu\n", name, BOUNDS[bucket] / 1e6,
+                         (unsigned long long)total);
+            else
+                snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)total);
+            out += line;
+        }
+        snprintf(line, sizeof(line), "%s_sum %g\n%s_count %llu\n", name,
+                 sumMicros.load(memory_order_relaxed) / 1e6, name, (unsigned long long)total);
+        out += line;
+    }
+};
+
+struct Metrics
+{
+    atomic<uint64_t> gamesStarted{0}, gamesFinished{0};
+    atomic<uint64_t> piecesLocked{0}, linesCleared{0};
+    atomic<uint64_t> soundsPlayed{0}, soundsDropped{0};
+    Histogram frameTime;    // composing and presenting one frame
+    Histogram inputLatency; // from reading a key to the frame that shows it
+
+    string Format() const
+    {
+        string out;
+        auto counter = [&out](const char *name, const char *help, const atomic<uint64_t> &value)
+        {
+            char line[160];
+            snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name,
+                     (unsigned long long)value.load(memory_order_relaxed));
+            out += line;
+        };
+        counter("tetris_games_started_total", "Games started.", gamesStarted);
+        counter("tetris_games_finished_total", "Games that ended.", gamesFinished);
+        counter("tetris_pieces_locked_total", "Pieces locked into the field.", piecesLocked);
+        counter("tetris_lines_cleared_total", "Lines cleared.", linesCleared);
+        counter("tetris_sounds_played_total", "Sound effects started.", soundsPlayed);
+        counter("tetris_sounds_dropped_total", "Sound effects that could not be played.", soundsDropped);
+        frameTime.Write(out, "tetris_frame_seconds", "Time to compose and present a frame.");
+        inputLatency.Write(out, "tetris_input_latency_seconds", "Time from reading a key to presenting the next frame.");
+        return out;
+    }
+};
+Metrics metrics;
+
+// Sound effects: Windows plays tones, other platforms play the matching
+// file through ffplay. Tools that run the game logic headless switch them
+// off with soundEnabled. An effect stays silent until the startup
+// AssetLoader has found its file and a player for it, so a missing file
+// never costs a shell per locked piece.
+enum SoundEffect
+{
+    SOUND_LOCK,
+    SOUND_LINE_CLEAR,
+    SOUND_LEVEL_UP,
+    SOUND_GAME_START,
+    SOUND_GAME_OVER,
+    SOUND_COUNTDOWN,
+    SOUND_COUNT
+};
+const char *const SOUND_FILES[SOUND_COUNT] = {"beep-07a.wav",   "beep.wav",      "beep.wav",
+                                              "game_start.mp3", "game_over.mp3", "beep-07a.wav"};
+
+struct Tone
+{
+    int frequency, millis; // a zero frequency ends the effect
+};
+const Tone SOUND_TONES[SOUND_COUNT][3] = {
+    {{420, 200}},                         // lock
+    {{2000, 500}},                        // line clear
+    {{880, 200}},                         // level up
+    {{523, 200}, {659, 200}, {784, 200}}, // game start: C, E, G
+    {},                                   // game over
+    {{800, 300}},                         // countdown
+};
+bool soundEnabled = true;
+atomic<bool> soundPlayable[SOUND_COUNT];
+
+// Plays effects one after another on its own thread, so neither a Beep,
+// which blocks for as long as its tone lasts, nor starting ffplay ever
+// holds up a frame. Effects that arrive while the queue is full are dropped
+// rather than played late. An ffplay counts as played once it exits
+// cleanly; one that fails, or could not be started, counts as dropped.
+class SoundPlayer
+{
+private:
+    static const int QUEUE_SIZE = 4;
+    SoundEffect queue[QUEUE_SIZE];
+    int head = 0, count = 0;
+    bool stopping = false;
+    mutex lock;
+    condition_variable wake;
+    thread worker;
+#ifndef _WIN32
+    vector<pid_t> children; // players still running, only touched by worker
+
+    // Collects the players that have exited.
+    void Reap()
+    {
+        for (size_t i = 0; i < children.size();)
+        {
+            int status = 0;
+            pid_t done = waitpid(children[i], &status, WNOHANG);
+            if (done == 0)
+            {
+                i++;
+                continue;
+            }
+            bool played = done == children[i] && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            (played ? metrics.soundsPlayed : metrics.soundsDropped).fetch_add(1, memory_order_relaxed);
+            children[i] = children.back();
+            children.pop_back();
+        }
+    }
+#endif
+
+    void Play(SoundEffect effect)
+    {
+#ifdef _WIN32
+        if (SOUND_TONES[effect][0].frequency == 0)
+            return;
+        for (const Tone &tone : SOUND_TONES[effect])
+        {
+            if (tone.frequency == 0)
+                break;
+            Beep(tone.frequency, tone.millis);
+        }
+        metrics.soundsPlayed.fetch_add(1, memory_order_relaxed);
+#else
+        // Away from the terminal, so the player neither reads the game's
+        // keys nor writes over the screen
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+        posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+        char *argv[] = {(char *)"ffplay", (char *)"-nodisp", (char *)"-autoexit", (char *)"-loglevel", (char *)"quiet",
+                        (char *)SOUND_FILES[effect], nullptr};
+        pid_t child;
+        int error = posix_spawnp(&child, "ffplay", &actions, nullptr, argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        if (error != 0)
+            metrics.soundsDropped.fetch_add(1, memory_order_relaxed);
+        else
+            children.push_back(child);
+#endif
+    }
+
+    void Run()
+    {
+        unique_lock<mutex> guard(lock);
+        auto ready = [this]
+        { return count > 0 || stopping; };
+        while (true)
+        {
+#ifdef _WIN32
+            wake.wait(guard, ready);
+#else
+            // Wake now and then while players run, to reap them
+            if (children.empty())
+                wake.wait(guard, ready);
+            else if (!wake.wait_for(guard, chrono::milliseconds(250), ready))
+            {
+                Reap();
+                continue;
+            }
+            Reap();
+#endif
+            if (stopping)
+                return;
+            SoundEffect effect = queue[head];
+            head = (head + 1) % QUEUE_SIZE;
+            count--;
+            guard.unlock();
+            Play(effect);
+            guard.lock();
+        }
+    }
+
+public:
+    // Queues an effect; false if the queue was full.
+    bool Post(SoundEffect effect)
+    {
+        lock_guard<mutex> guard(lock);
+        if (!worker.joinable())
+            worker = thread(&SoundPlayer::Run, this);
+        if (count == QUEUE_SIZE)
+            return false;
+        queue[(head + count++) % QUEUE_SIZE] = effect;
+        wake.notify_one();
+        return true;
+    }
+
+    ~SoundPlayer()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        if (worker.joinable())
+            worker.join();
+#ifndef _WIN32
+        Reap(); // players still running finish on their own
+#endif
+    }
+};
+SoundPlayer soundPlayer;
+
+void PlaySoundEffect(SoundEffect effect)
+{
+    if (!soundEnabled)
+        return;
+    if (!soundPlayable[effect].load(memory_order_relaxed) || !soundPlayer.Post(effect))
+        metrics.soundsDropped.fetch_add(1, memory_order_relaxed);
+}
+
+// A number on the side panel, kept as text padded to a fixed width. It is
+// only formatted again when the value changes, and the padding covers
+// whatever longer number was there before.
+template <int Width>
+class HudNumber
+{
+private:
+    int value = INT_MIN;
+    char text[Width + 1] = {};
+
+public:
+    // The value after prefix, which should be the same on every call.
+    const char *Format(const char *prefix, int newValue)
+    {
+        if (newValue != value)
+        {
+            value = newValue;
+            size_t length = min(strlen(prefix), size_t(Width));
+            memcpy(text, prefix, length);
+            to_chars_result result = to_chars(text + length, text + Width, newValue);
+            char *end = result.ec == errc() ? result.ptr : text + length;
+            memset(end, ' ', text + Width - end);
+            text[Width] = '\0';
+        }
+        return text;
+    }
+};
+
+#ifdef _WIN32
+class ConsoleBuffer
+{
+private:
+    HANDLE hConsole;
+    CHAR_INFO *buffer;
+    COORD bufferSize;
+    COORD bufferCoord;
+    SMALL_RECT writeRegion;
+    vector<vector<bool>> dirtyCells;
+
+public:
+    ConsoleBuffer(int width, int height) : bufferSize({(SHORT)width, (SHORT)height}),
+                                           dirtyCells(height, vector<bool>(width, true))
+    {
+        hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+        bufferCoord = {0, 0};
+        writeRegion = {0, 0, (SHORT)(width - 1), (SHORT)(height - 1)};
+        buffer = new CHAR_INFO[width * height];
+        Clear();
+    }
+
+    ~ConsoleBuffer()
+    {
+        delete[] buffer;
+    }
+
+    void Clear(char fillChar = ' ', WORD attributes = 0)
+    {
+        for (int i = 0; i < bufferSize.X * bufferSize.Y; i++)
+        {
+            buffer[i].Char.UnicodeChar = fillChar;
+            buffer[i].Attributes = attributes;
+        }
+        // Mark all cells as dirty
+        for (auto &row : dirtyCells)
+        {
+            fill(row.begin(), row.end(), true);
+        }
+    }
+
+    void Write(int x, int y, const char *text, WORD attributes)
+    {
+        for (int i = 0; text[i] != '\0'; i++)
+        {
+            if (x + i < bufferSize.X && y < bufferSize.Y)
+            {
+                int index = y * bufferSize.X + x + i;
+                buffer[index].Char.UnicodeChar = text[i];
+                buffer[index].Attributes = attributes;
+                dirtyCells[y][x + i] = true;
+            }
+        }
+    }
+
+    void Fill(int x, int y, int width, int height, char fillChar, WORD attributes)
+    {
+        for (int i = y; i < y + height && i < bufferSize.Y; i++)
+        {
+            for (int j = x; j < x + width && j < bufferSize.X; j++)
+            {
+                int index = i * bufferSize.X + j;
+                buffer[index].Char.UnicodeChar = fillChar;
+                buffer[index].Attributes = attributes;
+                dirtyCells[i][j] = true;
+            }
+        }
+    }
+
+    void Draw()
+    {
+        // Simple implementation - could be optimized further
+        // by writing only the dirty regions
+
+        // For now, we'll just write the entire buffer
+        WriteConsoleOutput(hConsole, buffer, bufferSize, bufferCoord, &writeRegion);
+
+        // Clear dirty flags
+        for (auto &row : dirtyCells)
+        {
+            fill(row.begin(), row.end(), false);
+        }
+    }
+};
+#endif
+
+// Colours a screen cell can take. 1-7 are the piece colours (piece index + 1)
+// and SCREEN_WALL matches the wall value stored in the field.
+enum ScreenColor : uint8_t
+{
+    SCREEN_TEXT = 0,
+    SCREEN_WALL = 8,
+    SCREEN_GHOST = 9,
+    SCREEN_TITLE = 15
+};
+
+#ifndef _WIN32
+// ncurses colour pairs matching ScreenColor.
+void InitColorPairs()
+{
+    init_pair(1, COLOR_BLACK, COLOR_CYAN);    // I
+    init_pair(2, COLOR_BLACK, COLOR_BLUE);    // J
+    init_pair(3, COLOR_BLACK, 208);           // L (using yellow for orange)
+    init_pair(4, COLOR_BLACK, COLOR_YELLOW);  // O
+    init_pair(5, COLOR_BLACK, COLOR_GREEN);   // S
+    init_pair(6, COLOR_BLACK, COLOR_MAGENTA); // T
+    init_pair(7, COLOR_BLACK, COLOR_RED);     // Z
+    init_pair(8, COLOR_RED, COLOR_WHITE);     // Border
+    init_pair(9, COLOR_WHITE, COLOR_BLACK);   // Ghost piece
+    init_pair(15, COLOR_CYAN, COLOR_BLACK);   // Titles
+}
+#endif
+
+// Glyphs for one field cell (two screen columns). The ncurses and ANSI
+// renderers colour the background; the Windows console draws brackets.
+const char GHOST_TEXT[] = "::";
+#ifdef _WIN32
+const char BLOCK_TEXT[] = "[]", WALL_TEXT[] = "##";
+#else
+const char BLOCK_TEXT[] = "  ", WALL_TEXT[] = "  ";
+#endif
+
+// Banner for the last T-spin, by [mini][lines cleared]
+const char *const SPIN_TEXT[2][4] = {{"T-SPIN", "T-SPIN SINGLE", "T-SPIN DOUBLE", "T-SPIN TRIPLE"},
+                                     {"MINI T-SPIN", "MINI T-SPIN 1", "MINI T-SPIN 2", "MINI T-SPIN 3"}};
+
+struct ScreenCell
+{
+    char ch;
+    uint8_t color;
+    bool bold;
+
+    bool operator==(const ScreenCell &other) const
+    {
+        return ch == other.ch && color == other.color && bold == other.bold;
+    }
+    bool operator!=(const ScreenCell &other) const { return !(*this == other); }
+};
+
+// A frame composed by Tetris::Draw, independent of where it is shown. The
+// storage is allocated once, so composing frames never touches the heap.
+// Writes only count as changes when a cell really changes, so a frame drawn
+// over itself with the same content keeps its revision and backends can skip
+// presenting it again.
+class FrameBuffer
+{
+private:
+    int width, height;
+    vector<ScreenCell> cells;
+    uint64_t generation = 0, revision = 0;
+
+    static uint64_t NextGeneration()
+    {
+        static atomic<uint64_t> next(0);
+        return ++next;
+    }
+
+    void Set(int index, ScreenCell cell)
+    {
+        if (cells[index] != cell)
+        {
+            cells[index] = cell;
+            revision++;
+        }
+    }
+
+public:
+    FrameBuffer(int frameWidth, int frameHeight)
+        : width(frameWidth), height(frameHeight), cells(frameWidth * frameHeight)
+    {
+        Clear();
+    }
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+    const ScreenCell &At(int x, int y) const { return cells[y * width + x]; }
+
+    // Unique to each clear, so whoever drew into the frame can tell whether
+    // what they drew is still there.
+    uint64_t Generation() const { return generation; }
+    // Goes up whenever a cell changes.
+    uint64_t Revision() const { return revision; }
+
+    void Clear()
+    {
+        fill(cells.begin(), cells.end(), ScreenCell{' ', SCREEN_TEXT, false});
+        generation = NextGeneration();
+        revision++;
+    }
+
+    void Write(int x, int y, const char *text, uint8_t color, bool bold = false)
+    {
+        if (y < 0 || y >= height)
+            return;
+        for (int i = 0; text[i] != '\0'; i++)
+        {
+            if (x + i >= 0 && x + i < width)
+                Set(y * width + x + i, {text[i], color, bold});
+        }
+    }
+
+    // Copies count cells into row y starting at x.
+    void WriteCells(int x, int y, const ScreenCell *row, int count)
+    {
+        if (y < 0 || y >= height)
+            return;
+        for (int i = max(-x, 0); i < count && x + i < width; i++)
+            Set(y * width + x + i, row[i]);
+    }
+
+    void Fill(int x, int y, int fillWidth, int fillHeight, char fillChar, uint8_t color)
+    {
+        for (int i = max(y, 0); i < y + fillHeight && i < height; i++)
+        {
+            for (int j = max(x, 0); j < x + fillWidth && j < width; j++)
+                Set(i * width + j, {fillChar, color, false});
+        }
+    }
+
+    // Copies another frame in with its top left corner at (x, y).
+    void Blit(const FrameBuffer &source, int x, int y)
+    {
+        for (int i = max(y, 0); i < y + source.height && i < height; i++)
+        {
+            for (int j = max(x, 0); j < x + source.width && j < width; j++)
+                Set(i * width + j, source.At(j - x, i - y));
+        }
+    }
+};
+
+// Somewhere to show composed frames: a terminal, a console or memory.
+class RenderBackend
+{
+protected:
+    // The frame last presented and its revision then; presenting it again
+    // unchanged has nothing to do.
+    const FrameBuffer *shownFrame = nullptr;
+    uint64_t shownRevision = 0;
+
+    bool AlreadyShown(const FrameBuffer &frame) const
+    {
+        return &frame == shownFrame && frame.Revision() == shownRevision;
+    }
+    void Shown(const FrameBuffer &frame)
+    {
+        shownFrame = &frame;
+        shownRevision = frame.Revision();
+    }
+
+public:
+    virtual ~RenderBackend() {}
+    virtual void Present(const FrameBuffer &frame) = 0;
+};
+
+// Keeps a copy of the last frame so it can be inspected or compared against
+// a golden file without a terminal.
+class MemoryBackend : public RenderBackend
+{
+private:
+    FrameBuffer last;
+
+public:
+    MemoryBackend(int width, int height) : last(width, height) {}
+
+    void Present(const FrameBuffer &frame) override { last = frame; }
+
+    // One line per screen row. Coloured blank cells show the piece letter,
+    // or '#' for walls, so block positions are visible in plain text.
+    string ToText() const
+    {
+        string text;
+        for (int y = 0; y < last.Height(); y++)
+        {
+            string line;
+            for (int x = 0; x < last.Width(); x++)
+            {
+                const ScreenCell &cell = last.At(x, y);
+                char ch = cell.ch;
+                if (ch == ' ' && cell.color >= 1 && cell.color <= 7)
+                    ch = PIECE_NAMES[cell.color - 1];
+                else if (ch == ' ' && cell.color == SCREEN_WALL)
+                    ch = '#';
+                line += ch;
+            }
+            while (!line.empty() && line.back() == ' ')
+                line.pop_back();
+            text += line + "\n";
+        }
+        return text;
+    }
+};
+
+// Emits ANSI escape sequences for the cells that changed since the previous
+// frame, moving the cursor only across gaps and changing attributes only
+// when they differ. Output goes to a file descriptor, or just accumulates in
+// Output() when the descriptor is negative (benchmarks).
+class AnsiBackend : public RenderBackend
+{
+private:
+    FrameBuffer previous;
+    string output;
+    int fd;
+    bool hasPrevious = false;
+
+    void AppendAttributes(const ScreenCell &cell)
+    {
+        static const char *const colors[] = {
+            "", ";30;46", ";30;44", ";30;48;5;208", ";30;43", ";30;42", ";30;45", ";30;41", ";31;47", ";37"};
+        char sgr[32];
+        const char *color = cell.color <= SCREEN_GHOST ? colors[cell.color] : ";36";
+        snprintf(sgr, sizeof(sgr), "\033[0%s%sm", cell.bold ? ";1" : "", color);
+        output += sgr;
+    }
+
+public:
+    AnsiBackend(int width, int height, int outputFd)
+        : previous(width, height), fd(outputFd)
+    {
+        output.reserve(size_t(width) * height * 24);
+    }
+
+    const string &Output() const { return output; }
+    void Invalidate()
+    {
+        hasPrevious = false;
+        shownFrame = nullptr;
+    }
+
+    void Present(const FrameBuffer &frame) override
+    {
+        output.clear();
+        if (AlreadyShown(frame))
+            return;
+        int cursorX = -1, cursorY = -1;
+        ScreenCell attributes{0, 255, false};
+        for (int y = 0; y < frame.Height(); y++)
+        {
+            for (int x = 0; x < frame.Width(); x++)
+            {
+                const ScreenCell &cell = frame.At(x, y);
+                if (hasPrevious && cell == previous.At(x, y))
+                    continue;
+                if (x != cursorX || y != cursorY)
+                {
+                    char move[32];
+                    snprintf(move, sizeof(move), "\033[%d;%dH", y + 1, x + 1);
+                    output += move;
+                }
+                if (cell.color != attributes.color || cell.bold != attributes.bold)
+                {
+                    AppendAttributes(cell);
+                    attributes = cell;
+                }
+                output += cell.ch;
+                cursorX = x + 1;
+                cursorY = y;
+            }
+        }
+        if (!output.empty())
+            output += "\033[0m";
+        previous = frame;
+        hasPrevious = true;
+        Shown(frame);
+
+#ifndef _WIN32
+        if (fd >= 0 && !output.empty() && write(fd, output.data(), output.size()) < 0)
+            fd = -1;
+#endif
+    }
+};
+
+#ifdef _WIN32
+// Copies changed cells into the console buffer, which writes the whole
+// frame with one WriteConsoleOutput call.
+class ConsoleBackend : public RenderBackend
+{
+private:
+    ConsoleBuffer screenBuffer;
+    FrameBuffer previous;
+    bool hasPrevious = false;
+
+public:
+    ConsoleBackend(int width, int height) : screenBuffer(width, height), previous(width, height) {}
+
+    void Invalidate()
+    {
+        hasPrevious = false;
+        shownFrame = nullptr;
+    }
+
+    void Present(const FrameBuffer &frame) override
+    {
+        if (AlreadyShown(frame))
+            return; // not even a WriteConsoleOutput call
+        for (int y = 0; y < frame.Height(); y++)
+        {
+            for (int x = 0; x < frame.Width(); x++)
+            {
+                const ScreenCell &cell = frame.At(x, y);
+                if (hasPrevious && cell == previous.At(x, y))
+                    continue;
+                char text[2] = {cell.ch, '\0'};
+                WORD attributes = 7;
+                if (cell.color >= 1 && cell.color <= 7)
+                    attributes = cell.color + 8;
+                else if (cell.color == SCREEN_GHOST)
+                    attributes = 8; // dark grey
+                else if (cell.color != SCREEN_TEXT || cell.bold)
+                    attributes = 15;
+                screenBuffer.Write(x, y, text, attributes);
+            }
+        }
+        previous = frame;
+        hasPrevious = true;
+        Shown(frame);
+        screenBuffer.Draw();
+    }
+};
+#else
+// Where a frame sits on the terminal: centred when the terminal has room,
+// pinned to the top left otherwise, with whatever does not fit cut off.
+struct Layout
+{
+    int originX = 0, originY = 0;
+    int visibleWidth = 0, visibleHeight = 0; // part of the frame on screen
+
+    static Layout Place(int frameWidth, int frameHeight, int columns, int lines)
+    {
+        Layout layout;
+        layout.originX = max((columns - frameWidth) / 2, 0);
+        layout.originY = max((lines - frameHeight) / 2, 0);
+        layout.visibleWidth = max(min(frameWidth, columns - layout.originX), 0);
+        layout.visibleHeight = max(min(frameHeight, lines - layout.originY), 0);
+        return layout;
+    }
+};
+
+// Sends changed cells to ncurses, which keeps its own copy of the screen and
+// emits the minimal update on refresh().
+class CursesBackend : public RenderBackend
+{
+private:
+    FrameBuffer previous;
+    bool hasPrevious = false;
+    Layout layout;
+
+    // Makes the next Present send these cells again.
+    void Invalidate(int x, int y, int width, int height) { previous.Fill(x, y, width, height, '\0', 255); }
+
+public:
+    CursesBackend(int width, int height) : previous(width, height)
+    {
+        layout = Layout::Place(width, height, COLS, LINES);
+    }
+
+    void Invalidate()
+    {
+        hasPrevious = false;
+        shownFrame = nullptr;
+    }
+
+    // Follows the terminal to a new size after KEY_RESIZE; ncurses has
+    // already resized its own screen. If the frame stays put, only the
+    // cells that have just come into view are sent again; if it moves, the
+    // old copy is wiped and all of it is.
+    void Resize(int columns, int lines)
+    {
+        Layout next = Layout::Place(previous.Width(), previous.Height(), columns, lines);
+        if (next.originX != layout.originX || next.originY != layout.originY)
+        {
+            erase();
+            hasPrevious = false;
+        }
+        else
+        {
+            Invalidate(layout.visibleWidth, 0, previous.Width(), previous.Height());
+            Invalidate(0, layout.visibleHeight, previous.Width(), previous.Height());
+        }
+        layout = next;
+        shownFrame = nullptr;
+        clearok(curscr, TRUE); // the terminal may have mangled what it showed
+    }
+
+    void Present(const FrameBuffer &frame) override
+    {
+        if (AlreadyShown(frame))
+            return;
+        for (int y = 0; y < layout.visibleHeight; y++)
+        {
+            for (int x = 0; x < layout.visibleWidth; x++)
+            {
+                const ScreenCell &cell = frame.At(x, y);
+                if (hasPrevious && cell == previous.At(x, y))
+                    continue;
+                attrset(COLOR_PAIR(cell.color) | (cell.bold ? A_BOLD : A_NORMAL));
+                mvaddch(layout.originY + y, layout.originX + x, cell.ch);
+            }
+        }
+        attrset(A_NORMAL);
+        previous = frame;
+        hasPrevious = true;
+        Shown(frame);
+        refresh();
+    }
+};
+#endif
+
+void ShowGameInstructions()
+{
+    ClearScreen();
+
+#ifdef _WIN32
+    // Windows version using console API
+    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+    CONSOLE_SCREEN_BUFFER_INFO csbi;
+    GetConsoleScreenBufferInfo(hConsole, &csbi);
+    int consoleWidth = csbi.srWindow.Right - csbi.srWindow.Left + 1;
+    int consoleHeight = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+
+    // Game Title
+    SetConsoleTextAttribute(hConsole, FOREGROUND_BLUE | FOREGROUND_GREEN | FOREGROUND_INTENSITY);
+    cout << string(consoleWidth / 2 - 10, ' ') << "     TETRIS GAME    \n\n";
+
+    // Instruction box
+    SetConsoleTextAttribute(hConsole, FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_INTENSITY);
+    cout << string(consoleWidth / 2 - 20, ' ') << "                HOW TO PLAY                 \n";
+
+    // Instruction lines
+    static const char *const instructions[] = {
+        "  - Arrange the falling blocks to complete lines",
+        "  - Complete lines to earn points and level up",
+        "  - The game speeds up as you progress levels",
+        "  - Game ends when blocks reach the top",
+        "",
+        "  CONTROLS:",
+        "  LEFT_ARROW, RIGHT_ARROW : Move block left/right",
+        "  UP_ARROW, X : Rotate block clockwise",
+        "  Z : Rotate block counter-clockwise",
+        "  DOWN_ARROW : Soft drop (move down faster)",
+        "  SPACE: Hard drop (instant drop)",
+        "  S : Pause game",
+        "  Ctrl + C : Quit game"};
+
+    for (const char *line : instructions)
+    {
+        cout << string(consoleWidth / 2 - 20, ' ') << line << "\n";
+    }
+
+    // Prompt to continue
+    SetConsoleTextAttribute(hConsole, FOREGROUND_GREEN | FOREGROUND_INTENSITY);
+    cout << "\n"
+         << string(consoleWidth / 2 - 15, ' ')
+         << "Press any key to return to the game...";
+
+    _getch();                                            // Wait for any key press
+    SetConsoleTextAttribute(hConsole, csbi.wAttributes); // Restore original colors
+
+#else
+    // Linux version using ncurses, on the screen main() set up
+    init_pair(15, COLOR_CYAN, COLOR_BLACK);
+    init_pair(16, COLOR_YELLOW, COLOR_BLACK);
+    init_pair(17, COLOR_GREEN, COLOR_BLACK);
+
+    // Redrawn for the new size whenever the terminal is resized
+    nodelay(stdscr, FALSE);
+    do
+    {
+        clear();
+
+        // Game Title
+        attron(COLOR_PAIR(15) | A_BOLD);
+        mvprintw(2, COLS / 2 - 10, "     TETRIS GAME    ");
+        attroff(COLOR_PAIR(15) | A_BOLD);
+
+        // Instruction box
+        attron(COLOR_PAIR(16));
+        mvprintw(7, COLS / 2 - 20, "                HOW TO PLAY                 ");
+
+        // Instruction lines
+        static const char *const instructions[] = {
+            "  - Arrange the falling blocks to complete lines",
+            "  - Complete lines to earn points and level up",
+            "  - The game speeds up as you progress levels",
+            "  - Game ends when blocks reach the top",
+            "",
+            "  CONTROLS:",
+            "  LEFT_KEY, RIGHT_KEY : Move block left/right",
+            "  UP_KEY, X : Rotate block clockwise",
+            "  Z : Rotate block counter-clockwise",
+            "  DOWN_KEY : Soft drop (move down faster)",
+            "  SPACE: Hard drop (instant drop)",
+            "  S : Pause game",
+            "  Ctrl+C : Quit game"};
+
+        for (size_t i = 0; i < sizeof(instructions) / sizeof(instructions[0]); i++)
+        {
+            mvprintw(9 + i, COLS / 2 - 20, "%-42s", instructions[i]);
+        }
+
+        // Prompt to continue
+        attron(COLOR_PAIR(17) | A_BOLD);
+        mvprintw(LINES - 4, COLS / 2 - 15, "Press any key to return to the game...");
+        attroff(COLOR_PAIR(17) | A_BOLD);
+
+        refresh();
+    } while (getch() == KEY_RESIZE);
+    nodelay(stdscr, TRUE);
+    clear();
+#endif
+}
+
+// Function to read high scores from file
+vector<HighScore> readHighScores()
+{
+    vector<HighScore> scores;
+    ifstream file("Score.txt");
+
+    if (file.is_open())
+    {
+        HighScore temp;
+        while (file >> temp.playerName >> temp.score)
+        {
+            scores.push_back(temp);
+        }
+        file.close();
+    }
+
+    // Sort in descending order
+    sort(scores.begin(), scores.end(), [](const HighScore &a, const HighScore &b)
+         { return a.score > b.score; });
+
+    return scores;
+}
+
+// Function to save high scores to file
+void saveHighScores(const vector<HighScore> &scores)
+{
+    ofstream file("Score.txt");
+
+    if (file.is_open())
+    {
+        for (const auto &score : scores)
+        {
+            file << score.playerName << " " << score.score << "\n";
+        }
+        file.close();
+    }
+}
+
+// Function to update high scores
+void updateHighScores(int newScore)
+{
+    vector<HighScore> scores = readHighScores();
+
+    // If we have less than 5 scores or new score is better than the worst in top 5
+    if (scores.size() < 5 || newScore > scores.back().score)
+    {
+        HighScore newEntry;
+
+        // Get player name (you can modify this for your game's input method)
+
+        cout << "\033[33m"
+                "Congratulations! You made it to the top 5!\n"
+             << "\033[0m";
+        cout << "\033[31m"
+                "Enter your name: "
+             << "\033[0m";
+        cin >> newEntry.playerName;
+        newEntry.score = newScore;
+
+        scores.push_back(newEntry);
+
+        // Sort and keep only top 5
+        sort(scores.begin(), scores.end(), [](const HighScore &a, const HighScore &b)
+             { return a.score > b.score; });
+
+        if (scores.size() > 5)
+        {
+            scores.resize(5);
+        }
+
+        saveHighScores(scores);
+    }
+}
+
+// Function to display high scores
+void displayHighScores()
+{
+    vector<HighScore> scores = readHighScores();
+
+    cout << "\033[36m"
+            "\n===== HIGH SCORES =====\n"
+         << "\033[0m";
+    if (scores.empty())
+    {
+        cout << "No high scores yet!\n";
+    }
+    else
+    {
+        for (size_t i = 0; i < scores.size(); ++i)
+        {
+            cout << "\033[33m" << i + 1 << ". " << scores[i].playerName << " - " << "\033[0m" << scores[i].score << "\n";
+        }
+    }
+    cout << "\033[36m"
+            "======================\n\n"
+         << "\033[0m";
+}
+
+#ifndef _WIN32
+// Whether an executable of this name is on the PATH.
+bool FindOnPath(const char *program)
+{
+    const char *path = getenv("PATH");
+    if (!path)
+        return false;
+    string dir;
+    for (const char *p = path;; p++)
+    {
+        if (*p == ':' || *p == '\0')
+        {
+            string candidate = (dir.empty() ? string(".") : dir) + "/" + program;
+            if (access(candidate.c_str(), X_OK) == 0)
+                return true;
+            dir.clear();
+            if (*p == '\0')
+                return false;
+        }
+        else
+        {
+            dir += *p;
+        }
+    }
+}
+#endif
+
+// Loads what the game needs from disk on a background thread, so the intro
+// screens, or with --quick the first frame, never wait on it: the high
+// score table, and which sound effects can be played. Reading each sound
+// file once also leaves it in the page cache for the player.
+class AssetLoader
+{
+private:
+    vector<HighScore> highScores;
+    thread worker;
+
+    void Load()
+    {
+        highScores = readHighScores();
+#ifdef _WIN32
+        for (auto &playable : soundPlayable)
+            playable.store(true, memory_order_relaxed);
+#else
+        bool player = FindOnPath("ffplay");
+        char buffer[4096];
+        for (int s = 0; s < SOUND_COUNT && player; s++)
+        {
+            FILE *file = fopen(SOUND_FILES[s], "rb");
+            if (!file)
+                continue;
+            while (fread(buffer, 1, sizeof(buffer), file) == sizeof(buffer))
+            {
+            }
+            fclose(file);
+            soundPlayable[s].store(true, memory_order_relaxed);
+        }
+#endif
+    }
+
+public:
+    void Start() { worker = thread(&AssetLoader::Load, this); }
+
+    // The high score table, once loading has finished.
+    const vector<HighScore> &HighScores()
+    {
+        if (worker.joinable())
+            worker.join();
+        return highScores;
+    }
+
+    ~AssetLoader()
+    {
+        if (worker.joinable())
+            worker.join();
+    }
+};
+
+void ShowCountdownAnimation()
+{
+#ifdef _WIN32
+    // Windows version
+    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+    CONSOLE_SCREEN_BUFFER_INFO csbi;
+    GetConsoleScreenBufferInfo(hConsole, &csbi);
+
+    int startX = csbi.srWindow.Right / 2;
+    int startY = csbi.srWindow.Bottom / 2;
+
+    // Hide cursor
+    CONSOLE_CURSOR_INFO cursorInfo;
+    GetConsoleCursorInfo(hConsole, &cursorInfo);
+    cursorInfo.bVisible = false;
+    SetConsoleCursorInfo(hConsole, &cursorInfo);
+
+    for (int i = 3; i > 0; i--)
+    {
+        ClearScreen();
+        SetConsoleTextAttribute(hConsole, FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_INTENSITY);
+        COORD coord = {(SHORT)startX, (SHORT)startY};
+        SetConsoleCursorPosition(hConsole, coord);
+        PlaySoundEffect(SOUND_COUNTDOWN);
+        cout << i;
+        Sleep((1000));
+    }
+
+    ClearScreen();
+    SetConsoleTextAttribute(hConsole, FOREGROUND_GREEN | FOREGROUND_INTENSITY);
+    COORD coord = {(SHORT)(startX - 5), (SHORT)startY};
+    SetConsoleCursorPosition(hConsole, coord);
+    cout << "Game Start!";
+    Sleep((1000));
+    ClearScreen();
+
+    // Restore cursor
+    SetConsoleCursorInfo(hConsole, &cursorInfo);
+    SetConsoleTextAttribute(hConsole, csbi.wAttributes);
+
+#else
+    // Linux version (using ncurses)
+    // Pairs of its own, so the game's colours survive the countdown
+    init_pair(10, COLOR_YELLOW, COLOR_BLACK);
+    init_pair(12, COLOR_GREEN, COLOR_BLACK);
+
+    // Centred afresh every step, in case the terminal was resized
+    for (int i = 3; i > 0; i--)
+    {
+        clear();
+        attron(COLOR_PAIR(10) | A_BOLD);
+        mvprintw(LINES / 2, COLS / 2, "%d", i);
+        attroff(COLOR_PAIR(10) | A_BOLD);
+        refresh();
+        this_thread::sleep_for(chrono::milliseconds(1000));
+    }
+
+    clear();
+    attron(COLOR_PAIR(12) | A_BOLD);
+    mvprintw(LINES / 2, COLS / 2 - 5, "Game Start!");
+    attroff(COLOR_PAIR(12) | A_BOLD);
+    refresh();
+    this_thread::sleep_for(chrono::milliseconds(1000));
+    clear();
+#endif
+}
+
+void ShowGameOverAnimation()
+{
+#ifdef _WIN32
+    // Windows version
+    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+    CONSOLE_SCREEN_BUFFER_INFO csbi;
+    GetConsoleScreenBufferInfo(hConsole, &csbi);
+
+    int startX = (csbi.srWindow.Right / 2) - 5;
+    int startY = csbi.srWindow.Bottom / 2;
+
+    // Hide cursor
+    CONSOLE_CURSOR_INFO cursorInfo;
+    GetConsoleCursorInfo(hConsole, &cursorInfo);
+    cursorInfo.bVisible = false;
+    SetConsoleCursorInfo(hConsole, &cursorInfo);
+
+    const char *gameOverText = "GAME OVER";
+
+    for (int i = 0; i < 5; i++)
+    {
+        ClearScreen();
+        SetConsoleTextAttribute(hConsole, FOREGROUND_RED | FOREGROUND_INTENSITY);
+
+        COORD coord = {(SHORT)startX, (SHORT)startY};
+        SetConsoleCursorPosition(hConsole, coord);
+
+        // Windows doesn't have direct blink, so we'll simulate it
+        if (i % 2 == 0)
+        {
+            cout << gameOverText;
+        }
+        else
+        {
+            // Just move cursor to same position without printing
+            SetConsoleCursorPosition(hConsole, coord);
+        }
+
+        Sleep(400);
+    }
+
+    // Final display
+    SetConsoleCursorPosition(hConsole, {(SHORT)startX, (SHORT)startY});
+    cout << gameOverText;
+    Sleep((1000));
+
+    // Restore cursor and colors
+    SetConsoleCursorInfo(hConsole, &cursorInfo);
+    SetConsoleTextAttribute(hConsole, csbi.wAttributes);
+
+#else
+    // Linux version (using ncurses)
+    init_pair(11, COLOR_RED, COLOR_BLACK);
+
+    const char *gameOverText = "GAME OVER";
+    PlaySoundEffect(SOUND_GAME_OVER);
+    for (int i = 0; i < 5; i++)
+    {
+        clear();
+        attron(COLOR_PAIR(11) | A_BOLD);
+        if (i % 2 == 0)
+            attron(A_BLINK);
+        mvprintw(LINES / 2, COLS / 2 - 5, "%s", gameOverText);
+        attroff(A_BLINK);
+        refresh();
+        this_thread::sleep_for(chrono::milliseconds(400));
+    }
+
+    this_thread::sleep_for(chrono::milliseconds(1000));
+#endif
+}
+
+// Maps a key from the keyboard to a game control; false for other keys.
+bool KeyToMove(int ch, Move &move)
+{
+    switch (ch)
+    {
+#ifdef _WIN32
+    case 75: // Left arrow
+#else
+    case KEY_LEFT:
+#endif
+        move = MOVE_LEFT;
+        return true;
+#ifdef _WIN32
+    case 77: // Right arrow
+#else
+    case KEY_RIGHT:
+#endif
+        move = MOVE_RIGHT;
+        return true;
+#ifdef _WIN32
+    case 72: // Up arrow
+#else
+    case KEY_UP:
+#endif
+    case 'x':
+    case 'X':
+        move = MOVE_ROTATE;
+        return true;
+    case 'z':
+    case 'Z':
+        move = MOVE_ROTATE_CCW;
+        return true;
+#ifdef _WIN32
+    case 80: // Down arrow
+#else
+    case KEY_DOWN:
+#endif
+        move = MOVE_SOFT_DROP;
+        return true;
+    case ' ':
+        move = MOVE_HARD_DROP;
+        return true;
+    case 'c':
+    case 'C':
+        move = MOVE_HOLD;
+        return true;
+    }
+    return false;
+}
+
+// A key from the keyboard: a press, or the terminal repeating a held key,
+// or on a console that reports them, a release. Key codes are the ones
+// KeyToMove takes.
+struct InputEvent
+{
+    int key;
+    bool released;
+};
+
+#ifdef _WIN32
+const bool CONSOLE_REPORTS_RELEASES = true;
+#else
+const bool CONSOLE_REPORTS_RELEASES = false;
+#endif
+
+// Keys read since the last frame, in the order they came. A full queue
+// drops new keys.
+class InputQueue
+{
+private:
+    static const int CAPACITY = 64;
+    InputEvent events[CAPACITY];
+    int head = 0, count = 0;
+
+public:
+    void Push(int key, bool released = false)
+    {
+        if (count < CAPACITY)
+            events[(head + count++) % CAPACITY] = {key, released};
+    }
+
+    bool Pop(InputEvent &event)
+    {
+        if (count == 0)
+            return false;
+        event = events[head];
+        head = (head + 1) % CAPACITY;
+        count--;
+        return true;
+    }
+};
+
+// Moves whatever the keyboard has sent into the queue, without waiting.
+// Linux reads ncurses keys; Windows reads the console's key records, which
+// carry releases too, and treats losing focus as letting go of the keys
+// that repeat.
+void ReadKeys(InputQueue &queue)
+{
+#ifdef _WIN32
+    HANDLE console = GetStdHandle(STD_INPUT_HANDLE);
+    INPUT_RECORD records[32];
+    DWORD waiting = 0, read = 0;
+    while (GetNumberOfConsoleInputEvents(console, &waiting) && waiting > 0 &&
+           ReadConsoleInputA(console, records, min<DWORD>(waiting, 32), &read) && read > 0)
+    {
+        for (DWORD i = 0; i < read; i++)
+        {
+            if (records[i].EventType == FOCUS_EVENT && !records[i].Event.FocusEvent.bSetFocus)
+            {
+                for (int key : {75, 77, 80})
+                    queue.Push(key, true);
+            }
+            if (records[i].EventType != KEY_EVENT)
+                continue;
+            const KEY_EVENT_RECORD &record = records[i].Event.KeyEvent;
+            // Arrows keep the codes _getch gives them after its 224 prefix
+            int key;
+            switch (record.wVirtualKeyCode)
+            {
+            case VK_LEFT:
+                key = 75;
+                break;
+            case VK_RIGHT:
+                key = 77;
+                break;
+            case VK_UP:
+                key = 72;
+                break;
+            case VK_DOWN:
+                key = 80;
+                break;
+            default:
+                key = (unsigned char)record.uChar.AsciiChar;
+                break;
+            }
+            if (key == 0)
+                continue; // Shift, Ctrl and other keys without a character
+            if (!record.bKeyDown)
+                queue.Push(key, true);
+            for (int repeat = 0; record.bKeyDown && repeat < max<int>(record.wRepeatCount, 1); repeat++)
+                queue.Push(key);
+        }
+    }
+#else
+    int ch;
+    while ((ch = getch()) != ERR)
+        queue.Push(ch);
+#endif
+}
+
+// Delayed auto shift for the keyboard. Turns key events into at most one
+// move per tick, so input advances with the simulation and the moves per
+// tick replay a game exactly. A shift moves on the press, again after das
+// ticks and then every arr ticks while held; soft drop repeats at the rate
+// the game gives; other keys act once per event. A terminal only reports a
+// held key through its own key repeat, so a key that has sent nothing for
+// RELEASE_TICKS counts as released, and the first repeat after the
+// terminal's delay starts a new press. A console that reports releases
+// holds a key down until its release instead.
+class AutoRepeat
+{
+public:
+    static const int RELEASE_TICKS = 8;
+    static const int QUEUE_SIZE = 8; // presses that can wait for their tick
+
+private:
+    struct Key
+    {
+        bool down;
+        int heldTicks, idleTicks;
+    };
+    Key keys[MOVE_HOLD + 1];
+    Move presses[QUEUE_SIZE]; // waiting for their tick
+    int pressCount;
+    int das, arr;
+    bool releases;  // the console reports key releases
+    Move lastShift; // direction pressed most recently
+
+    static bool Repeats(Move move)
+    {
+        return move == MOVE_LEFT || move == MOVE_RIGHT || move == MOVE_SOFT_DROP;
+    }
+
+public:
+    AutoRepeat(int dasTicks, int arrTicks, bool reportsReleases = CONSOLE_REPORTS_RELEASES)
+        : das(max(dasTicks, 0)), arr(max(arrTicks, 1)), releases(reportsReleases)
+    {
+        Clear();
+    }
+
+    void Clear()
+    {
+        memset(keys, 0, sizeof(keys));
+        pressCount = 0;
+        lastShift = MOVE_LEFT;
+    }
+
+    // A key event: a press, or the terminal repeating a held key.
+    void KeyEvent(Move move)
+    {
+        Key &key = keys[move];
+        if (!Repeats(move) || !key.down)
+        {
+            if (pressCount < QUEUE_SIZE)
+                presses[pressCount++] = move;
+            key.down = Repeats(move);
+            key.heldTicks = 0;
+            if (move == MOVE_LEFT || move == MOVE_RIGHT)
+                lastShift = move;
+        }
+        key.idleTicks = 0;
+    }
+
+    // For consoles that report releases.
+    void KeyUp(Move move) { keys[move].down = false; }
+
+    // The move for the next tick, if there is one.
+    bool Next(Move &move, int softDropInterval)
+    {
+        for (Move held : {MOVE_LEFT, MOVE_RIGHT, MOVE_SOFT_DROP})
+        {
+            Key &key = keys[held];
+            if (key.down)
+            {
+                key.heldTicks++;
+                if (++key.idleTicks > RELEASE_TICKS && !releases)
+                    key.down = false;
+            }
+        }
+
+        if (pressCount > 0)
+        {
+            move = presses[0];
+            memmove(presses, presses + 1, sizeof(Move) * --pressCount);
+            return true;
+        }
+
+        // The most recent direction wins while both are held
+        Move shift = keys[lastShift].down ? lastShift : lastShift == MOVE_LEFT ? MOVE_RIGHT : MOVE_LEFT;
+        int held = keys[shift].heldTicks;
+        if (keys[shift].down && held >= das && (held - das) % arr == 0)
+        {
+            move = shift;
+            return true;
+        }
+        if (keys[MOVE_SOFT_DROP].down && keys[MOVE_SOFT_DROP].heldTicks % max(softDropInterval, 1) == 0)
+        {
+            move = MOVE_SOFT_DROP;
+            return true;
+        }
+        return false;
+    }
+};
+
+// The falling piece: which one, where, and how far it has been rotated.
+struct PieceState
+{
+    int piece, x, y, rotation;
+
+    bool operator==(const PieceState &other) const
+    {
+        return piece == other.piece && x == other.x && y == other.y && rotation == other.rotation;
+    }
+    bool operator!=(const PieceState &other) const { return !(*this == other); }
+};
+
+// Everything needed to draw a game, copied out of or into a Tetris instance.
+// Sized for the largest board variant so one layout serves every board.
+const int MAX_FIELD_WIDTH = 18, MAX_FIELD_HEIGHT = 42;
+const int PREVIEW_MAX = 5; // pieces kept in the queue, and the most that can be shown
+const uint8_t NO_PIECE = 0xFF;
+
+struct GameStatus
+{
+    uint8_t width, height;
+    uint8_t piece, rotation;
+    uint8_t queue[PREVIEW_MAX], previewCount;
+    uint8_t hold; // NO_PIECE when empty
+    int8_t x, y;
+    bool holdUsed, isPaused, isGameOver;
+    uint8_t lastSpin, lastSpinLines; // SpinType of the last lock and the lines it cleared
+    uint8_t lastChain;               // clears in that lock's cascade
+    int32_t score, level, lines;
+
+    bool operator==(const GameStatus &other) const
+    {
+        return width == other.width && height == other.height && piece == other.piece &&
+               memcmp(queue, other.queue, PREVIEW_MAX) == 0 && previewCount == other.previewCount &&
+               hold == other.hold && holdUsed == other.holdUsed && rotation == other.rotation &&
+               x == other.x && y == other.y && isPaused == other.isPaused &&
+               isGameOver == other.isGameOver && lastSpin == other.lastSpin &&
+               lastSpinLines == other.lastSpinLines && lastChain == other.lastChain && score == other.score &&
+               level == other.level &&
+               lines == other.lines;
+    }
+};
+
+struct GameView
+{
+    GameStatus status;
+    uint8_t cells[MAX_FIELD_HEIGHT][MAX_FIELD_WIDTH];
+};
+
+// What a lock leaves behind: the settled field and everything the next
+// piece starts from, so restoring one plays on exactly as the game did.
+struct LockState
+{
+    GameView view;
+    uint32_t pieceRandom, garbageRandom;
+    int32_t pendingGarbage, piecesLocked;
+};
+
+template <class BoardT>
+class Tetris
+{
+private:
+    static const int FIELD_WIDTH = BoardT::FIELD_WIDTH, FIELD_HEIGHT = BoardT::FIELD_HEIGHT;
+
+    // All game state is plain data, so a copy of the object is a complete
+    // snapshot; versus mode relies on this to roll back and replay frames.
+    BoardT field;
+    int currentPiece, currentRotation;
+    int queue[PREVIEW_MAX]; // upcoming pieces, next first
+    int holdPiece;          // -1 while the hold slot is empty
+    bool holdUsed;          // hold can be used once per piece
+    int currentX, currentY;
+    int score, level, linesCleared;
+    bool isGameOver, isPaused;
+    uint32_t pieceRandom, garbageRandom; // NextRandom states
+    int fallProgress;                    // towards the next row, in 1/GRAVITY_ROW rows
+    int lockTimer, lockResets;           // ticks spent landed, and move resets used
+    int lowestY;                         // lowest row the piece has reached
+    int pendingGarbage, sentGarbage;     // versus mode rows coming in and going out
+    int ghostY;                          // row the falling piece would land on
+    bool lastMoveRotated;                // T-spins need the last move to be a turn
+    int lastKick;                        // kick test of that turn
+    SpinType lastSpin;                   // shown until the next lock
+    int lastSpinLines;
+    int lastChain;                       // clears the last lock set off, cascades included
+    int piecesLocked;
+    bool reportMetrics = false;          // counts into metrics; off for copies and tools
+    mutable HudNumber<11> scoreText, levelText, linesText; // written after their labels
+    mutable HudNumber<19> incomingText;                    // the whole info column
+    mutable HudNumber<13> chainText;
+    static uint64_t chromeGeneration; // frame generation the labels were last drawn into
+    static int previewCount;      // queued pieces shown; a display setting
+    static Ruleset rules;         // set once at startup
+    const Ruleset *gameRules = &rules; // the startup rules unless a tool picks others
+
+    // Puts a new piece at the top; the game is over if it does not fit.
+    void SpawnPiece(int piece)
+    {
+        currentPiece = piece;
+        currentX = FIELD_WIDTH / 2 - 2;
+        currentY = 1;
+        currentRotation = 0;
+        lastMoveRotated = false;
+        fallProgress = 0;
+        lockTimer = 0;
+        lockResets = 0;
+        lowestY = currentY;
+        if (!DoesPieceFit(currentPiece, currentRotation, currentX, currentY))
+            isGameOver = true;
+        UpdateGhost();
+    }
+
+    // The landing row only changes when the piece moves sideways, rotates
+    // or is replaced; dropping keeps it in the same columns.
+    void UpdateGhost()
+    {
+        ghostY = currentY;
+        if (DoesPieceFit(currentPiece, currentRotation, currentX, currentY))
+            ghostY += field.DropDistance(currentPiece, currentRotation, currentX, currentY);
+    }
+
+    int TakeNextPiece()
+    {
+        int piece = queue[0];
+        memmove(queue, queue + 1, sizeof(int) * (PREVIEW_MAX - 1));
+        queue[PREVIEW_MAX - 1] = NextRandom(pieceRandom, 7);
+        return piece;
+    }
+
+    // Swaps the falling piece with the held one, or with the next piece
+    // while the slot is empty.
+    void Hold()
+    {
+        if (holdUsed)
+            return;
+        int held = holdPiece;
+        holdPiece = currentPiece;
+        holdUsed = true;
+        SpawnPiece(held >= 0 ? held : TakeNextPiece());
+    }
+
+    // Draws a preview sprite with its origin at (x, y), or nothing if it is
+    // null, over the area (left, top, width, height) of at most 10 by 5
+    // cells. Every cell of the area is written once, so an unchanged preview
+    // leaves the frame unchanged.
+    static void DrawSprite(FrameBuffer &frame, const int8_t (*sprite)[2], int x, int y, uint8_t color,
+                           int left, int top, int width, int height)
+    {
+        ScreenCell area[5][10];
+        for (int row = 0; row < height; row++)
+        {
+            for (int column = 0; column < width; column++)
+                area[row][column] = {' ', SCREEN_TEXT, false};
+        }
+        for (int i = 0; sprite && i < 4; i++)
+        {
+            int row = y + sprite[i][1] - top, column = x + sprite[i][0] - left;
+            for (int half = 0; half < 2; half++)
+            {
+                if (row >= 0 && row < height && column + half >= 0 && column + half < width)
+                    area[row][column + half] = {BLOCK_TEXT[half], color, false};
+            }
+        }
+        for (int row = 0; row < height; row++)
+            frame.WriteCells(left, top + row, area[row], width);
+    }
+
+    static bool InMask(const uint8_t *mask, int px, int py)
+    {
+        return px >= 0 && px < TETROMINO_SIZE && py >= 0 && py < TETROMINO_SIZE && (mask[py] & (1 << px));
+    }
+
+    bool DoesPieceFit(int piece, int rotation, int posX, int posY)
+    {
+        return field.DoesPieceFit(piece, rotation, posX, posY);
+    }
+
+    // Turns the piece with wall kicks; direction is 1 clockwise, -1 counter-clockwise.
+    void RotatePiece(int direction)
+    {
+        int kick = KickRotate(currentPiece, currentRotation, direction, currentX, currentY,
+                              [this](int x, int y, int rotation)
+                              { return DoesPieceFit(currentPiece, rotation, x, y); });
+        if (kick < 0)
+            return;
+        currentRotation = (currentRotation + direction) & 3;
+        lastMoveRotated = true;
+        lastKick = kick;
+        UpdateGhost();
+        ResetLockDelay();
+    }
+
+    // Move reset: a shift or turn after the piece has landed restarts the
+    // lock delay, a limited number of times until it reaches a lower row.
+    void ResetLockDelay()
+    {
+        if (lockTimer > 0 && lockResets < gameRules->lockResets)
+        {
+            lockTimer = 0;
+            lockResets++;
+        }
+    }
+
+    void MoveDown()
+    {
+        currentY++;
+        lastMoveRotated = false;
+        if (currentY > lowestY)
+        {
+            lowestY = currentY;
+            lockTimer = 0;
+            lockResets = 0;
+        }
+    }
+
+    // Scores a clear: the first of a lock, with its T-spin, or a later
+    // step of a cascade chain (chain counts from 1).
+    void ScoreClear(int linesClearedThisTurn, SpinType spin, int chain)
+    {
+        if (reportMetrics)
+            metrics.linesCleared.fetch_add(linesClearedThisTurn, memory_order_relaxed);
+        if (linesClearedThisTurn > 0)
+        {
+            // Play sound (platform independent)
+#ifdef _WIN32
+            for (int i = 0; i < linesClearedThisTurn; i++)
+                PlaySoundEffect(SOUND_LINE_CLEAR);
+#else
+            if (linesCleared == 0)
+            {
+                PlaySoundEffect(SOUND_LINE_CLEAR);
+            }
+#endif
+        }
+
+        // Update score
+        if (chain > 1)
+            score += gameRules->ChainScore(linesClearedThisTurn, level, chain);
+        else
+            score += gameRules->LineClearScore(linesClearedThisTurn, level, spin);
+        linesCleared += linesClearedThisTurn;
+
+        // Level up
+        if (linesCleared >= gameRules->linesPerLevel)
+        {
+            level++;
+            linesCleared -= gameRules->linesPerLevel;
+            PlaySoundEffect(SOUND_LEVEL_UP);
+        }
+
+        // Cleared lines cancel incoming garbage before any is sent on
+        int attack = gameRules->GarbageLines(linesClearedThisTurn, chain > 1 ? SPIN_NONE : spin);
+        int cancelled = min(attack, pendingGarbage);
+        pendingGarbage -= cancelled;
+        sentGarbage += attack - cancelled;
+    }
+
+    // Clears the rows the locked piece completed; seams gets the rows that
+    // met across them, for cascades.
+    int ClearLines(SpinType spin, uint64_t &seams)
+    {
+        int linesClearedThisTurn = field.ClearLines(&seams);
+        ScoreClear(linesClearedThisTurn, spin, 1);
+        lastSpin = spin;
+        lastSpinLines = min(linesClearedThisTurn, 3);
+        lastChain = linesClearedThisTurn > 0;
+        return linesClearedThisTurn;
+    }
+
+    // Locks the piece where it is: clears lines, settles floating clusters,
+    // raises garbage and spawns the next piece.
+    void Lock()
+    {
+        PlaySoundEffect(SOUND_LOCK);
+        piecesLocked++;
+        if (reportMetrics)
+            metrics.piecesLocked.fetch_add(1, memory_order_relaxed);
+        score += gameRules->lockBonus * level;
+
+        // A T turned into a tight spot scores as a T-spin
+        SpinType spin = ClassifySpin(currentPiece, lastMoveRotated, lastKick,
+                                     field.BlockedCorners(currentX, currentY), currentRotation);
+
+        // Lock piece
+        field.LockPiece(currentPiece, currentRotation, currentX, currentY);
+
+        // Game over check
+        if (currentY <= 1)
+        {
+            isGameOver = true;
+            return;
+        }
+
+        uint64_t seams = 0;
+        int lines = ClearLines(spin, seams);
+        AppleGravity(seams);
+
+        // Garbage that was not cancelled rises once the piece is down
+        if (lines == 0 && pendingGarbage > 0)
+        {
+            int hole = 1 + NextRandom(garbageRandom, FIELD_WIDTH - 2);
+            int rows = min(pendingGarbage, FIELD_HEIGHT - 2);
+            bool fits = field.AddGarbage(rows, hole);
+            pendingGarbage = 0;
+            if (!fits)
+            {
+                isGameOver = true;
+                return;
+            }
+
+            // Under cascade rules whatever now hangs over the hole drops
+            // straight away, and may clear rows on the way
+            if (gameRules->cascade)
+                AppleGravity(1ULL << (FIELD_HEIGHT - 2 - rows));
+        }
+
+        // New piece
+        holdUsed = false;
+        SpawnPiece(TakeNextPiece());
+    }
+
+public:
+    Tetris()
+    {
+        Reset();
+    }
+
+    // Starts a new game on an empty field.
+    void Reset()
+    {
+        Reset(rand());
+    }
+
+    // Starts a new game whose pieces and garbage holes follow from seed, so
+    // every peer in a versus match simulates the same game.
+    void Reset(uint32_t seed)
+    {
+        field = BoardT();
+        pieceRandom = seed * 2 + 1;
+        garbageRandom = seed ^ 0x9E3779B9u;
+        if (garbageRandom == 0)
+            garbageRandom = 1;
+        currentPiece = NextRandom(pieceRandom, 7);
+        for (int i = 0; i < PREVIEW_MAX; i++)
+            queue[i] = NextRandom(pieceRandom, 7);
+        holdPiece = -1;
+        holdUsed = false;
+        currentRotation = 0;
+        currentX = FIELD_WIDTH / 2 - 2;
+        currentY = 1;
+        lastMoveRotated = false;
+        lastKick = 0;
+        lastSpin = SPIN_NONE;
+        lastSpinLines = 0;
+        lastChain = 0;
+        piecesLocked = 0;
+        score = 0;
+        level = 1;
+        linesCleared = 0;
+        isGameOver = false;
+        isPaused = false;
+        fallProgress = 0;
+        lockTimer = 0;
+        lockResets = 0;
+        lowestY = currentY;
+        pendingGarbage = 0;
+        sentGarbage = 0;
+        UpdateGhost();
+    }
+
+    void ProcessInput(int ch)
+    {
+        if (isPaused)
+        {
+            if (ch == 's' || ch == 'S')
+                isPaused = false;
+            return;
+        }
+        Move move;
+        if (KeyToMove(ch, move))
+            ApplyMove(move);
+        else if (ch == 's' || ch == 'S')
+            isPaused = true;
+    }
+
+    // One control, from the keyboard or from a versus peer.
+    void ApplyMove(Move move)
+    {
+        if (isPaused || isGameOver)
+            return;
+        switch (move)
+        {
+        case MOVE_LEFT:
+            if (DoesPieceFit(currentPiece, currentRotation, currentX - 1, currentY))
+            {
+                currentX--;
+                lastMoveRotated = false;
+                UpdateGhost();
+                ResetLockDelay();
+            }
+            break;
+        case MOVE_RIGHT:
+            if (DoesPieceFit(currentPiece, currentRotation, currentX + 1, currentY))
+            {
+                currentX++;
+                lastMoveRotated = false;
+                UpdateGhost();
+                ResetLockDelay();
+            }
+            break;
+        case MOVE_ROTATE:
+            RotatePiece(1);
+            break;
+        case MOVE_ROTATE_CCW:
+            RotatePiece(-1);
+            break;
+        case MOVE_SOFT_DROP:
+            if (currentY < ghostY)
+            {
+                MoveDown();
+                fallProgress = 0;
+            }
+            break;
+        case MOVE_HARD_DROP:
+            while (currentY < ghostY)
+                MoveDown();
+            Lock();
+            break;
+        case MOVE_HOLD:
+            Hold();
+            break;
+        }
+    }
+
+    // Settles the field after a clear. Cascade rules follow the falls from
+    // the seams and score every further clear as a chain step; otherwise
+    // the whole field settles once.
+    void AppleGravity(uint64_t seams)
+    {
+        if (gameRules->cascade)
+            field.Cascade(seams, [this](int lines)
+                          { ScoreClear(lines, SPIN_NONE, ++lastChain); });
+        else if (gameRules->clusterGravity)
+            field.ApplyGravity();
+    }
+    // One fixed simulation step. Everything the game does over time happens
+    // here, so a game is a pure function of its seed and its inputs per tick.
+    void Tick()
+    {
+        if (isPaused || isGameOver)
+            return;
+
+        int gravity = gameRules->Gravity(level);
+        if (gravity >= GRAVITY_20G)
+        {
+            while (currentY < ghostY)
+                MoveDown();
+        }
+        else
+        {
+            fallProgress += gravity;
+            for (; fallProgress >= GRAVITY_ROW && currentY < ghostY; fallProgress -= GRAVITY_ROW)
+                MoveDown();
+        }
+
+        // A landed piece locks once it has rested for the lock delay
+        if (currentY < ghostY)
+            return;
+        fallProgress = 0;
+        if (++lockTimer >= gameRules->lockDelay)
+            Lock();
+    }
+
+    // One forced gravity step for scripted play: moves the piece down a row,
+    // or locks it at once when it has landed.
+    void Fall()
+    {
+        if (isPaused || isGameOver)
+            return;
+        if (currentY < ghostY)
+            MoveDown();
+        else
+            Lock();
+    }
+
+    // Ticks between soft drop steps while the key is held.
+    int SoftDropInterval() const
+    {
+        int gravity = gameRules->Gravity(level) * gameRules->softDropFactor;
+        return max(1, GRAVITY_ROW / max(gravity, 1));
+    }
+
+    // Where Draw puts the side panel (info and next box), the hold box and
+    // the rest of the queue, which sits clear of the info and controls.
+    static constexpr int PANEL_X = FIELD_WIDTH * 2 + 5;
+    static constexpr int HOLD_X = PANEL_X + 13;
+    static constexpr int QUEUE_X = HOLD_X + 6;
+
+    // Size of the frame Draw composes.
+    static int ScreenWidth() { return FIELD_WIDTH * 2 + 34; }
+    static int ScreenHeight() { return FIELD_HEIGHT + 2; }
+
+    // Box borders, titles and labels: everything Draw shows that never
+    // changes, drawn once per cleared frame.
+    static void DrawPanelLabels(FrameBuffer &frame)
+    {
+        frame.Fill(PANEL_X, 1, 11, 1, ' ', SCREEN_WALL);
+        frame.Fill(PANEL_X, 7, 11, 1, ' ', SCREEN_WALL);
+        frame.Fill(PANEL_X, 2, 1, 5, ' ', SCREEN_WALL);
+        frame.Fill(PANEL_X + 10, 2, 1, 5, ' ', SCREEN_WALL);
+        frame.Write(PANEL_X + 3, 1, "NEXT", SCREEN_TITLE, true);
+
+        frame.Fill(HOLD_X, 1, 11, 1, ' ', SCREEN_WALL);
+        frame.Fill(HOLD_X, 7, 11, 1, ' ', SCREEN_WALL);
+        frame.Fill(HOLD_X, 2, 1, 5, ' ', SCREEN_WALL);
+        frame.Fill(HOLD_X + 10, 2, 1, 5, ' ', SCREEN_WALL);
+        frame.Write(HOLD_X + 3, 1, "HOLD", SCREEN_TITLE, true);
+
+        frame.Write(PANEL_X, 9, "Score: ", SCREEN_TEXT, true);
+        frame.Write(PANEL_X, 10, "Level: ", SCREEN_TEXT, true);
+        frame.Write(PANEL_X, 11, "Lines: ", SCREEN_TEXT, true);
+
+        frame.Write(PANEL_X, 13, "Controls:", SCREEN_TEXT);
+        frame.Write(PANEL_X, 14, "LEFT/RIGHT: Move", SCREEN_TEXT);
+        frame.Write(PANEL_X, 15, "UP/X: Rotate Right", SCREEN_TEXT);
+        frame.Write(PANEL_X, 16, "Z: Rotate Left", SCREEN_TEXT);
+        frame.Write(PANEL_X, 17, "DOWN: Soft Drop", SCREEN_TEXT);
+        frame.Write(PANEL_X, 18, "SPACE: Hard Drop", SCREEN_TEXT);
+        frame.Write(PANEL_X, 19, "C: Hold", SCREEN_TEXT);
+        frame.Write(PANEL_X, 20, "S: Pause", SCREEN_TEXT);
+        frame.Write(PANEL_X, 21, "Ctrl + C: Quit", SCREEN_TEXT);
+    }
+
+    // Draws the game over whatever this board type last drew into the frame.
+    // Each cell is written once with what ends up on top, so a frame where
+    // nothing moved keeps its revision and costs the backend nothing.
+    void Draw(FrameBuffer &frame) const
+    {
+        if (frame.Generation() != chromeGeneration)
+        {
+            frame.Clear();
+            DrawPanelLabels(frame);
+            chromeGeneration = frame.Generation();
+        }
+
+        // Field with the falling piece, its ghost and the pause banner on top
+        const uint8_t *mask = PIECE_MASKS.rows[currentPiece][currentRotation & 3];
+        bool showGhost = !isGameOver && ghostY > currentY;
+        const char pausedText[] = "PAUSED";
+        const int pausedX = FIELD_WIDTH - 4, pausedY = FIELD_HEIGHT / 2 + 1;
+        ScreenCell row[FIELD_WIDTH * 2];
+        for (int y = 0; y < FIELD_HEIGHT; y++)
+        {
+            for (int x = 0; x < FIELD_WIDTH; x++)
+            {
+                const char *text = "  ";
+                uint8_t color = SCREEN_TEXT;
+                int cell = field[y][x];
+                if (InMask(mask, x - currentX, y - currentY))
+                {
+                    text = BLOCK_TEXT;
+                    color = currentPiece + 1;
+                }
+                else if (showGhost && InMask(mask, x - currentX, y - ghostY))
+                {
+                    text = GHOST_TEXT;
+                    color = SCREEN_GHOST;
+                }
+                else if (cell > 0 && cell < 8)
+                {
+                    text = BLOCK_TEXT;
+                    color = cell;
+                }
+                else if (cell == 8)
+                {
+                    text = WALL_TEXT;
+                    color = SCREEN_WALL;
+                }
+                row[x * 2] = {text[0], color, false};
+                row[x * 2 + 1] = {text[1], color, false};
+            }
+            if (isPaused && y + 1 == pausedY)
+            {
+                for (int i = 0; i < 6; i++)
+                    row[pausedX - 1 + i] = {pausedText[i], SCREEN_WALL, true};
+            }
+            frame.WriteCells(1, y + 1, row, FIELD_WIDTH * 2);
+        }
+
+        // Next piece, centred in its box
+        DrawSprite(frame, PREVIEW_SPRITES.box[queue[0]], PANEL_X + 4, 4, queue[0] + 1, PANEL_X + 1, 2, 9, 5);
+
+        // Held piece, greyed out once hold has been used
+        DrawSprite(frame, holdPiece >= 0 ? PREVIEW_SPRITES.box[holdPiece] : nullptr, HOLD_X + 4, 4,
+                   holdUsed ? SCREEN_WALL : holdPiece + 1, HOLD_X + 1, 2, 9, 5);
+
+        // The rest of the queue, flat, in a column right of the info
+        for (int i = 1; i < PREVIEW_MAX; i++)
+            DrawSprite(frame, i < previewCount ? PREVIEW_SPRITES.compact[queue[i]] : nullptr, QUEUE_X, 6 + i * 3,
+                       queue[i] + 1, QUEUE_X, 6 + i * 3, 8, 2);
+
+        // Last T-spin or cascade chain, until the next piece locks
+        const char *spin = "";
+        if (lastSpin != SPIN_NONE)
+            spin = SPIN_TEXT[lastSpin == SPIN_MINI][lastSpinLines];
+        else if (lastChain > 1)
+            spin = chainText.Format("CHAIN x", lastChain);
+        int spinLength = strlen(spin);
+        frame.Write(PANEL_X, 8, spin, SCREEN_TITLE, true);
+        frame.Fill(PANEL_X + spinLength, 8, QUEUE_X - PANEL_X - spinLength, 1, ' ', SCREEN_TEXT);
+
+        // Game info after the labels
+        frame.Write(PANEL_X + 7, 9, scoreText.Format("", score), SCREEN_TEXT, true);
+        frame.Write(PANEL_X + 7, 10, levelText.Format("", level), SCREEN_TEXT, true);
+        frame.Write(PANEL_X + 7, 11, linesText.Format("", linesCleared), SCREEN_TEXT, true);
+        if (pendingGarbage > 0)
+            frame.Write(PANEL_X, 12, incomingText.Format("Incoming: ", pendingGarbage), SCREEN_WALL, true);
+        else
+            frame.Fill(PANEL_X, 12, QUEUE_X - PANEL_X, 1, ' ', SCREEN_TEXT);
+    }
+
+    // All placements reachable by the current piece from where it is now.
+    const vector<Placement> &FindPlacements(MoveGenerator<BoardT> &generator) const
+    {
+        return generator.Generate(field, currentPiece, currentX, currentY, currentRotation);
+    }
+    void GetView(GameView &view) const
+    {
+        view.status = {};
+        view.status.width = FIELD_WIDTH;
+        view.status.height = FIELD_HEIGHT;
+        view.status.piece = currentPiece;
+        view.status.rotation = currentRotation & 3;
+        for (int i = 0; i < PREVIEW_MAX; i++)
+            view.status.queue[i] = queue[i];
+        view.status.previewCount = previewCount;
+        view.status.hold = holdPiece >= 0 ? holdPiece : NO_PIECE;
+        view.status.x = currentX;
+        view.status.y = currentY;
+        view.status.holdUsed = holdUsed;
+        view.status.isPaused = isPaused;
+        view.status.isGameOver = isGameOver;
+        view.status.lastSpin = lastSpin;
+        view.status.lastSpinLines = lastSpinLines;
+        view.status.lastChain = min(lastChain, 255);
+        view.status.score = score;
+        view.status.level = level;
+        view.status.lines = linesCleared;
+        for (int y = 0; y < FIELD_HEIGHT; y++)
+            memcpy(view.cells[y], field[y], FIELD_WIDTH);
+    }
+
+    // Shows a game described by a view; used by spectator displays.
+    void SetView(const GameView &view)
+    {
+        for (int y = 0; y < FIELD_HEIGHT; y++)
+        {
+            for (int x = 0; x < FIELD_WIDTH; x++)
+                field.Set(y, x, view.cells[y][x]);
+        }
+        currentPiece = view.status.piece % 7;
+        for (int i = 0; i < PREVIEW_MAX; i++)
+            queue[i] = view.status.queue[i] % 7;
+        previewCount = max(1, min<int>(view.status.previewCount, PREVIEW_MAX));
+        holdPiece = view.status.hold == NO_PIECE ? -1 : view.status.hold % 7;
+        holdUsed = view.status.holdUsed;
+        currentRotation = view.status.rotation;
+        currentX = view.status.x;
+        currentY = view.status.y;
+        UpdateGhost();
+        isPaused = view.status.isPaused;
+        isGameOver = view.status.isGameOver;
+        lastSpin = (SpinType)min<int>(view.status.lastSpin, SPIN_FULL);
+        lastSpinLines = min<int>(view.status.lastSpinLines, 3);
+        lastChain = view.status.lastChain;
+        score = view.status.score;
+        level = view.status.level;
+        linesCleared = view.status.lines;
+    }
+
+    // The state right after a lock, for the time-travel debugger.
+    void SaveLock(LockState &state) const
+    {
+        GetView(state.view);
+        state.pieceRandom = pieceRandom;
+        state.garbageRandom = garbageRandom;
+        state.pendingGarbage = pendingGarbage;
+        state.piecesLocked = piecesLocked;
+    }
+
+    // Goes back to a saved lock; the piece it spawned starts afresh.
+    void RestoreLock(const LockState &state)
+    {
+        SetView(state.view);
+        pieceRandom = state.pieceRandom;
+        garbageRandom = state.garbageRandom;
+        pendingGarbage = state.pendingGarbage;
+        piecesLocked = state.piecesLocked;
+        sentGarbage = 0;
+        lastMoveRotated = false;
+        lastKick = 0;
+        fallProgress = 0;
+        lockTimer = 0;
+        lockResets = 0;
+        lowestY = currentY;
+    }
+
+    // Versus mode: garbage rows cleared towards opponents since the last
+    // call, and rows arriving from them.
+    int TakeSentGarbage()
+    {
+        int lines = sentGarbage;
+        sentGarbage = 0;
+        return lines;
+    }
+    void ReceiveGarbage(int lines) { pendingGarbage += lines; }
+    void ReportMetrics(bool report) { reportMetrics = report; }
+    int PendingGarbage() const { return pendingGarbage; }
+
+    // What a bot sees: the settled field and the falling piece.
+    const BoardT &GetField() const { return field; }
+    PieceState GetPieceState() const { return {currentPiece, currentX, currentY, currentRotation & 3}; }
+    int GetPreview(int i) const { return queue[i]; }
+
+    // How many queued pieces Draw shows, 1 to PREVIEW_MAX.
+    static void SetPreviewCount(int count) { previewCount = max(1, min(count, PREVIEW_MAX)); }
+
+    // Scoring and timing for every game; set before the first one starts.
+    static void SetRules(const Ruleset &ruleset) { rules = ruleset; }
+    static const Ruleset &GetRules() { return rules; }
+    // Plays this game under other rules, which have to outlive it; for
+    // tools that run several rulesets side by side.
+    void UseRules(const Ruleset &ruleset) { gameRules = &ruleset; }
+    const Ruleset &Rules() const { return *gameRules; }
+
+    bool IsGameOver() const { return isGameOver; }
+    int GetScore() const { return score; }
+    int GetLevel() const { return level; }
+    int PiecesLocked() const { return piecesLocked; }
+
+    // Moves a game that has just started on to a later level.
+    void SetLevel(int startLevel) { level = max(startLevel, 1); }
+};
+
+template <class BoardT>
+uint64_t Tetris<BoardT>::chromeGeneration = 0;
+template <class BoardT>
+int Tetris<BoardT>::previewCount = 1;
+template <class BoardT>
+Ruleset Tetris<BoardT>::rules;
+
+// Time-travel debugging: a ring of the states the last few thousand locks
+// left behind. A record holds only what changed since the one before it:
+// the game numbers as varint deltas, then the rows that differ, each as a
+// row of the previous board (cleared lines move rows down) with the cells
+// that differ from it. Every KEYFRAME_INTERVAL-th record is taken against
+// an empty board instead, so any record decodes from the keyframe before
+// it, and when the ring is full the oldest keyframe goes with its deltas.
+template <class BoardT, int CAPACITY = 4096, int BYTES = 256 * 1024, int KEYFRAME_INTERVAL = 64>
+class LockHistory
+{
+private:
+    static const int W = BoardT::FIELD_WIDTH, H = BoardT::FIELD_HEIGHT;
+    static const int FIELD_COUNT = 17 + PREVIEW_MAX;
+    // Every field a 5 byte varint, and every row rewritten cell by cell
+    static const int MAX_RECORD = FIELD_COUNT * 5 + 1 + (H - 2) * (2 + 3 + (W - 1) / 2);
+    static_assert(BYTES >= 2 * MAX_RECORD && BYTES < (1 << 30), "the ring must hold a record wherever it starts");
+
+    struct Entry
+    {
+        uint32_t offset;
+        uint16_t size;
+        bool keyframe;
+    };
+
+    // A decoded record. Row 0 stays empty: row sources refer to it for
+    // rows that were empty before.
+    struct Snapshot
+    {
+        int32_t fields[FIELD_COUNT];
+        uint8_t board[H][W];
+    };
+
+    Entry entries[CAPACITY]; // by sequence number modulo CAPACITY
+    uint8_t data[BYTES];
+    uint64_t first = 0, count = 0; // sequence number of the oldest record, and records kept
+    uint32_t end = 0;              // where the newest record ends
+    int sinceKeyframe = 0;         // records after the newest keyframe
+    Snapshot newest, scratch;      // the newest record decoded, which the next is taken against
+    LockState state;
+
+    static uint8_t *PutVarint(uint8_t *out, uint32_t value)
+    {
+        for (; value >= 0x80; value >>= 7)
+            *out++ = value | 0x80;
+        *out++ = value;
+        return out;
+    }
+
+    static const uint8_t *GetVarint(const uint8_t *in, uint32_t &value)
+    {
+        value = 0;
+        for (int shift = 0;; shift += 7)
+        {
+            value |= (uint32_t)(*in & 0x7F) << shift;
+            if (!(*in++ & 0x80))
+                return in;
+        }
+    }
+
+    // state as a list of numbers; Unpack reads them back in the same order.
+    void Pack(Snapshot &snapshot) const
+    {
+        const GameStatus &status = state.view.status;
+        int32_t fields[FIELD_COUNT] = {status.score, status.level, status.lines, state.pendingGarbage,
+                                       state.piecesLocked, (int32_t)state.pieceRandom,
+                                       (int32_t)state.garbageRandom, status.piece, status.rotation, status.hold,
+                                       status.x, status.y,
+                                       status.holdUsed | status.isPaused << 1 | status.isGameOver << 2,
+                                       status.lastSpin, status.lastSpinLines, status.lastChain,
+                                       status.previewCount};
+        for (int i = 0; i < PREVIEW_MAX; i++)
+            fields[FIELD_COUNT - PREVIEW_MAX + i] = status.queue[i];
+        memcpy(snapshot.fields, fields, sizeof(fields));
+        memset(snapshot.board[0], 0, W);
+        for (int y = 1; y < H - 1; y++)
+            memcpy(snapshot.board[y], state.view.cells[y], W);
+    }
+
+    void Unpack(const Snapshot &snapshot)
+    {
+        const int32_t *fields = snapshot.fields;
+        GameStatus &status = state.view.status;
+        state = {};
+        status.width = W;
+        status.height = H;
+        status.score = fields[0];
+        status.level = fields[1];
+        status.lines = fields[2];
+        state.pendingGarbage = fields[3];
+        state.piecesLocked = fields[4];
+        state.pieceRandom = fields[5];
+        state.garbageRandom = fields[6];
+        status.piece = fields[7];
+        status.rotation = fields[8];
+        status.hold = fields[9];
+        status.x = fields[10];
+        status.y = fields[11];
+        status.holdUsed = fields[12] & 1;
+        status.isPaused = fields[12] & 2;
+        status.isGameOver = fields[12] & 4;
+        status.lastSpin = fields[13];
+        status.lastSpinLines = fields[14];
+        status.lastChain = fields[15];
+        status.previewCount = fields[16];
+        for (int i = 0; i < PREVIEW_MAX; i++)
+            status.queue[i] = fields[FIELD_COUNT - PREVIEW_MAX + i];
+        for (int y = 0; y < H; y++)
+        {
+            for (int x = 0; x < W; x++)
+            {
+                bool isBorder = x == 0 || x == W - 1 || y == 0 || y == H - 1;
+                state.view.cells[y][x] = isBorder ? 8 : snapshot.board[y][x];
+            }
+        }
+    }
+
+    static int Differences(const uint8_t *row, const uint8_t *source)
+    {
+        int differences = 0;
+        for (int x = 1; x < W - 1; x++)
+            differences += row[x] != source[x];
+        return differences;
+    }
+
+    // Writes next as changes from base and returns the record's size.
+    static int Encode(const Snapshot &next, const Snapshot &base, uint8_t *out)
+    {
+        uint8_t *start = out;
+        for (int i = 0; i < FIELD_COUNT; i++)
+        {
+            uint32_t delta = (uint32_t)next.fields[i] - (uint32_t)base.fields[i];
+            out = PutVarint(out, delta << 1 ^ (uint32_t)((int32_t)delta >> 31));
+        }
+        uint8_t *rowCount = out++;
+        *rowCount = 0;
+        for (int y = 1; y < H - 1; y++)
+        {
+            const uint8_t *row = next.board[y];
+            if (Differences(row, base.board[y]) == 0)
+                continue;
+
+            // The row of base it is closest to, nearest first
+            int source = 0, best = Differences(row, base.board[0]);
+            for (int distance = 0; distance < H && best > 0; distance++)
+            {
+                for (int candidate : {y - distance, y + distance})
+                {
+                    if (candidate >= 1 && candidate < H - 1 && best > 0)
+                    {
+                        int differences = Differences(row, base.board[candidate]);
+                        if (differences < best)
+                        {
+                            best = differences;
+                            source = candidate;
+                        }
+                    }
+                }
+            }
+
+            uint32_t changed = 0;
+            for (int x = 1; x < W - 1; x++)
+            {
+                if (row[x] != base.board[source][x])
+                    changed |= 1u << (x - 1);
+            }
+            *out++ = y;
+            *out++ = source;
+            out = PutVarint(out, changed);
+            int nibbles = 0;
+            for (int x = 1; x < W - 1; x++)
+            {
+                if (changed & 1u << (x - 1))
+                {
+                    if (nibbles++ & 1)
+                        out[-1] |= row[x] << 4;
+                    else
+                        *out++ = row[x];
+                }
+            }
+            ++*rowCount;
+        }
+        return out - start;
+    }
+
+    // Applies a record to snapshot, which holds the record before it.
+    static void Decode(const uint8_t *in, Snapshot &snapshot)
+    {
+        for (int i = 0; i < FIELD_COUNT; i++)
+        {
+            uint32_t value;
+            in = GetVarint(in, value);
+            snapshot.fields[i] = (uint32_t)snapshot.fields[i] + ((value >> 1) ^ (0u - (value & 1)));
+        }
+        uint8_t base[H][W];
+        memcpy(base, snapshot.board, sizeof(base));
+        for (int rows = *in++; rows > 0; rows--)
+        {
+            int y = *in++, source = *in++;
+            uint32_t changed;
+            in = GetVarint(in, changed);
+            memcpy(snapshot.board[y], base[source], W);
+            int nibbles = 0;
+            for (int x = 1; x < W - 1; x++)
+            {
+                if (changed & 1u << (x - 1))
+                    snapshot.board[y][x] = nibbles++ & 1 ? *in++ >> 4 : *in & 0x0F;
+            }
+            if (nibbles & 1)
+                in++;
+        }
+    }
+
+    // Decodes record sequence into snapshot, from the keyframe before it.
+    void Load(uint64_t sequence, Snapshot &snapshot)
+    {
+        uint64_t keyframe = sequence;
+        while (!entries[keyframe % CAPACITY].keyframe)
+            keyframe--;
+        memset(&snapshot, 0, sizeof(snapshot));
+        for (uint64_t s = keyframe; s <= sequence; s++)
+            Decode(data + entries[s % CAPACITY].offset, snapshot);
+    }
+
+    // Drops the oldest keyframe and the deltas that depend on it.
+    void DropOldest()
+    {
+        do
+        {
+            first++;
+            count--;
+        } while (count > 0 && !entries[first % CAPACITY].keyframe);
+    }
+
+public:
+    LockHistory() { Clear(); }
+
+    void Clear()
+    {
+        first += count;
+        count = 0;
+        end = 0;
+        sinceKeyframe = 0;
+        memset(&newest, 0, sizeof(newest));
+    }
+
+    // Adds the state the game is in, which should be just after a lock.
+    void Record(const Tetris<BoardT> &game)
+    {
+        game.SaveLock(state);
+        Pack(scratch);
+        uint8_t record[MAX_RECORD];
+        bool keyframe = count == 0 || sinceKeyframe + 1 >= KEYFRAME_INTERVAL;
+        Snapshot &base = newest;
+        if (keyframe)
+            memset(&base, 0, sizeof(base));
+        int size = Encode(scratch, base, record);
+
+        if (count == CAPACITY)
+            DropOldest();
+        uint32_t offset = end + size <= BYTES ? end : 0;
+        while (count > 0)
+        {
+            const Entry &oldest = entries[first % CAPACITY];
+            bool skipped = offset == 0 && oldest.offset >= end; // in the tail left unused by wrapping
+            if (!skipped && (oldest.offset >= offset + size || oldest.offset + oldest.size <= offset))
+                break;
+            DropOldest();
+        }
+        if (count == 0 && !keyframe)
+        {
+            // The ring ran out under this record's own keyframe
+            keyframe = true;
+            memset(&base, 0, sizeof(base));
+            size = Encode(scratch, base, record);
+            offset = 0;
+        }
+
+        memcpy(data + offset, record, size);
+        entries[(first + count) % CAPACITY] = {offset, (uint16_t)size, keyframe};
+        count++;
+        end = offset + size;
+        sinceKeyframe = keyframe ? 0 : sinceKeyframe + 1;
+        newest = scratch;
+    }
+
+    // Puts game back to record sequence, between Oldest() and Newest().
+    void Restore(uint64_t sequence, Tetris<BoardT> &game)
+    {
+        Load(sequence, scratch);
+        Unpack(scratch);
+        game.RestoreLock(state);
+    }
+
+    // Forgets the records after sequence, for a game that plays on from it.
+    void Truncate(uint64_t sequence)
+    {
+        count = sequence - first + 1;
+        const Entry &last = entries[sequence % CAPACITY];
+        end = last.offset + last.size;
+        Load(sequence, newest);
+        sinceKeyframe = 0;
+        for (uint64_t s = sequence; !entries[s % CAPACITY].keyframe; s--)
+            sinceKeyframe++;
+    }
+
+    uint64_t Oldest() const { return first; }
+    uint64_t Newest() const { return first + count - 1; }
+};
+
+// Plays a game for attract mode and soak tests. For every piece it asks the
+// MoveGenerator for all reachable placements, and for each of those all the
+// placements of the next piece in the queue. The pair that leaves the best
+// board (a weighted sum of line clears, stack height, holes and bumpiness)
+// decides the move, and the bot presses the keys towards it at a steady
+// pace. If gravity moves the piece before the keys are done, it finds a new
+// path from where the piece is to the same target.
+template <class BoardT>
+class Bot
+{
+private:
+    static const int FIELD_WIDTH = BoardT::FIELD_WIDTH, FIELD_HEIGHT = BoardT::FIELD_HEIGHT;
+
+    MoveGenerator<BoardT> generator, nextGenerator;
+    vector<Move> keys;
+    size_t nextKey = 0;
+    PieceState expected = {-1, 0, 0, 0};
+    Placement target = {};
+    int keyInterval, cooldown = 0;
+
+    static double Evaluate(const BoardT &field, int lines)
+    {
+        int aggregateHeight = 0, holes = 0, bumpiness = 0, lastHeight = -1;
+        for (int x = 1; x < FIELD_WIDTH - 1; x++)
+        {
+            int height = 0;
+            for (int y = 1; y < FIELD_HEIGHT - 1; y++)
+            {
+                if (field[y][x] != 0)
+                {
+                    if (height == 0)
+                        height = FIELD_HEIGHT - 1 - y;
+                }
+                else if (height > 0)
+                {
+                    holes++;
+                }
+            }
+            aggregateHeight += height;
+            if (lastHeight >= 0)
+                bumpiness += abs(height - lastHeight);
+            lastHeight = height;
+        }
+        return 0.76 * lines - 0.51 * aggregateHeight - 0.36 * holes - 0.18 * bumpiness;
+    }
+
+    void Plan(const Tetris<BoardT> &game)
+    {
+        PieceState piece = game.GetPieceState();
+        const vector<Placement> &placements = game.FindPlacements(generator);
+        keys.clear();
+        nextKey = 0;
+        if (placements.empty())
+            return;
+
+        const Placement *best = &placements[0];
+        double bestScore = -1e300;
+        int next = game.GetPreview(0);
+        for (const Placement &placement : placements)
+        {
+            BoardT after = game.GetField();
+            after.LockPiece(piece.piece, placement.rotation, placement.x, placement.y);
+            int lines = after.ClearLines();
+
+            // Best follow-up with the next piece from its spawn position
+            double score = -1e9;
+            for (const Placement &follow : nextGenerator.Generate(after, next, FIELD_WIDTH / 2 - 2, 1, 0))
+            {
+                BoardT then = after;
+                then.LockPiece(next, follow.rotation, follow.x, follow.y);
+                int moreLines = then.ClearLines();
+                score = max(score, Evaluate(then, lines + moreLines));
+            }
+            score -= 0.001 * placement.keyCount;
+            if (score > bestScore)
+            {
+                bestScore = score;
+                best = &placement;
+            }
+        }
+        target = *best;
+        generator.GetKeys(target, keys);
+    }
+
+    // Finds keys to the current target from where the piece is now; plans
+    // from scratch if the target can no longer be reached.
+    void Repath(const Tetris<BoardT> &game)
+    {
+        for (const Placement &placement : game.FindPlacements(generator))
+        {
+            if (placement.x == target.x && placement.y == target.y && placement.rotation == target.rotation)
+            {
+                generator.GetKeys(placement, keys);
+                nextKey = 0;
+                return;
+            }
+        }
+        Plan(game);
+    }
+
+public:
+    // keyInterval: ticks between key presses.
+    explicit Bot(int interval) : keyInterval(interval)
+    {
+        keys.reserve(256);
+    }
+
+    // Called before every Tick; presses at most one key.
+    void Act(Tetris<BoardT> &game)
+    {
+        Move key;
+        if (NextKey(game, key))
+        {
+            game.ApplyMove(key);
+            Pressed(game, key);
+        }
+    }
+
+    // Act in two halves, for callers that time the game without the bot's
+    // thinking: the key to press before the next Tick, if any, and then
+    // the game after that key went in.
+    bool NextKey(const Tetris<BoardT> &game, Move &key)
+    {
+        if (game.IsGameOver())
+            return false;
+        PieceState piece = game.GetPieceState();
+        if (piece != expected)
+        {
+            // A new piece is a different one or higher up; anything else was gravity
+            if (piece.piece != expected.piece || piece.y < expected.y)
+                Plan(game);
+            else
+                Repath(game);
+            expected = piece;
+        }
+        if (cooldown > 0)
+        {
+            cooldown--;
+            return false;
+        }
+        // Once at the target, lock at once instead of waiting out the lock delay
+        key = nextKey < keys.size() ? keys[nextKey++] : MOVE_HARD_DROP;
+        cooldown = keyInterval - 1;
+        return true;
+    }
+
+    void Pressed(const Tetris<BoardT> &game, Move key)
+    {
+        // A hard drop locks the piece, so whatever comes next gets a new plan
+        expected = key == MOVE_HARD_DROP ? PieceState{-1, 0, 0, 0} : game.GetPieceState();
+    }
+};
+
+// Hands a key event that is not the game loop's own to the game: moves and
+// their releases go to auto-repeat, other keys act at once.
+template <class BoardT>
+void RouteKey(Tetris<BoardT> &game, AutoRepeat &input, const InputEvent &event)
+{
+    Move move;
+    if (event.released)
+    {
+        if (KeyToMove(event.key, move))
+            input.KeyUp(move);
+    }
+    else if (KeyToMove(event.key, move))
+        input.KeyEvent(move);
+    else
+        game.ProcessInput(event.key);
+}
+
+// One tick of PlayGame: the move auto-repeat has due, the bot's key when
+// it plays, then the tick itself. stepped runs after each of the three,
+// so a lock history sees every lock.
+template <class BoardT, class Stepped>
+void PlayTick(Tetris<BoardT> &game, AutoRepeat &input, Bot<BoardT> *bot, Stepped stepped)
+{
+    Move move;
+    if (input.Next(move, game.SoftDropInterval()))
+        game.ApplyMove(move);
+    stepped();
+    if (bot)
+    {
+        bot->Act(game);
+        stepped();
+    }
+    game.Tick();
+    stepped();
+}
+
+// Offline search for puzzle and challenge modes: given a board and a known
+// piece sequence, finds the placements that score the most under the same
+// rules as Tetris::Lock (lock bonus, line scores times level, level ups,
+// cluster gravity and cascades). Iterative deepening fills a shared
+// Zobrist-hashed transposition table whose best moves order the next, deeper
+// iteration, and the children of the root are split across threads.
+template <class BoardT>
+class Solver
+{
+public:
+    struct Step
+    {
+        int piece, x, y, rotation;
+        string keys;
+    };
+
+    struct Result
+    {
+        int score = 0;
+        int depth = 0; // number of pieces the result covers
+        long long nodes = 0;
+        vector<Step> steps;
+    };
+
+private:
+    static const int NO_SCORE = -1000000000;
+    enum Bound : uint8_t
+    {
+        BOUND_EXACT,
+        BOUND_UPPER
+    };
+
+    static const int FIELD_WIDTH = BoardT::FIELD_WIDTH, FIELD_HEIGHT = BoardT::FIELD_HEIGHT;
+
+    // A position and its Zobrist key, kept up to date as pieces go in and
+    // come out. The key of a row's cells is rotated left by the row's
+    // number, so a clear moves a whole row's key instead of its cells'.
+    struct State
+    {
+        BoardT board;
+        int level, lines;
+        uint64_t key;
+        uint64_t rowKeys[FIELD_HEIGHT];
+    };
+
+    // A placement still to be searched. gain is what the lock scores before
+    // any cascade, exact without cascades and the ordering key with them.
+    struct Child
+    {
+        int gain;
+        int x, y, rotation;
+        SpinType spin;
+        uint64_t completed; // rows the lock completes, bit y for row y
+        bool isGameOver;
+    };
+
+    // What Undo needs: nothing when the lock only added the piece's cells,
+    // and the position before it when rows cleared or clusters fell.
+    struct UndoRecord
+    {
+        bool restore;
+        State saved;
+    };
+
+    struct PackedMove
+    {
+        int x, y, rotation;
+    };
+
+    // Lock-free entries: the key is stored xor'ed with the data so a torn
+    // write from another thread just looks like a miss.
+    struct TTEntry
+    {
+        atomic<uint64_t> check{0};
+        atomic<uint64_t> data{0};
+    };
+
+    // Per-thread search scratch space: the position being searched, which
+    // each ply changes and changes back, and one set of buffers per ply so
+    // the recursion never allocates.
+    struct Worker
+    {
+        MoveGenerator<BoardT> generator;
+        State state;
+        vector<vector<Child>> children;
+        vector<UndoRecord> undo;
+        long long nodes = 0;
+    };
+
+    State root;
+    bool rootSettled; // no cluster on the starting board floats
+    const Ruleset rules;
+    const vector<int> pieces;
+    vector<int> tPiecesBefore; // T pieces among the first i of pieces
+    const bool perfectClear;
+    const int threadCount;
+    vector<TTEntry> table;
+    uint64_t tableMask;
+    uint64_t zobristCells[FIELD_WIDTH][9];
+    uint64_t zobristPly[256], zobristLevel[256], zobristLines[256];
+    int depthLimit;
+    atomic<bool> stop{false};
+    chrono::steady_clock::time_point deadline;
+
+    static uint64_t SplitMix64(uint64_t &seed)
+    {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    static uint64_t RowKey(uint64_t cells, int y) { return cells << y | cells >> (64 - y); }
+
+    uint64_t Hash(const State &state, int ply) const
+    {
+        return state.key ^ zobristPly[ply & 255] ^ zobristLevel[state.level & 255] ^ zobristLines[state.lines & 255];
+    }
+
+    // Keys the whole board from scratch, for the root and after clusters fell.
+    void Rehash(State &state) const
+    {
+        state.key = 0;
+        memset(state.rowKeys, 0, sizeof(state.rowKeys));
+        for (int y = 1; y < FIELD_HEIGHT - 1; y++)
+        {
+            for (int x = 1; x < FIELD_WIDTH - 1; x++)
+            {
+                if (state.board[y][x] != 0)
+                    state.rowKeys[y] ^= zobristCells[x][state.board[y][x]];
+            }
+            state.key ^= RowKey(state.rowKeys[y], y);
+        }
+    }
+
+    // Adds the piece's cells to the board, or takes them out again.
+    void TogglePiece(State &state, int piece, int rotation, int posX, int posY, bool add) const
+    {
+        const uint8_t *mask = PIECE_MASKS.rows[piece][rotation & 3];
+        for (int py = 0; py < TETROMINO_SIZE; py++)
+        {
+            uint64_t cells = 0;
+            for (int px = 0; px < TETROMINO_SIZE; px++)
+            {
+                if (mask[py] & (1 << px))
+                {
+                    state.board.Set(posY + py, posX + px, add ? piece + 1 : 0);
+                    cells ^= zobristCells[posX + px][piece + 1];
+                }
+            }
+            if (cells != 0)
+            {
+                state.rowKeys[posY + py] ^= cells;
+                state.key ^= RowKey(cells, posY + py);
+            }
+        }
+    }
+
+    static uint64_t Pack(int value, PackedMove move, Bound bound, int remaining)
+    {
+        return (uint64_t)(uint32_t)value |
+               (uint64_t)(uint8_t)(move.x + 8) << 32 |
+               (uint64_t)(uint8_t)(move.y + 8) << 40 |
+               (uint64_t)(move.rotation & 3) << 48 |
+               (uint64_t)bound << 50 |
+               (uint64_t)(remaining & 255) << 56;
+    }
+
+    bool Probe(uint64_t key, int remaining, int &value, PackedMove &move, Bound &bound) const
+    {
+        const TTEntry &entry = table[key & tableMask];
+        uint64_t data = entry.data.load(memory_order_relaxed);
+        if ((entry.check.load(memory_order_relaxed) ^ data) != key)
+            return false;
+        value = (int32_t)(uint32_t)data;
+        move = {(int)(uint8_t)(data >> 32) - 8, (int)(uint8_t)(data >> 40) - 8, (int)(data >> 48) & 3};
+        bound = (Bound)((data >> 50) & 1);
+        // Entries from a shallower iteration still carry a useful best move,
+        // but their value answers a different question.
+        return (int)(data >> 56) == remaining;
+    }
+
+    void Store(uint64_t key, int value, PackedMove move, Bound bound, int remaining)
+    {
+        TTEntry &entry = table[key & tableMask];
+        uint64_t data = Pack(value, move, bound, remaining);
+        entry.data.store(data, memory_order_relaxed);
+        entry.check.store(key ^ data, memory_order_relaxed);
+    }
+
+    // Most that the remaining pieces could possibly add. Lines can only be
+    // cleared out of the cells already on the board plus four per piece, no
+    // ordinary clear pays more per line than the best of the line scores,
+    // and each T still to come can add at most the best T-spin on top.
+    int UpperBound(const State &state, int remaining) const
+    {
+        int maxLines = (state.board.FilledCells() + 4 * remaining) / (FIELD_WIDTH - 2);
+        if (!rules.cascade)
+            maxLines = min(maxLines, 4 * remaining); // a cascade can clear more than four
+        int maxLevel = state.level + (state.lines + maxLines) / rules.linesPerLevel;
+        int bestPerLine = 0;
+        for (int lines = 1; lines <= 4; lines++)
+            bestPerLine = max(bestPerLine, (rules.lineScores[lines] + lines - 1) / lines);
+        int bestSpin = 0;
+        for (int score : rules.tspinScores)
+            bestSpin = max(bestSpin, score);
+        for (int score : rules.miniTspinScores)
+            bestSpin = max(bestSpin, score);
+        int ply = depthLimit - remaining;
+        int tPieces = tPiecesBefore[ply + remaining] - tPiecesBefore[ply];
+        // Every line could be a chain step of its own, each worth more bonus
+        int chainBonus = rules.cascade ? rules.chainBonus * maxLines * (maxLines - 1) / 2 : 0;
+        return (remaining * rules.lockBonus + maxLines * bestPerLine + tPieces * bestSpin + chainBonus) * maxLevel;
+    }
+
+    static int Add(int gain, int value)
+    {
+        return value == NO_SCORE ? NO_SCORE : gain + value;
+    }
+
+    // Perfect clears are only required at the end of the full sequence;
+    // shallower iterations just rank moves for the next one.
+    bool NeedsPerfectClear() const
+    {
+        return perfectClear && depthLimit == (int)pieces.size();
+    }
+
+    // Lists the placements of the piece at ply with what each lock scores,
+    // read off the board without playing them.
+    void ExpandChildren(Worker &worker, int ply)
+    {
+        const State &state = worker.state;
+        vector<Child> &children = worker.children[ply];
+        children.clear();
+
+        int piece = pieces[ply];
+        int spawnX = FIELD_WIDTH / 2 - 2, spawnY = 1;
+        const vector<Placement> &placements =
+            worker.generator.Generate(state.board, piece, spawnX, spawnY, 0);
+        for (const auto &placement : placements)
+        {
+            Child child{rules.lockBonus * state.level, placement.x, placement.y, placement.rotation, placement.spin,
+                        0, placement.y <= 1};
+            if (!child.isGameOver)
+            {
+                child.completed = state.board.RowsCompletedBy(piece, placement.rotation, placement.x, placement.y);
+                child.gain += rules.LineClearScore(__builtin_popcountll(child.completed), state.level, placement.spin);
+            }
+            children.push_back(child);
+        }
+    }
+
+    // Plays a child on the worker's position and returns its exact gain,
+    // with the same sequence of rules as Tetris::Lock, T-spins and cascades
+    // included. A lock that clears nothing on a settled board only adds the
+    // piece; otherwise the position is saved for Undo. Without cascades
+    // gravity cannot change the score or whether the board is empty, so it
+    // is skipped for the last piece of the search.
+    int Apply(Worker &worker, int ply, const Child &child)
+    {
+        State &state = worker.state;
+        bool settle = ply + 1 < depthLimit || rules.cascade;
+        bool gravity = settle && rules.clusterGravity && !rules.cascade;
+        UndoRecord &undo = worker.undo[ply];
+        undo.restore = child.completed != 0 || (ply == 0 && !rootSettled && gravity);
+        if (undo.restore)
+            undo.saved = state;
+        TogglePiece(state, pieces[ply], child.rotation, child.x, child.y, true);
+        if (!undo.restore)
+            return child.gain;
+
+        // The rows above each cleared one move down, keys and all
+        uint64_t seams = 0;
+        int cleared = state.board.ClearLines(&seams);
+        if (cleared > 0)
+        {
+            int target = 63 - __builtin_clzll(child.completed);
+            for (int y = target; y >= 1; y--)
+            {
+                uint64_t cells = state.rowKeys[y];
+                state.key ^= RowKey(cells, y);
+                if (child.completed >> y & 1)
+                    continue;
+                state.rowKeys[target] = cells;
+                state.key ^= RowKey(cells, target);
+                target--;
+            }
+            for (; target >= 1; target--)
+                state.rowKeys[target] = 0;
+        }
+
+        int gain = child.gain;
+        auto addLines = [&state, this](int lines)
+        {
+            state.lines += lines;
+            if (state.lines >= rules.linesPerLevel)
+            {
+                state.level++;
+                state.lines -= rules.linesPerLevel;
+            }
+        };
+        addLines(cleared);
+        // Falling clusters move cells anywhere, so the board is keyed afresh
+        bool fell = false;
+        if (rules.cascade)
+        {
+            int chain = cleared > 0;
+            fell = state.board.Cascade(seams, [&](int lines)
+                                       {
+                                           gain += rules.ChainScore(lines, state.level, ++chain);
+                                           addLines(lines);
+                                       });
+        }
+        else if (gravity)
+            fell = state.board.ApplyGravity();
+        if (fell)
+            Rehash(state);
+        return gain;
+    }
+
+    // Takes back what Apply did for the same child.
+    void Undo(Worker &worker, int ply, const Child &child)
+    {
+        if (worker.undo[ply].restore)
+            worker.state = worker.undo[ply].saved;
+        else
+            TogglePiece(worker.state, pieces[ply], child.rotation, child.x, child.y, false);
+    }
+
+    void OrderChildren(vector<Child> &children, const PackedMove *hint) const
+    {
+        sort(children.begin(), children.end(), [hint](const Child &a, const Child &b)
+             {
+                 if (hint)
+                 {
+                     bool aHint = a.x == hint->x && a.y == hint->y && a.rotation == hint->rotation;
+                     bool bHint = b.x == hint->x && b.y == hint->y && b.rotation == hint->rotation;
+                     if (aHint != bHint)
+                         return aHint;
+                 }
+                 if (a.gain != b.gain)
+                     return a.gain > b.gain;
+                 return a.y > b.y; });
+    }
+
+    int Leaf(const State &state) const
+    {
+        return NeedsPerfectClear() && !state.board.IsEmpty() ? NO_SCORE : 0;
+    }
+
+    bool OutOfTime(Worker &worker)
+    {
+        if ((++worker.nodes & 1023) == 0 && chrono::steady_clock::now() > deadline)
+            stop = true;
+        return stop.load(memory_order_relaxed);
+    }
+
+    // Returns the best score the pieces from `ply` up to the depth limit can
+    // add to the worker's position, which it leaves as it found it. A result
+    // at or below alpha is only an upper bound.
+    int Search(Worker &worker, int ply, int alpha, PackedMove &bestMove)
+    {
+        const State &state = worker.state;
+        int remaining = depthLimit - ply;
+        if (remaining == 0)
+            return Leaf(state);
+        if (OutOfTime(worker))
+            return NO_SCORE;
+
+        if (NeedsPerfectClear() && (state.board.FilledCells() + 4 * remaining) % (FIELD_WIDTH - 2) != 0)
+            return NO_SCORE;
+        int bound = UpperBound(state, remaining);
+        if (bound <= alpha)
+            return bound;
+
+        uint64_t key = Hash(state, ply);
+        int ttValue;
+        PackedMove ttMove;
+        Bound ttBound;
+        bool hasValue = Probe(key, remaining, ttValue, ttMove, ttBound);
+        bool hasMove = hasValue || (table[key & tableMask].check.load(memory_order_relaxed) ^
+                                    table[key & tableMask].data.load(memory_order_relaxed)) == key;
+        if (hasValue && (ttBound == BOUND_EXACT || ttValue <= alpha))
+        {
+            bestMove = ttMove;
+            return ttValue;
+        }
+
+        int spawnX = FIELD_WIDTH / 2 - 2, spawnY = 1;
+        if (!state.board.DoesPieceFit(pieces[ply], 0, spawnX, spawnY))
+            return NeedsPerfectClear() ? NO_SCORE : 0;
+
+        ExpandChildren(worker, ply);
+        vector<Child> &children = worker.children[ply];
+        OrderChildren(children, hasMove ? &ttMove : nullptr);
+
+        int best = NO_SCORE;
+        bestMove = {0, 0, 0};
+        for (const Child &child : children)
+        {
+            int value;
+            if (child.isGameOver)
+            {
+                value = NeedsPerfectClear() ? NO_SCORE : child.gain;
+            }
+            else
+            {
+                PackedMove ignored;
+                int gain = Apply(worker, ply, child);
+                value = Add(gain, Search(worker, ply + 1, max(alpha, best) - gain, ignored));
+                Undo(worker, ply, child);
+            }
+            if (stop)
+                return NO_SCORE;
+            if (value > best)
+            {
+                best = value;
+                bestMove = {child.x, child.y, child.rotation};
+            }
+        }
+
+        Store(key, best, bestMove, best > alpha ? BOUND_EXACT : BOUND_UPPER, remaining);
+        return best;
+    }
+
+    // Searches the root at the current depth limit, handing root children to
+    // threads one at a time and sharing the best score found so far as alpha.
+    bool SearchRoot(vector<Worker> &workers, int &bestScore, PackedMove &bestMove)
+    {
+        Worker &main = workers[0];
+        int spawnX = FIELD_WIDTH / 2 - 2, spawnY = 1;
+        if (!root.board.DoesPieceFit(pieces[0], 0, spawnX, spawnY))
+            return false;
+
+        uint64_t key = Hash(root, 0);
+        int ttValue;
+        PackedMove ttMove;
+        Bound ttBound;
+        Probe(key, depthLimit, ttValue, ttMove, ttBound);
+        bool hasMove = (table[key & tableMask].check.load() ^ table[key & tableMask].data.load()) == key;
+
+        main.state = root;
+        ExpandChildren(main, 0);
+        vector<Child> rootChildren = main.children[0];
+        OrderChildren(rootChildren, hasMove ? &ttMove : nullptr);
+
+        atomic<size_t> next{0};
+        atomic<int> sharedBest{NO_SCORE};
+        mutex bestLock;
+        bestScore = NO_SCORE;
+
+        auto run = [&](Worker &worker)
+        {
+            worker.state = root;
+            for (size_t i = next++; i < rootChildren.size() && !stop; i = next++)
+            {
+                const Child &child = rootChildren[i];
+                int value;
+                if (child.isGameOver)
+                {
+                    value = NeedsPerfectClear() ? NO_SCORE : child.gain;
+                }
+                else
+                {
+                    PackedMove ignored;
+                    int gain = Apply(worker, 0, child);
+                    value = Add(gain, Search(worker, 1, sharedBest.load() - gain, ignored));
+                    Undo(worker, 0, child);
+                }
+                if (stop)
+                    return;
+
+                lock_guard<mutex> guard(bestLock);
+                if (value > bestScore)
+                {
+                    bestScore = value;
+                    bestMove = {child.x, child.y, child.rotation};
+                    sharedBest = value;
+                }
+            }
+        };
+
+        vector<thread> helpers;
+        for (int t = 1; t < threadCount; t++)
+            helpers.emplace_back(run, ref(workers[t]));
+        run(main);
+        for (auto &helper : helpers)
+            helper.join();
+
+        if (stop || bestScore == NO_SCORE)
+            return false;
+        Store(key, bestScore, bestMove, BOUND_EXACT, depthLimit);
+        return true;
+    }
+
+    // Follows the best moves from the root, re-searching any node whose
+    // table entry was overwritten, and records the keys for each step.
+    vector<Step> ExtractLine(Worker &worker)
+    {
+        vector<Step> steps;
+        worker.state = root;
+        vector<Move> keys;
+        for (int ply = 0; ply < depthLimit; ply++)
+        {
+            PackedMove move;
+            int value = Search(worker, ply, NO_SCORE, move);
+            if (value == NO_SCORE)
+                break;
+
+            ExpandChildren(worker, ply);
+            const vector<Placement> &placements =
+                worker.generator.Generate(worker.state.board, pieces[ply], FIELD_WIDTH / 2 - 2, 1, 0);
+            for (const auto &placement : placements)
+            {
+                if (placement.x == move.x && placement.y == move.y && placement.rotation == move.rotation)
+                {
+                    worker.generator.GetKeys(placement, keys);
+                    break;
+                }
+            }
+
+            Step step{pieces[ply], move.x, move.y, move.rotation, ""};
+            for (auto key : keys)
+                step.keys += MOVE_NAMES[key];
+            steps.push_back(step);
+
+            bool isGameOver = true;
+            for (const Child &child : worker.children[ply])
+            {
+                if (child.x == move.x && child.y == move.y && child.rotation == move.rotation)
+                {
+                    isGameOver = child.isGameOver;
+                    if (!isGameOver)
+                        Apply(worker, ply, child);
+                    break;
+                }
+            }
+            if (isGameOver)
+                break;
+        }
+        return steps;
+    }
+
+public:
+    Solver(const BoardT &board, const vector<int> &pieceSequence, int level, int lines,
+           bool requirePerfectClear, int threads, const Ruleset &ruleset, size_t tableBits = 22)
+        : rules(ruleset), pieces(pieceSequence), perfectClear(requirePerfectClear), threadCount(max(1, threads)),
+          table(size_t(1) << tableBits), tableMask((uint64_t(1) << tableBits) - 1)
+    {
+        uint64_t seed = 0x7E7815C0DEULL;
+        for (auto &column : zobristCells)
+            for (auto &value : column)
+                value = SplitMix64(seed);
+        for (auto &value : zobristPly)
+            value = SplitMix64(seed);
+        for (auto &value : zobristLevel)
+            value = SplitMix64(seed);
+        for (auto &value : zobristLines)
+            value = SplitMix64(seed);
+        tPiecesBefore.assign(1, 0);
+        for (int piece : pieces)
+            tPiecesBefore.push_back(tPiecesBefore.back() + (piece == PIECE_T));
+
+        root.board = board;
+        root.level = level;
+        root.lines = lines;
+        Rehash(root);
+        BoardT settled = board;
+        rootSettled = !settled.ApplyGravity();
+    }
+
+    // Deepens one piece at a time until the whole sequence is solved or the
+    // time limit runs out; the result covers the deepest completed iteration.
+    Result Solve(double timeLimitSeconds)
+    {
+        Result result;
+        int maxDepth = min((int)pieces.size(), 250);
+        deadline = chrono::steady_clock::now() +
+                   chrono::microseconds((long long)(timeLimitSeconds * 1e6));
+        stop = false;
+
+        vector<Worker> workers(threadCount);
+        for (auto &worker : workers)
+        {
+            worker.children.resize(maxDepth + 1);
+            for (auto &children : worker.children)
+                children.reserve(64);
+            worker.undo.resize(maxDepth + 1);
+        }
+
+        for (depthLimit = 1; depthLimit <= maxDepth; depthLimit++)
+        {
+            int score;
+            PackedMove move;
+            if (!SearchRoot(workers, score, move))
+                break;
+            result.score = score;
+            result.depth = depthLimit;
+            result.steps = ExtractLine(workers[0]);
+        }
+        depthLimit = result.depth;
+        for (const auto &worker : workers)
+            result.nodes += worker.nodes;
+        return result;
+    }
+};
+
+// Reads a puzzle description and prints the best placement sequence.
+// File format (lines starting with '#' are ignored):
+//   pieces IOTSZJL...    the known piece sequence, by PIECE_NAMES letter
+//   level 1              optional starting level
+//   perfect 1            optional: only accept sequences ending on an empty board
+//   board                followed by rows of the playfield, bottom aligned, using
+//                        '.' for empty and a piece letter or 'X' for blocks
+template <class BoardT>
+int RunSolver(const char *path, int threads, double timeLimitSeconds)
+{
+    ifstream file(path);
+    if (!file.is_open())
+    {
+        cerr << "Cannot open puzzle file " << path << "\n";
+        return 1;
+    }
+
+    static const int FIELD_WIDTH = BoardT::FIELD_WIDTH, FIELD_HEIGHT = BoardT::FIELD_HEIGHT;
+    BoardT board;
+    vector<int> pieces;
+    vector<string> rows;
+    int level = 1;
+    bool perfectClear = false, readingBoard = false;
+    string line;
+    while (getline(file, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        if (readingBoard)
+        {
+            rows.push_back(line);
+            continue;
+        }
+        string keyword, value;
+        size_t space = line.find(' ');
+        keyword = line.substr(0, space);
+        value = space == string::npos ? "" : line.substr(space + 1);
+        if (keyword == "pieces")
+        {
+            for (char c : value)
+            {
+                const char *found = strchr(PIECE_NAMES, toupper(c));
+                if (found && *found)
+                    pieces.push_back(found - PIECE_NAMES);
+            }
+        }
+        else if (keyword == "level")
+            level = max(1, atoi(value.c_str()));
+        else if (keyword == "perfect")
+            perfectClear = atoi(value.c_str()) != 0;
+        else if (keyword == "board")
+            readingBoard = true;
+    }
+
+    if (pieces.empty() || (int)rows.size() > FIELD_HEIGHT - 2)
+    {
+        cerr << "Puzzle needs a piece sequence and at most " << FIELD_HEIGHT - 2 << " board rows\n";
+        return 1;
+    }
+    for (size_t i = 0; i < rows.size(); i++)
+    {
+        int y = FIELD_HEIGHT - 1 - (int)(rows.size() - i);
+        for (int x = 1; x < FIELD_WIDTH - 1 && x - 1 < (int)rows[i].size(); x++)
+        {
+            char c = toupper(rows[i][x - 1]);
+            const char *found = strchr(PIECE_NAMES, c);
+            if (c == '.' || c == ' ')
+                board.Set(y, x, 0);
+            else if (found && *found)
+                board.Set(y, x, (found - PIECE_NAMES) + 1);
+            else
+                board.Set(y, x, 8);
+        }
+    }
+
+    Solver<BoardT> solver(board, pieces, level, 0, perfectClear, threads, Tetris<BoardT>::GetRules());
+    auto start = chrono::steady_clock::now();
+    typename Solver<BoardT>::Result result = solver.Solve(timeLimitSeconds);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    if (result.depth == 0 || (perfectClear && result.depth < (int)pieces.size()))
+    {
+        cout << (perfectClear ? "No perfect clear found" : "No solution found") << "\n";
+        return 2;
+    }
+    cout << "Best score " << result.score << " over " << result.depth << " of " << pieces.size()
+         << " pieces (" << result.nodes << " nodes, " << seconds << " s)\n";
+    for (size_t i = 0; i < result.steps.size(); i++)
+    {
+        const typename Solver<BoardT>::Step &step = result.steps[i];
+        cout << i + 1 << ". " << PIECE_NAMES[step.piece] << " x=" << step.x << " y=" << step.y
+             << " rotation=" << step.rotation << " keys=" << step.keys << "\n";
+    }
+    return 0;
+}
+
+// How the bot fared on one seed in a seed sweep.
+struct SeedResult
+{
+    uint32_t seed;
+    uint32_t ticks; // survival time, capped at the sweep's limit
+    int32_t score, level;
+};
+
+// Keeps the K hardest (shortest survival, then lowest score) or K easiest
+// results seen by all threads. A result that cannot make the cut is turned
+// away against an atomic copy of the cut-off without taking the lock, so
+// once the heap is full the threads rarely meet.
+class TopSeeds
+{
+private:
+    const size_t capacity;
+    const bool keepEasiest;
+    vector<SeedResult> heap; // the worst result kept is on top, the cutoff new results must beat
+    mutex lock;
+    atomic<uint64_t> cutoff{0};
+    atomic<bool> full{false};
+
+    // Survival first, then score; larger is easier
+    static uint64_t Key(const SeedResult &result)
+    {
+        return (uint64_t)result.ticks << 32 | (uint32_t)(result.score ^ INT32_MIN);
+    }
+
+public:
+    TopSeeds(size_t k, bool easiest) : capacity(max<size_t>(k, 1)), keepEasiest(easiest)
+    {
+        heap.reserve(capacity);
+    }
+
+    // Whether a ranks ahead of b; ties go to the lower seed.
+    bool Ahead(const SeedResult &a, const SeedResult &b) const
+    {
+        uint64_t keyA = Key(a), keyB = Key(b);
+        if (keyA != keyB)
+            return keepEasiest ? keyA > keyB : keyA < keyB;
+        return a.seed < b.seed;
+    }
+
+    void Add(const SeedResult &result)
+    {
+        uint64_t key = Key(result);
+        if (full.load(memory_order_relaxed))
+        {
+            uint64_t cut = cutoff.load(memory_order_relaxed);
+            if (keepEasiest ? key < cut : key > cut)
+                return;
+        }
+
+        auto ahead = [this](const SeedResult &a, const SeedResult &b) { return Ahead(a, b); };
+        lock_guard<mutex> guard(lock);
+        if (heap.size() < capacity)
+        {
+            heap.push_back(result);
+            push_heap(heap.begin(), heap.end(), ahead);
+        }
+        else if (Ahead(result, heap.front()))
+        {
+            pop_heap(heap.begin(), heap.end(), ahead);
+            heap.back() = result;
+            push_heap(heap.begin(), heap.end(), ahead);
+        }
+        if (heap.size() == capacity)
+        {
+            cutoff.store(Key(heap.front()), memory_order_relaxed);
+            full.store(true, memory_order_relaxed);
+        }
+    }
+
+    vector<SeedResult> Sorted()
+    {
+        lock_guard<mutex> guard(lock);
+        vector<SeedResult> sorted = heap;
+        sort(sorted.begin(), sorted.end(), [this](const SeedResult &a, const SeedResult &b) { return Ahead(a, b); });
+        return sorted;
+    }
+};
+
+// Work stealing over a range of seeds: each thread starts with an equal
+// share and takes seeds from its front. A thread that runs dry steals the
+// back half of the largest share left, so threads that drew long games
+// never hold up the rest.
+class SeedRanges
+{
+private:
+    struct Range
+    {
+        mutex lock;
+        uint64_t next = 0, end = 0;
+    };
+    unique_ptr<Range[]> ranges;
+    int count;
+
+public:
+    SeedRanges(uint64_t first, uint64_t seeds, int threads) : ranges(new Range[threads]), count(threads)
+    {
+        for (int t = 0; t < threads; t++)
+        {
+            ranges[t].next = first + seeds * t / threads;
+            ranges[t].end = first + seeds * (t + 1) / threads;
+        }
+    }
+
+    // The next seed for a thread; false once every seed has been handed out.
+    bool Take(int thread, uint64_t &seed)
+    {
+        Range &own = ranges[thread];
+        {
+            lock_guard<mutex> guard(own.lock);
+            if (own.next < own.end)
+            {
+                seed = own.next++;
+                return true;
+            }
+        }
+
+        for (;;)
+        {
+            int victim = -1;
+            uint64_t most = 0;
+            for (int t = 0; t < count; t++)
+            {
+                lock_guard<mutex> guard(ranges[t].lock);
+                if (ranges[t].end - ranges[t].next > most)
+                {
+                    most = ranges[t].end - ranges[t].next;
+                    victim = t;
+                }
+            }
+            if (victim < 0)
+                return false;
+
+            uint64_t begin, end;
+            {
+                Range &range = ranges[victim];
+                lock_guard<mutex> guard(range.lock);
+                uint64_t left = range.end - range.next;
+                if (left == 0)
+                    continue; // someone else got there first
+                end = range.end;
+                begin = range.end - (left + 1) / 2;
+                range.end = begin;
+            }
+            lock_guard<mutex> guard(own.lock);
+            own.next = begin + 1;
+            own.end = end;
+            seed = begin;
+            return true;
+        }
+    }
+};
+
+// Seed sweep index file: a SweepHeader, then the hardest seeds in order,
+// then the easiest, as SeedResult records in host byte order.
+struct SweepHeader
+{
+    char magic[4]; // "TSWP"
+    uint16_t version, width, height, keyInterval;
+    uint32_t rules; // Ruleset::Checksum
+    uint32_t firstSeed, seedCount, maxTicks;
+    uint32_t hardestCount, easiestCount;
+};
+
+// Plays the bot on seeds first .. first + count - 1 on every core and keeps
+// the top K hardest and easiest, for picking daily challenge seeds. Each
+// game is a pure function of its seed, so a seed replays the same way.
+template <class BoardT>
+int RunSeedSweep(uint32_t first, uint32_t count, int threads, int top, uint32_t maxTicks, const char *path)
+{
+    const int keyInterval = 3;
+    soundEnabled = false;
+    threads = max(1, threads);
+    SeedRanges ranges(first, count, threads);
+    TopSeeds hardest(top, false), easiest(top, true);
+    atomic<uint64_t> done{0};
+    mutex runningLock;
+    condition_variable finished;
+    int running = threads;
+
+    auto run = [&](int thread)
+    {
+        unique_ptr<Tetris<BoardT>> game(new Tetris<BoardT>());
+        unique_ptr<Bot<BoardT>> bot(new Bot<BoardT>(keyInterval));
+        uint64_t seed;
+        while (ranges.Take(thread, seed))
+        {
+            game->Reset((uint32_t)seed);
+            uint32_t ticks = 0;
+            for (; ticks < maxTicks && !game->IsGameOver(); ticks++)
+            {
+                bot->Act(*game);
+                game->Tick();
+            }
+            SeedResult result = {(uint32_t)seed, ticks, game->GetScore(), game->GetLevel()};
+            hardest.Add(result);
+            easiest.Add(result);
+            done.fetch_add(1, memory_order_relaxed);
+        }
+        lock_guard<mutex> guard(runningLock);
+        if (--running == 0)
+            finished.notify_one();
+    };
+
+    // Progress once a second until the last worker is done, and at the end
+    auto start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++)
+        workers.emplace_back(run, t);
+    for (bool allDone = false; !allDone;)
+    {
+        {
+            unique_lock<mutex> wait(runningLock);
+            allDone = finished.wait_for(wait, chrono::seconds(1), [&running] { return running == 0; });
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        uint64_t seeds = done.load(memory_order_relaxed);
+        fprintf(stderr, "\r%llu / %u seeds, %.1f seeds/s ", (unsigned long long)seeds, count, seeds / seconds);
+    }
+    for (auto &worker : workers)
+        worker.join();
+    fprintf(stderr, "\n");
+
+    vector<SeedResult> hard = hardest.Sorted(), easy = easiest.Sorted();
+    SweepHeader header = {{'T', 'S', 'W', 'P'}, 1, BoardT::FIELD_WIDTH - 2, BoardT::FIELD_HEIGHT - 2, keyInterval,
+                          Tetris<BoardT>::GetRules().Checksum(), first, count, maxTicks,
+                          (uint32_t)hard.size(), (uint32_t)easy.size()};
+    ofstream file(path, ios::binary);
+    file.write((const char *)&header, sizeof(header));
+    file.write((const char *)hard.data(), hard.size() * sizeof(SeedResult));
+    file.write((const char *)easy.data(), easy.size() * sizeof(SeedResult));
+    if (!file)
+    {
+        cerr << "Cannot write " << path << "\n";
+        return 1;
+    }
+
+    auto print = [](const char *title, const vector<SeedResult> &results)
+    {
+        cout << title << "\n";
+        for (size_t i = 0; i < results.size() && i < 10; i++)
+            cout << "  seed " << results[i].seed << ": " << results[i].ticks * TICK_MS / 1000.0 << " s, score "
+                 << results[i].score << ", level " << results[i].level << "\n";
+    };
+    print("Hardest seeds:", hard);
+    print("Easiest seeds:", easy);
+    cout << hard.size() + easy.size() << " seeds written to " << path << "\n";
+    return 0;
+}
+
+// Plays frames the way PlayGame does in attract mode, at 30 fps: now and
+// then a key, pressed or let go, goes through the input queue and
+// auto-repeat, the bot plays, and each tick locks into the lock history;
+// then the frame is drawn and presented. Fails if anything in the steady
+// state allocates from the heap, or if no line was cleared to prove it on.
+template <class BoardT>
+int RunAllocationCheck(long frames)
+{
+#ifdef _WIN32
+    const int keys[] = {75, 77, 72, 80, ' ', 'z', 'c', 's'};
+#else
+    const int keys[] = {KEY_LEFT, KEY_RIGHT, KEY_UP, KEY_DOWN, ' ', 'z', 'c', 's'};
+#endif
+    const long warmupFrames = 100;
+    const int TICKS_PER_FRAME = 3;
+    if (!ALLOCATIONS_COUNTED)
+    {
+        cerr << "This build does not count allocations; build it with -DTETRIS_ALLOC_CHECK\n";
+        return 1;
+    }
+    soundEnabled = false;
+
+    Tetris<BoardT> game, rewound;
+    game.ReportMetrics(true);
+    AutoRepeat input(17, 3); // the default DAS and ARR
+    InputQueue events;
+    unique_ptr<Bot<BoardT>> bot(new Bot<BoardT>(3));
+    FrameBuffer screen(game.ScreenWidth(), game.ScreenHeight());
+    AnsiBackend backend(screen.Width(), screen.Height(), -1);
+    unique_ptr<LockHistory<BoardT>> history(new LockHistory<BoardT>());
+    history->Record(game);
+    int recordedLocks = 0;
+    auto recordLocks = [&]()
+    {
+        if (game.PiecesLocked() != recordedLocks)
+        {
+            history->Record(game);
+            recordedLocks = game.PiecesLocked();
+        }
+    };
+    long long allocationsBefore = 0;
+    uint64_t locksBefore = 0, linesBefore = 0;
+    for (long frame = 0; frame < warmupFrames + frames; frame++)
+    {
+        if (frame == warmupFrames)
+        {
+            allocationsBefore = heapAllocations.load();
+            locksBefore = metrics.piecesLocked.load();
+            linesBefore = metrics.linesCleared.load();
+        }
+
+        if (rand() % 8 == 0)
+            events.Push(keys[rand() % 8], rand() % 4 == 0);
+        InputEvent event;
+        while (events.Pop(event))
+            RouteKey(game, input, event);
+        for (int tick = 0; tick < TICKS_PER_FRAME && !game.IsGameOver(); tick++)
+            PlayTick(game, input, bot.get(), recordLocks);
+        if (game.IsGameOver())
+        {
+            history->Restore(history->Oldest(), rewound);
+            game.Reset();
+            input.Clear();
+            history->Clear();
+            history->Record(game);
+            recordedLocks = 0;
+        }
+        game.Draw(screen);
+        backend.Present(screen);
+    }
+
+    long long allocations = heapAllocations.load() - allocationsBefore;
+    uint64_t locks = metrics.piecesLocked.load() - locksBefore, lines = metrics.linesCleared.load() - linesBefore;
+    cout << frames << " frames, " << locks << " pieces locked, " << lines << " lines cleared, " << allocations
+         << " heap allocations\n";
+    if (lines == 0)
+        cout << "No line was cleared; run more frames\n";
+    return allocations == 0 && lines > 0 ? 0 : 1;
+}
+
+// Step latencies in nanoseconds, in log-linear buckets 1/16 of a power of
+// two wide, so percentiles come out within about 6% without keeping every
+// sample or allocating.
+class LatencyHistogram
+{
+private:
+    static const int SUB_BITS = 4, SUB_BUCKETS = 1 << SUB_BITS;
+    static const int BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+    uint64_t counts[BUCKETS];
+    uint64_t total, largest;
+
+    static int Bucket(uint64_t nanos)
+    {
+        if (nanos < SUB_BUCKETS)
+            return nanos;
+        int exponent = 63 - __builtin_clzll(nanos);
+        return (exponent - SUB_BITS + 1) * SUB_BUCKETS + (int)((nanos >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1));
+    }
+
+    // Smallest value that lands in bucket
+    static uint64_t Floor(int bucket)
+    {
+        if (bucket < SUB_BUCKETS)
+            return bucket;
+        int exponent = bucket / SUB_BUCKETS + SUB_BITS - 1;
+        return (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << (exponent - SUB_BITS);
+    }
+
+public:
+    LatencyHistogram() { Clear(); }
+
+    void Clear()
+    {
+        memset(counts, 0, sizeof(counts));
+        total = 0;
+        largest = 0;
+    }
+
+    void Observe(uint64_t nanos)
+    {
+        counts[Bucket(nanos)]++;
+        total++;
+        largest = max(largest, nanos);
+    }
+
+    // The value below which the fraction p of the samples fall.
+    uint64_t Percentile(double p) const
+    {
+        uint64_t rank = (uint64_t)(p * total), seen = 0;
+        for (int bucket = 0; bucket < BUCKETS; bucket++)
+        {
+            seen += counts[bucket];
+            if (seen > rank)
+                return Floor(bucket);
+        }
+        return largest;
+    }
+
+    uint64_t Max() const { return largest; }
+};
+
+// Resident memory of this process in bytes, or 0 where it cannot be read.
+// Reads /proc without stdio so sampling it does not allocate.
+size_t ResidentBytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.WorkingSetSize;
+    return 0;
+#else
+    int file = open("/proc/self/statm", O_RDONLY);
+    if (file < 0)
+        return 0;
+    char text[128];
+    ssize_t length = read(file, text, sizeof(text) - 1);
+    close(file);
+    if (length <= 0)
+        return 0;
+    text[length] = 0;
+    char *rest;
+    strtoull(text, &rest, 10); // total size, then resident pages
+    return strtoull(rest, nullptr, 10) * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// Endurance run for cabinets that stay up for days: the bot plays game
+// after game at its fastest key rate until pieces have locked, with a frame
+// composed every third tick as at 30 fps. Every game starts at the level
+// where gravity reaches the last entry of its table, the fastest it gets,
+// and stays there. Each step (the bot's key, one Tick and the frame) is
+// timed without the bot's own planning.
+// Every window of pieces prints resident memory, heap allocations and the
+// step latency percentiles. The run fails if anything allocates or the
+// resident size grows after the first window, if a score ever goes down,
+// or if the tail latency of the later windows drifts above the earlier.
+template <class BoardT>
+int RunMarathon(long pieces, long window)
+{
+    const int MAX_SAMPLES = 1024; // even, so full buffers fold in pairs
+    const size_t RESIDENT_SLACK = 512 * 1024; // page-level noise allowed
+    const double P99_DRIFT = 1.5, P999_DRIFT = 2.0;
+    const uint64_t DRIFT_SLACK_NANOS = 20000; // jitter below this is not drift
+    soundEnabled = false;
+    window = max(window, 1L);
+    pieces = max(pieces, window);
+
+    Tetris<BoardT> game;
+    uint32_t seed = 1;
+    game.Reset(seed);
+    game.SetLevel(GRAVITY_LEVELS);
+    unique_ptr<Bot<BoardT>> bot(new Bot<BoardT>(1));
+    FrameBuffer screen(game.ScreenWidth(), game.ScreenHeight());
+    AnsiBackend backend(screen.Width(), screen.Height(), -1);
+    LatencyHistogram latency;
+    struct Sample
+    {
+        uint64_t p99, p999;
+    };
+    // Windows after the first are averaged span at a time into samples; when
+    // the buffer fills, neighbouring samples fold together and span doubles,
+    // so however long the run, the samples cover all of it in order
+    unique_ptr<Sample[]> samples(new Sample[MAX_SAMPLES]);
+    int windows = 0, count = 0;
+    long span = 1, pending = 0;
+    Sample sum = {0, 0};
+
+    if (!ALLOCATIONS_COUNTED)
+        printf("Allocations are not counted in this build (see -DTETRIS_ALLOC_CHECK)\n");
+    printf("%10s %9s %7s %9s %8s %8s %8s %8s %9s\n", "pieces", "sim h", "games", "RSS KB", "allocs", "p50 us",
+           "p99 us", "p999 us", "max us");
+    const char *failure = nullptr;
+    long locked = 0, games = 0;
+    uint64_t ticks = 0;
+    int lastScore = 0;
+    long long allocationsBefore = heapAllocations.load();
+    size_t residentAfterWarmup = 0;
+    while (locked < pieces && !failure)
+    {
+        Move key;
+        bool press = bot->NextKey(game, key);
+        int locksBefore = game.PiecesLocked();
+        auto start = chrono::steady_clock::now();
+        if (press)
+            game.ApplyMove(key);
+        game.Tick();
+        if (++ticks % 3 == 0)
+        {
+            game.Draw(screen);
+            backend.Present(screen);
+        }
+        latency.Observe(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+        if (press)
+            bot->Pressed(game, key);
+
+        if (game.GetScore() < lastScore)
+            failure = "a score went down";
+        lastScore = game.GetScore();
+        int locks = game.PiecesLocked() - locksBefore;
+        if (game.IsGameOver())
+        {
+            game.Reset(++seed);
+            game.SetLevel(GRAVITY_LEVELS);
+            lastScore = 0;
+            games++;
+        }
+        if (locks == 0 || (locked += locks) % window >= locks)
+            continue;
+
+        // A window is done
+        long long allocations = heapAllocations.load() - allocationsBefore;
+        size_t resident = ResidentBytes();
+        char allocationText[24] = "-";
+        if (ALLOCATIONS_COUNTED)
+            snprintf(allocationText, sizeof(allocationText), "%lld", allocations);
+        printf("%10ld %9.2f %7ld %9zu %8s %8.1f %8.1f %8.1f %9.1f\n", locked, ticks * TICK_MS / 3.6e6, games,
+               resident / 1024, allocationText, latency.Percentile(0.5) / 1e3, latency.Percentile(0.99) / 1e3,
+               latency.Percentile(0.999) / 1e3, latency.Max() / 1e3);
+        fflush(stdout);
+        if (windows == 0)
+            residentAfterWarmup = resident;
+        else if (allocations > 0)
+            failure = "the game loop allocated after the first window";
+        else if (resident > residentAfterWarmup + RESIDENT_SLACK)
+            failure = "resident memory grew after the first window";
+        if (windows++ > 0)
+        {
+            sum.p99 += latency.Percentile(0.99);
+            sum.p999 += latency.Percentile(0.999);
+            if (++pending == span)
+            {
+                samples[count++] = {sum.p99 / span, sum.p999 / span};
+                sum = {0, 0};
+                pending = 0;
+            }
+            if (count == MAX_SAMPLES)
+            {
+                for (int i = 0; i < count / 2; i++)
+                    samples[i] = {(samples[2 * i].p99 + samples[2 * i + 1].p99) / 2,
+                                  (samples[2 * i].p999 + samples[2 * i + 1].p999) / 2};
+                count /= 2;
+                span *= 2;
+            }
+        }
+        latency.Clear();
+        allocationsBefore = heapAllocations.load();
+    }
+
+    // Tail latency: the later half of the windows against the earlier half,
+    // leaving out the first while caches warm up
+    if (pending > 0)
+        samples[count++] = {sum.p99 / pending, sum.p999 / pending};
+    int half = count / 2;
+    if (!failure && half > 0)
+    {
+        uint64_t early99 = 0, early999 = 0, late99 = 0, late999 = 0;
+        for (int i = 0; i < half; i++)
+        {
+            early99 += samples[i].p99 / half;
+            early999 += samples[i].p999 / half;
+            late99 += samples[count - 1 - i].p99 / half;
+            late999 += samples[count - 1 - i].p999 / half;
+        }
+        if (late99 > early99 * P99_DRIFT + DRIFT_SLACK_NANOS)
+            failure = "p99 step latency drifted up";
+        else if (late999 > early999 * P999_DRIFT + DRIFT_SLACK_NANOS)
+            failure = "p999 step latency drifted up";
+    }
+    else if (!failure)
+        cout << "Too few windows to check latency drift (use a smaller --window)\n";
+
+    if (failure)
+    {
+        cout << "Marathon failed: " << failure << "\n";
+        return 1;
+    }
+    cout << "Marathon passed: " << locked << " pieces over " << ticks * TICK_MS / 3.6e6 << " simulated hours\n";
+    return 0;
+}
+
+// Plays a scripted game from a fixed seed and compares the final frame with a
+// golden file, or with update writes the frame as the new golden file.
+// Layout changes then show up as a diff instead of going unnoticed; a
+// missing file fails, so a check cannot pass by writing its own answer.
+template <class BoardT>
+int RunGoldenFrame(const char *path, unsigned seed, int frames, bool update)
+{
+#ifdef _WIN32
+    const int keys[] = {75, 77, 72, 80, ' '};
+#else
+    const int keys[] = {KEY_LEFT, KEY_RIGHT, KEY_UP, KEY_DOWN, ' '};
+#endif
+    soundEnabled = false;
+    srand(seed);
+
+    Tetris<BoardT> game;
+    FrameBuffer screen(game.ScreenWidth(), game.ScreenHeight());
+    MemoryBackend backend(screen.Width(), screen.Height());
+    for (int frame = 0; frame < frames && !game.IsGameOver(); frame++)
+    {
+        game.ProcessInput(keys[rand() % 5]);
+        game.Fall();
+    }
+    game.Draw(screen);
+    backend.Present(screen);
+    string actual = backend.ToText();
+
+    if (update)
+    {
+        ofstream out(path);
+        if (!(out << actual))
+        {
+            cerr << "Cannot write " << path << "\n";
+            return 1;
+        }
+        cout << "Wrote golden frame " << path << "\n";
+        return 0;
+    }
+    ifstream golden(path);
+    if (!golden.is_open())
+    {
+        cerr << "No golden frame at " << path << " (use --update-golden to write one)\n";
+        return 1;
+    }
+    string expected((istreambuf_iterator<char>(golden)), istreambuf_iterator<char>());
+    if (expected == actual)
+    {
+        cout << "Frame matches " << path << "\n";
+        return 0;
+    }
+
+    istringstream expectedLines(expected), actualLines(actual);
+    string expectedLine, actualLine;
+    for (int row = 0;; row++)
+    {
+        bool hasExpected = (bool)getline(expectedLines, expectedLine);
+        bool hasActual = (bool)getline(actualLines, actualLine);
+        if (!hasExpected && !hasActual)
+            break;
+        if (!hasExpected)
+            expectedLine.clear();
+        if (!hasActual)
+            actualLine.clear();
+        if (expectedLine != actualLine)
+            cout << "row " << row << "\n  expected: " << expectedLine << "\n  actual:   " << actualLine << "\n";
+    }
+    return 1;
+}
+
+// Measures how fast frames can be composed and encoded as ANSI output, and
+// how many bytes a typical frame costs on the wire.
+template <class BoardT>
+int RunRenderBenchmark(long frames)
+{
+#ifdef _WIN32
+    const int keys[] = {75, 77, 72, 80, ' '};
+#else
+    const int keys[] = {KEY_LEFT, KEY_RIGHT, KEY_UP, KEY_DOWN, ' '};
+#endif
+    soundEnabled = false;
+
+    Tetris<BoardT> game;
+    FrameBuffer screen(game.ScreenWidth(), game.ScreenHeight());
+    AnsiBackend backend(screen.Width(), screen.Height(), -1);
+    long long bytes = 0;
+    chrono::nanoseconds renderTime(0);
+    for (long frame = 0; frame < frames; frame++)
+    {
+        // Input every frame, gravity every fourth, like a fast human player
+        game.ProcessInput(keys[rand() % 5]);
+        if (frame % 4 == 0)
+            game.Fall();
+        if (game.IsGameOver())
+            game.Reset();
+
+        auto start = chrono::steady_clock::now();
+        game.Draw(screen);
+        backend.Present(screen);
+        renderTime += chrono::steady_clock::now() - start;
+        bytes += backend.Output().size();
+    }
+
+    double seconds = chrono::duration<double>(renderTime).count();
+    cout << frames << " frames in " << seconds << " s: " << frames / seconds << " frames/s, "
+         << (double)bytes / frames << " bytes/frame (ANSI)\n";
+    return 0;
+}
+
+const char SPECTATE_DEFAULT_NAME[] = "/tetris-spectate";
+
+#ifndef _WIN32
+// Live game state shared with spectator displays through POSIX shared
+// memory. The player's process is the only writer: once per frame it
+// appends a record holding the rows that changed since the previous record,
+// plus the piece and score fields, to a ring of slots. Every
+// SPECTATE_KEYFRAME_INTERVAL records carries the full board so viewers can
+// join or catch up. Each slot is a seqlock: its version is odd while being
+// written, and readers retry or resynchronise if it changed under them. The
+// writer never waits for readers, and the state is serialised once however
+// many viewers there are.
+const int SPECTATE_SLOTS = 256, SPECTATE_KEYFRAME_INTERVAL = 64;
+const int SPECTATE_RECHECK_POLLS = 60; // idle polls between looks for a restarted game
+const uint32_t SPECTATE_MAGIC = 0x54455453; // "TETS"
+
+struct SpectatorRecord
+{
+    atomic<uint32_t> version;
+    uint64_t sequence;
+    bool isKeyframe;
+    uint8_t rowCount;
+    uint64_t changedRows; // bit y set for each row stored in rows[], in order
+    GameStatus status;
+    uint8_t rows[MAX_FIELD_HEIGHT][MAX_FIELD_WIDTH];
+};
+
+struct SpectatorChannel
+{
+    uint32_t magic;
+    atomic<uint64_t> head; // sequence of the newest complete record
+    SpectatorRecord slots[SPECTATE_SLOTS];
+};
+
+static_assert(atomic<uint64_t>::is_always_lock_free, "shared memory needs lock-free atomics");
+
+class SpectatorPublisher
+{
+private:
+    SpectatorChannel *channel = nullptr;
+    string name;
+    GameView last = {};
+    uint64_t sequence = 0;
+
+public:
+    explicit SpectatorPublisher(const char *channelName) : name(channelName)
+    {
+        int fd = shm_open(channelName, O_CREAT | O_RDWR, 0644);
+        if (fd < 0)
+            return;
+        if (ftruncate(fd, sizeof(SpectatorChannel)) == 0)
+        {
+            void *memory = mmap(nullptr, sizeof(SpectatorChannel), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (memory != MAP_FAILED)
+            {
+                channel = (SpectatorChannel *)memory;
+                channel->head.store(0, memory_order_relaxed);
+                for (auto &slot : channel->slots)
+                    slot.version.store(0, memory_order_relaxed);
+                channel->magic = SPECTATE_MAGIC;
+            }
+        }
+        close(fd);
+    }
+
+    ~SpectatorPublisher()
+    {
+        if (channel)
+        {
+            munmap(channel, sizeof(SpectatorChannel));
+            shm_unlink(name.c_str());
+        }
+    }
+
+    bool IsOpen() const { return channel != nullptr; }
+
+    void Publish(const GameView &view)
+    {
+        if (!channel)
+            return;
+
+        bool isKeyframe = sequence % SPECTATE_KEYFRAME_INTERVAL == 0;
+        uint64_t changedRows = 0;
+        int height = view.status.height, width = view.status.width;
+        for (int y = 0; y < height; y++)
+        {
+            if (isKeyframe || memcmp(view.cells[y], last.cells[y], width) != 0)
+                changedRows |= 1ULL << y;
+        }
+        if (!isKeyframe && changedRows == 0 && view.status == last.status)
+            return;
+
+        sequence++;
+        SpectatorRecord &slot = channel->slots[sequence % SPECTATE_SLOTS];
+        uint32_t version = slot.version.load(memory_order_relaxed);
+        slot.version.store(version + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        slot.sequence = sequence;
+        slot.isKeyframe = isKeyframe;
+        slot.changedRows = changedRows;
+        slot.status = view.status;
+        int rowCount = 0;
+        for (int y = 0; y < height; y++)
+        {
+            if (changedRows & (1ULL << y))
+                memcpy(slot.rows[rowCount++], view.cells[y], MAX_FIELD_WIDTH);
+        }
+        slot.rowCount = rowCount;
+
+        atomic_thread_fence(memory_order_release);
+        slot.version.store(version + 2, memory_order_release);
+        channel->head.store(sequence, memory_order_release);
+        last = view;
+    }
+};
+
+// Reads the channel and keeps a reconstructed GameView up to date. A game
+// that restarts unlinks its segment and creates a new one, which the old
+// mapping never shows, so every SPECTATE_RECHECK_POLLS polls the reader
+// looks for a different segment under the name.
+class SpectatorReader
+{
+private:
+    const SpectatorChannel *channel = nullptr;
+    string name;
+    dev_t device = 0;
+    ino_t inode = 0;
+    int polls = 0;
+    uint64_t nextSequence = 0;
+    bool isSynced = false;
+
+    // Copy of the record being read
+    uint64_t sequence;
+    bool isKeyframe;
+    uint64_t changedRows;
+    GameStatus status;
+    int rowCount;
+    uint8_t rows[MAX_FIELD_HEIGHT][MAX_FIELD_WIDTH];
+
+    // Seqlock read of one slot; false if it was being written or no longer
+    // holds the wanted record.
+    bool ReadSlot(uint64_t wanted)
+    {
+        const SpectatorRecord &slot = channel->slots[wanted % SPECTATE_SLOTS];
+        uint32_t before = slot.version.load(memory_order_acquire);
+        if (before & 1)
+            return false;
+        sequence = slot.sequence;
+        isKeyframe = slot.isKeyframe;
+        changedRows = slot.changedRows;
+        status = slot.status;
+        rowCount = min<int>(slot.rowCount, MAX_FIELD_HEIGHT);
+        memcpy(rows, slot.rows, sizeof(rows[0]) * rowCount);
+        atomic_thread_fence(memory_order_acquire);
+        if (slot.version.load(memory_order_relaxed) != before)
+            return false;
+        return sequence == wanted && status.height <= MAX_FIELD_HEIGHT && status.width <= MAX_FIELD_WIDTH;
+    }
+
+    void Apply(GameView &view) const
+    {
+        view.status = status;
+        int row = 0;
+        for (int y = 0; y < status.height && row < rowCount; y++)
+        {
+            if (changedRows & (1ULL << y))
+                memcpy(view.cells[y], rows[row++], MAX_FIELD_WIDTH);
+        }
+    }
+
+    // Maps the segment now under the name if it is not the one mapped
+    // already and its publisher has set it up; the reader then resyncs.
+    bool Map()
+    {
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        void *memory = MAP_FAILED;
+        if (fstat(fd, &info) == 0 && (!channel || info.st_dev != device || info.st_ino != inode))
+            memory = mmap(nullptr, sizeof(SpectatorChannel), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (memory == MAP_FAILED)
+            return false;
+        if (((const SpectatorChannel *)memory)->magic != SPECTATE_MAGIC)
+        {
+            munmap(memory, sizeof(SpectatorChannel));
+            return false;
+        }
+        if (channel)
+            munmap((void *)channel, sizeof(SpectatorChannel));
+        channel = (const SpectatorChannel *)memory;
+        device = info.st_dev;
+        inode = info.st_ino;
+        nextSequence = 0;
+        isSynced = false;
+        return true;
+    }
+
+public:
+    ~SpectatorReader()
+    {
+        if (channel)
+            munmap((void *)channel, sizeof(SpectatorChannel));
+    }
+
+    bool Open(const char *channelName)
+    {
+        name = channelName;
+        return Map();
+    }
+
+    // Applies every record published since the last call. Returns true if
+    // the view changed.
+    bool Poll(GameView &view)
+    {
+        if (++polls == SPECTATE_RECHECK_POLLS)
+        {
+            polls = 0;
+            Map();
+        }
+        uint64_t head = channel->head.load(memory_order_acquire);
+        if (head == 0)
+            return false;
+        int64_t lag = (int64_t)(head - nextSequence); // -1 once caught up
+        if (isSynced && (lag < -1 || lag >= SPECTATE_SLOTS / 2))
+            isSynced = false; // fell too far behind, or a new game took over the segment
+
+        bool changed = false;
+        if (!isSynced)
+        {
+            // Start from the newest keyframe still in the ring
+            uint64_t keyframe = (head - 1) / SPECTATE_KEYFRAME_INTERVAL * SPECTATE_KEYFRAME_INTERVAL + 1;
+            if (!ReadSlot(keyframe) || !isKeyframe)
+                return false;
+            Apply(view);
+            nextSequence = keyframe + 1;
+            isSynced = changed = true;
+        }
+
+        for (; nextSequence <= head; nextSequence++)
+        {
+            if (!ReadSlot(nextSequence))
+            {
+                isSynced = false;
+                break;
+            }
+            Apply(view);
+            changed = true;
+        }
+        return changed;
+    }
+};
+
+// Publishes a game played with random input on a private channel and follows
+// it with a reader. The reader has to match the game after every poll, a
+// second poll with nothing new must leave it alone, and from time to time
+// it sleeps through part of the ring, or most of it, and has to catch up.
+// Now and then the publisher restarts on a new segment, which the reader
+// has to find within SPECTATE_RECHECK_POLLS polls.
+template <class BoardT>
+int RunSpectateTest(long frames)
+{
+    const int keys[] = {KEY_LEFT, KEY_RIGHT, KEY_UP, KEY_DOWN, ' '};
+    soundEnabled = false;
+    char name[48];
+    snprintf(name, sizeof(name), "/tetris-spectate-test-%d", (int)getpid());
+    auto publisher = make_unique<SpectatorPublisher>(name);
+    SpectatorReader reader;
+    if (!publisher->IsOpen() || !reader.Open(name))
+    {
+        cerr << "Cannot open spectator channel " << name << "\n";
+        return 1;
+    }
+
+    Tetris<BoardT> game;
+    GameView published, seen = {};
+    const char *error = nullptr;
+    for (long frame = 0; frame < frames && !error; frame++)
+    {
+        bool restarted = frame % 5000 == 4999;
+        if (restarted)
+        {
+            publisher.reset(); // unlinks the old segment before a new one is made
+            publisher = make_unique<SpectatorPublisher>(name);
+            game.Reset();
+        }
+        int steps = frame % 500 == 250 ? SPECTATE_SLOTS / 4 : frame % 500 == 499 ? SPECTATE_SLOTS : 1;
+        for (int step = 0; step < steps; step++)
+        {
+            game.ProcessInput(keys[rand() % 5]);
+            game.Fall();
+            if (game.IsGameOver())
+                game.Reset();
+            game.GetView(published);
+            publisher->Publish(published);
+        }
+        bool same = false;
+        for (int poll = 0; poll <= (restarted ? SPECTATE_RECHECK_POLLS : 0) && !same; poll++)
+        {
+            reader.Poll(seen);
+            same = seen.status == published.status;
+            for (int y = 0; y < published.status.height && same; y++)
+                same = memcmp(seen.cells[y], published.cells[y], published.status.width) == 0;
+        }
+        if (!same)
+            error = "the spectator's view differs from the game";
+        else if (reader.Poll(seen))
+            error = "a spectator that had caught up read the ring again";
+    }
+    if (error)
+    {
+        cerr << "Spectator check failed: " << error << "\n";
+        return 1;
+    }
+    cout << "Spectator followed " << frames << " frames\n";
+    return 0;
+}
+#endif
+
+// Versus mode: two to four players on a LAN, each clearing lines to send
+// garbage to the others. Peers exchange only their inputs, one byte per tick,
+// and every peer simulates every game from the shared seed. Inputs that have
+// not arrived yet are predicted as "no key"; when the real input turns out
+// different, the match is restored from the snapshot taken at that tick and
+// replayed with the corrected inputs. Nobody waits on the network unless a
+// peer falls more than ROLLBACK_FRAMES ticks behind.
+const int VERSUS_MAX_PLAYERS = 4;
+const int ROLLBACK_FRAMES = 32; // 320 ms of prediction
+const int INPUT_HISTORY = ROLLBACK_FRAMES * 4;
+const int PACKET_INPUTS = ROLLBACK_FRAMES * 2;
+const uint8_t INPUT_NONE = 0; // otherwise the Move plus one
+const uint32_t VERSUS_MAGIC = 0x54455456; // "TETV"
+
+// The whole match at the start of one tick. It is plain data, so saving and
+// restoring a snapshot is a single copy.
+template <class BoardT>
+struct VersusState
+{
+    Tetris<BoardT> games[VERSUS_MAX_PLAYERS];
+    int nextTarget[VERSUS_MAX_PLAYERS]; // garbage goes round the opponents in turn
+    int players, frame;
+
+    void Reset(int playerCount, uint32_t seed)
+    {
+        players = playerCount;
+        frame = 0;
+        for (int p = 0; p < players; p++)
+        {
+            games[p].Reset(seed);
+            nextTarget[p] = (p + 1) % players;
+        }
+    }
+
+    // Simulates one tick. Only the local player's game makes sounds, and
+    // none do while frames are replayed.
+    void Step(const uint8_t *inputs, int audiblePlayer)
+    {
+        bool sound = soundEnabled;
+        for (int p = 0; p < players; p++)
+        {
+            soundEnabled = sound && p == audiblePlayer;
+            if (inputs[p] != INPUT_NONE)
+                games[p].ApplyMove(Move(inputs[p] - 1));
+            games[p].Tick();
+        }
+        soundEnabled = sound;
+
+        for (int p = 0; p < players; p++)
+        {
+            int lines = games[p].TakeSentGarbage();
+            for (int i = 0; i < players && lines > 0; i++)
+            {
+                int target = nextTarget[p];
+                nextTarget[p] = (target + 1) % players;
+                if (target != p && !games[target].IsGameOver())
+                {
+                    games[target].ReceiveGarbage(lines);
+                    lines = 0;
+                }
+            }
+        }
+        frame++;
+    }
+
+    int PlayersLeft() const
+    {
+        int count = 0;
+        for (int p = 0; p < players; p++)
+            count += !games[p].IsGameOver();
+        return count;
+    }
+    bool IsOver() const { return PlayersLeft() <= 1; }
+};
+
+struct VersusPacket
+{
+    uint32_t magic, seed; // seed: player 0's choice, used by everyone
+    uint8_t player, width, height, count;
+    uint32_t rules; // Ruleset::Checksum; peers only play under the same rules
+    int32_t start;  // tick of inputs[0]
+    int32_t ack;   // how many of the receiver's inputs the sender has
+    int32_t lead;  // how far the sender has simulated past the receiver's inputs
+    uint8_t inputs[PACKET_INPUTS];
+};
+
+// "a.b.c.d:port" or "localhost:port".
+bool ParseAddress(const string &text, sockaddr_in &address)
+{
+    size_t colon = text.rfind(':');
+    if (colon == string::npos)
+        return false;
+    string host = text.substr(0, colon);
+    int port = atoi(text.c_str() + colon + 1);
+    if (host == "localhost")
+        host = "127.0.0.1";
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    return port > 0 && port < 65536 && inet_pton(AF_INET, host.c_str(), &address.sin_addr) == 1;
+}
+
+// Non-blocking UDP socket for versus packets. Outgoing packets can be held
+// back for a fixed delay, to try the netcode over loopback as if on a slow
+// link.
+class VersusSocket
+{
+private:
+    struct DelayedPacket
+    {
+        chrono::steady_clock::time_point due;
+        sockaddr_in to;
+        VersusPacket packet;
+    };
+
+#ifdef _WIN32
+    SOCKET handle = INVALID_SOCKET;
+#else
+    int handle = -1;
+#endif
+    DelayedPacket delayed[256];
+    int delayedHead = 0, delayedCount = 0;
+    chrono::milliseconds delay{0};
+
+    void SendNow(const sockaddr_in &to, const VersusPacket &packet)
+    {
+        sendto(handle, (const char *)&packet, sizeof(packet), 0, (const sockaddr *)&to, sizeof(to));
+    }
+
+public:
+    ~VersusSocket()
+    {
+#ifdef _WIN32
+        if (handle != INVALID_SOCKET)
+            closesocket(handle);
+#else
+        if (handle >= 0)
+            close(handle);
+#endif
+    }
+
+    bool Open(const sockaddr_in &address, int delayMs)
+    {
+        delay = chrono::milliseconds(delayMs);
+#ifdef _WIN32
+        static WSADATA wsaData;
+        static bool started = WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+        if (!started)
+            return false;
+        handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        u_long nonBlocking = 1;
+        if (handle == INVALID_SOCKET || ioctlsocket(handle, FIONBIO, &nonBlocking) != 0)
+            return false;
+#else
+        handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (handle < 0 || fcntl(handle, F_SETFL, O_NONBLOCK) != 0)
+            return false;
+#endif
+        return bind(handle, (const sockaddr *)&address, sizeof(address)) == 0;
+    }
 
-    return scores;
-}
+    // The port actually bound, for sockets opened on port 0.
+    int Port() const
+    {
+        sockaddr_in address;
+#ifdef _WIN32
+        int length = sizeof(address);
+#else
+        socklen_t length = sizeof(address);
+#endif
+        getsockname(handle, (sockaddr *)&address, &length);
+        return ntohs(address.sin_port);
+    }
 
-// Function to save high scores to file
-void saveHighScores(const vector<HighScore> &scores)
-{
-    ofstream file("Score.txt");
+    void Send(const sockaddr_in &to, const VersusPacket &packet)
+    {
+        if (delay.count() == 0)
+        {
+            SendNow(to, packet);
+            return;
+        }
+        if (delayedCount == 256)
+            return; // the simulated link is full; drop like a real one
+        delayed[(delayedHead + delayedCount++) % 256] = {chrono::steady_clock::now() + delay, to, packet};
+    }
 
-    if (file.is_open())
+    // Sends delayed packets that are due, then reads one incoming packet.
+    bool Receive(VersusPacket &packet)
     {
-        for (const auto &score : scores)
+        auto now = chrono::steady_clock::now();
+        while (delayedCount > 0 && delayed[delayedHead].due <= now)
         {
-            file << score.playerName << " " << score.score << "\n";
+            SendNow(delayed[delayedHead].to, delayed[delayedHead].packet);
+            delayedHead = (delayedHead + 1) % 256;
+            delayedCount--;
         }
-        file.close();
+        return recvfrom(handle, (char *)&packet, sizeof(packet), 0, nullptr, nullptr) == (int)sizeof(packet);
     }
-}
+};
 
-// Function to update high scores
-void updateHighScores(int newScore)
+// One peer's view of a versus match: the predicted present, snapshots to roll
+// back to and the inputs of every player by tick.
+template <class BoardT>
+class VersusSession
 {
-    vector<HighScore> scores = readHighScores();
-
-    // If we have less than 5 scores or new score is better than the worst in top 5
-    if (scores.size() < 5 || newScore > scores.back().score)
+private:
+    VersusState<BoardT> state;
+    VersusState<BoardT> snapshots[ROLLBACK_FRAMES + 1]; // by tick, taken before it ran
+    uint8_t inputs[INPUT_HISTORY][VERSUS_MAX_PLAYERS];    // by tick
+    int confirmed[VERSUS_MAX_PLAYERS];                    // each player's inputs are known below this tick
+    int acked[VERSUS_MAX_PLAYERS];                        // our inputs each peer already has
+    int remoteLead[VERSUS_MAX_PLAYERS];
+    chrono::steady_clock::time_point lastHeard[VERSUS_MAX_PLAYERS];
+    bool heard[VERSUS_MAX_PLAYERS];
+    sockaddr_in peers[VERSUS_MAX_PLAYERS];
+    VersusSocket socket;
+    int players = 0, localPlayer = 0;
+    int rollbackFrame = INT_MAX; // earliest tick that ran on a wrong prediction
+    int syncCooldown = 0;
+    uint32_t seed = 0;
+    uint32_t rulesChecksum = 0;
+    int otherRulesPlayer = -1; // a peer heard playing under other rules
+    uint32_t otherRules = 0;
+    bool started = false;
+
+    void Rollback()
     {
-        HighScore newEntry;
+        if (rollbackFrame >= state.frame)
+        {
+            rollbackFrame = INT_MAX;
+            return;
+        }
+        int frame = state.frame;
+        state = snapshots[rollbackFrame % (ROLLBACK_FRAMES + 1)];
+        while (state.frame < frame && !state.IsOver())
+        {
+            snapshots[state.frame % (ROLLBACK_FRAMES + 1)] = state;
+            state.Step(inputs[state.frame % INPUT_HISTORY], -1);
+        }
+        rollbacks++;
+        replayedFrames += frame - rollbackFrame;
+        maxReplay = max(maxReplay, frame - rollbackFrame);
+        rollbackFrame = INT_MAX;
+    }
 
-        // Get player name (you can modify this for your game's input method)
+    int MinConfirmed() const
+    {
+        int frame = INT_MAX;
+        for (int p = 0; p < players; p++)
+            frame = min(frame, confirmed[p]);
+        return frame;
+    }
 
-        cout << "\033[33m"
-                "Congratulations! You made it to the top 5!\n"
-             << "\033[0m";
-        cout << "\033[31m"
-                "Enter your name: "
-             << "\033[0m";
-        cin >> newEntry.playerName;
-        newEntry.score = newScore;
+public:
+    long rollbacks = 0, replayedFrames = 0;
+    int maxReplay = 0;
 
-        scores.push_back(newEntry);
+    bool Open(int playerCount, int player, const sockaddr_in &address, int delayMs)
+    {
+        players = playerCount;
+        localPlayer = player;
+        rulesChecksum = Tetris<BoardT>::GetRules().Checksum();
+        memset(inputs, INPUT_NONE, sizeof(inputs));
+        for (int p = 0; p < players; p++)
+        {
+            confirmed[p] = acked[p] = remoteLead[p] = 0;
+            heard[p] = p == localPlayer;
+            peers[p] = address;
+        }
+        if (localPlayer == 0)
+            seed = rand();
+        return socket.Open(address, delayMs);
+    }
 
-        // Sort and keep only top 5
-        sort(scores.begin(), scores.end(), [](const HighScore &a, const HighScore &b)
-             { return a.score > b.score; });
+    void SetPeer(int player, const sockaddr_in &address) { peers[player] = address; }
+    int Port() const { return socket.Port(); }
 
-        if (scores.size() > 5)
+    // Reads everything that has arrived and corrects the present if it was
+    // simulated on a wrong guess. Starts the match once every peer is there.
+    void Poll()
+    {
+        VersusPacket packet;
+        while (socket.Receive(packet))
         {
-            scores.resize(5);
+            int p = packet.player;
+            if (packet.magic != VERSUS_MAGIC || p >= players || p == localPlayer ||
+                packet.width != BoardT::FIELD_WIDTH || packet.height != BoardT::FIELD_HEIGHT ||
+                packet.count > PACKET_INPUTS)
+                continue;
+            if (packet.rules != rulesChecksum)
+            {
+                otherRulesPlayer = p;
+                otherRules = packet.rules;
+                continue;
+            }
+            heard[p] = true;
+            lastHeard[p] = chrono::steady_clock::now();
+            if (p == 0)
+                seed = packet.seed;
+            acked[p] = max(acked[p], (int)packet.ack);
+            remoteLead[p] = packet.lead;
+            for (int i = 0; i < packet.count; i++)
+            {
+                int frame = packet.start + i;
+                if (frame < confirmed[p])
+                    continue;
+                if (frame > confirmed[p])
+                    break; // a gap; the missing inputs are repeated in later packets
+                uint8_t &input = inputs[frame % INPUT_HISTORY][p];
+                if (frame < state.frame && input != packet.inputs[i])
+                    rollbackFrame = min(rollbackFrame, frame);
+                input = packet.inputs[i];
+                confirmed[p] = frame + 1;
+            }
         }
 
-        saveHighScores(scores);
+        if (!started && all_of(heard, heard + players, [](bool h)
+                               { return h; }))
+        {
+            started = true;
+            state.Reset(players, seed);
+            auto now = chrono::steady_clock::now();
+            fill(lastHeard, lastHeard + players, now);
+        }
+        if (started)
+            Rollback();
     }
-}
-
-// Function to display high scores
-void displayHighScores()
-{
-    vector<HighScore> scores = readHighScores();
 
-    cout << "\033[36m"
-            "\n===== HIGH SCORES =====\n"
-         << "\033[0m";
-    if (scores.empty())
+    // True while running the next tick would not outrun the inputs we have
+    // by more than the rollback window.
+    bool CanAdvance() const
     {
-        cout << "No high scores yet!\n";
+        if (!started || state.IsOver())
+            return false;
+        for (int p = 0; p < players; p++)
+        {
+            if (state.frame >= confirmed[p] + ROLLBACK_FRAMES)
+                return false;
+        }
+        return true;
     }
-    else
+
+    // True now and then while this peer runs ahead of the others, so the
+    // caller can sit out a tick and let them catch up instead of stalling
+    // on a full rollback window later.
+    bool ShouldWait()
     {
-        for (size_t i = 0; i < scores.size(); ++i)
+        if (syncCooldown > 0)
         {
-            cout << "\033[33m" << i + 1 << ". " << scores[i].playerName << " - " << "\033[0m" << scores[i].score << "\n";
+            syncCooldown--;
+            return false;
+        }
+        for (int p = 0; p < players; p++)
+        {
+            if (p != localPlayer && (state.frame - confirmed[p]) - remoteLead[p] >= 4)
+            {
+                syncCooldown = 10;
+                return true;
+            }
         }
+        return false;
     }
-    cout << "\033[36m"
-            "======================\n\n"
-         << "\033[0m";
-}
-
-void ShowCountdownAnimation()
-{
-#ifdef _WIN32
-    // Windows version
-    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
-    GetConsoleScreenBufferInfo(hConsole, &csbi);
-
-    int startX = csbi.srWindow.Right / 2;
-    int startY = csbi.srWindow.Bottom / 2;
-
-    // Hide cursor
-    CONSOLE_CURSOR_INFO cursorInfo;
-    GetConsoleCursorInfo(hConsole, &cursorInfo);
-    cursorInfo.bVisible = false;
-    SetConsoleCursorInfo(hConsole, &cursorInfo);
 
-    for (int i = 3; i > 0; i--)
+    // Runs one tick with the local player's input (INPUT_NONE or a Move plus
+    // one) and sends it to the other peers.
+    void Advance(uint8_t localInput)
     {
-        ClearScreen();
-        SetConsoleTextAttribute(hConsole, FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_INTENSITY);
-        COORD coord = {(SHORT)startX, (SHORT)startY};
-        SetConsoleCursorPosition(hConsole, coord);
-        Beep(800, 300);
-        cout << i;
-        Sleep((1000));
+        memset(inputs[(state.frame + ROLLBACK_FRAMES * 2) % INPUT_HISTORY], INPUT_NONE, VERSUS_MAX_PLAYERS);
+        inputs[state.frame % INPUT_HISTORY][localPlayer] = localInput;
+        confirmed[localPlayer] = state.frame + 1;
+        snapshots[state.frame % (ROLLBACK_FRAMES + 1)] = state;
+        state.Step(inputs[state.frame % INPUT_HISTORY], localPlayer);
+        SendInputs();
     }
 
-    ClearScreen();
-    SetConsoleTextAttribute(hConsole, FOREGROUND_GREEN | FOREGROUND_INTENSITY);
-    COORD coord = {(SHORT)(startX - 5), (SHORT)startY};
-    SetConsoleCursorPosition(hConsole, coord);
-    cout << "Game Start!";
-    Sleep((1000));
-    ClearScreen();
+    // Sends each peer the local inputs it has not acknowledged yet.
+    void SendInputs()
+    {
+        VersusPacket packet;
+        memset(&packet, 0, sizeof(packet));
+        packet.magic = VERSUS_MAGIC;
+        packet.seed = seed;
+        packet.player = localPlayer;
+        packet.width = BoardT::FIELD_WIDTH;
+        packet.height = BoardT::FIELD_HEIGHT;
+        packet.rules = rulesChecksum;
+        for (int p = 0; p < players; p++)
+        {
+            if (p == localPlayer)
+                continue;
+            int end = confirmed[localPlayer];
+            int start = max(acked[p], end - PACKET_INPUTS);
+            packet.start = start;
+            packet.count = end - start;
+            packet.ack = confirmed[p];
+            packet.lead = state.frame - confirmed[p];
+            for (int frame = start; frame < end; frame++)
+                packet.inputs[frame - start] = inputs[frame % INPUT_HISTORY][localPlayer];
+            socket.Send(peers[p], packet);
+        }
+    }
 
-    // Restore cursor
-    SetConsoleCursorInfo(hConsole, &cursorInfo);
-    SetConsoleTextAttribute(hConsole, csbi.wAttributes);
+    bool IsStarted() const { return started; }
+    // The peer that plays under other rules, or -1; theirs is its checksum.
+    int OtherRules(uint32_t &theirs, uint32_t &ours) const
+    {
+        theirs = otherRules;
+        ours = rulesChecksum;
+        return otherRulesPlayer;
+    }
+    // Every input up to the present is known, so the present is final.
+    bool IsSettled() const { return MinConfirmed() >= state.frame; }
+    bool IsFinished() const { return started && state.IsOver() && IsSettled(); }
+    bool PeerLost() const
+    {
+        auto now = chrono::steady_clock::now();
+        for (int p = 0; p < players; p++)
+        {
+            if (started && p != localPlayer && now - lastHeard[p] > chrono::seconds(5))
+                return true;
+        }
+        return false;
+    }
+    const VersusState<BoardT> &State() const { return state; }
+};
 
-#else
-    // Linux version (using ncurses)
-    initscr();
-    noecho();
-    curs_set(0);
-    start_color();
-    init_pair(10, COLOR_YELLOW, COLOR_BLACK);
-    init_pair(9, COLOR_GREEN, COLOR_BLACK);
+// Plays a versus match between two peers in this process over loopback UDP,
+// with random inputs and a delay injected on every packet, then checks both
+// peers ended up with the same match.
+template <class BoardT>
+int RunVersusTest(int frames, int delayMs)
+{
+    soundEnabled = false;
+    sockaddr_in address;
+    ParseAddress("127.0.0.1:1", address);
+    address.sin_port = 0;
+
+    auto peerA = make_unique<VersusSession<BoardT>>();
+    auto peerB = make_unique<VersusSession<BoardT>>();
+    VersusSession<BoardT> *peers[2] = {peerA.get(), peerB.get()};
+    for (int p = 0; p < 2; p++)
+    {
+        if (!peers[p]->Open(2, p, address, delayMs))
+        {
+            cerr << "Could not open a loopback UDP socket\n";
+            return 1;
+        }
+    }
+    for (int p = 0; p < 2; p++)
+    {
+        address.sin_port = htons(peers[p]->Port());
+        peers[1 - p]->SetPeer(p, address);
+    }
 
-    int startX = COLS / 2;
-    int startY = LINES / 2;
+    uint32_t botRandom[2] = {12345, 67890};
+    chrono::nanoseconds worstTick(0);
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(60);
+    while (chrono::steady_clock::now() < deadline)
+    {
+        bool done = true, advanced = false;
+        for (int p = 0; p < 2; p++)
+        {
+            VersusSession<BoardT> &peer = *peers[p];
+            auto start = chrono::steady_clock::now();
+            peer.Poll();
+            if (peer.CanAdvance() && peer.State().frame < frames)
+            {
+                // A key roughly every sixth tick, like a busy player; without hard
+                // drops, pieces lock through the lock delay
+                uint8_t input = NextRandom(botRandom[p], 6) == 0 ? 1 + NextRandom(botRandom[p], MOVE_HARD_DROP) : INPUT_NONE;
+                peer.Advance(input);
+                advanced = true;
+            }
+            else
+            {
+                peer.SendInputs();
+            }
+            worstTick = max(worstTick, chrono::steady_clock::now() - start);
+            done = done && peer.IsStarted() && peer.IsSettled() &&
+                   (peer.State().frame >= frames || peer.State().IsOver());
+        }
+        if (done)
+            break;
+        if (!advanced)
+            this_thread::sleep_for(chrono::microseconds(200));
+    }
 
-    for (int i = 3; i > 0; i--)
+    bool match = peerA->State().frame == peerB->State().frame;
+    for (int p = 0; p < 2 && match; p++)
     {
-        clear();
-        attron(COLOR_PAIR(10) | A_BOLD);
-        mvprintw(startY, startX, "%d", i);
-        attroff(COLOR_PAIR(10) | A_BOLD);
-        refresh();
-        this_thread::sleep_for(chrono::milliseconds(1000));
+        GameView viewA = {}, viewB = {};
+        peerA->State().games[p].GetView(viewA);
+        peerB->State().games[p].GetView(viewB);
+        match = viewA.status == viewB.status && memcmp(viewA.cells, viewB.cells, sizeof(viewA.cells)) == 0;
     }
 
-    clear();
-    attron(COLOR_PAIR(9) | A_BOLD);
-    mvprintw(startY, startX - 5, "Game Start!");
-    attroff(COLOR_PAIR(9) | A_BOLD);
-    refresh();
-    this_thread::sleep_for(chrono::milliseconds(1000));
-    endwin();
-#endif
+    cout << peerA->State().frame << " ticks, " << delayMs << " ms delay: "
+         << (match ? "peers agree" : "PEERS DIVERGED") << "\n";
+    for (int p = 0; p < 2; p++)
+    {
+        cout << "peer " << p << ": " << peers[p]->rollbacks << " rollbacks, " << peers[p]->replayedFrames
+             << " ticks replayed (at most " << peers[p]->maxReplay << " at once)\n";
+    }
+    cout << "slowest tick including rollback: " << chrono::duration<double, micro>(worstTick).count()
+         << " us of a " << TICK_MS << " ms budget\n";
+    return match ? 0 : 1;
 }
 
-void ShowGameOverAnimation()
+// Serves the metrics in the Prometheus text format over HTTP, on a local TCP
+// port or (not on Windows) a Unix socket, from a background thread. Every
+// scrape formats a fresh snapshot; the game thread never waits for it.
+class MetricsServer
 {
+private:
 #ifdef _WIN32
-    // Windows version
-    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
-    GetConsoleScreenBufferInfo(hConsole, &csbi);
-
-    int startX = (csbi.srWindow.Right / 2) - 5;
-    int startY = csbi.srWindow.Bottom / 2;
-
-    // Hide cursor
-    CONSOLE_CURSOR_INFO cursorInfo;
-    GetConsoleCursorInfo(hConsole, &cursorInfo);
-    cursorInfo.bVisible = false;
-    SetConsoleCursorInfo(hConsole, &cursorInfo);
-
-    const char *gameOverText = "GAME OVER";
+    SOCKET handle = INVALID_SOCKET;
+#else
+    int handle = -1;
+    string socketPath;
+#endif
+    thread worker;
+    atomic<bool> stopping{false};
 
-    for (int i = 0; i < 5; i++)
+    template <class SocketT>
+    static void CloseSocket(SocketT socket)
     {
-        ClearScreen();
-        SetConsoleTextAttribute(hConsole, FOREGROUND_RED | FOREGROUND_INTENSITY);
+#ifdef _WIN32
+        closesocket(socket);
+#else
+        close(socket);
+#endif
+    }
 
-        COORD coord = {(SHORT)startX, (SHORT)startY};
-        SetConsoleCursorPosition(hConsole, coord);
+    // Waits up to timeoutMs for a socket to become readable.
+    template <class SocketT>
+    static bool WaitReadable(SocketT socket, int timeoutMs)
+    {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(socket, &readable);
+        timeval timeout = {0, timeoutMs * 1000};
+        return select((int)socket + 1, &readable, nullptr, nullptr, &timeout) > 0;
+    }
 
-        // Windows doesn't have direct blink, so we'll simulate it
-        if (i % 2 == 0)
-        {
-            cout << gameOverText;
-        }
-        else
+    void Serve()
+    {
+        while (!stopping.load(memory_order_relaxed))
         {
-            // Just move cursor to same position without printing
-            SetConsoleCursorPosition(hConsole, coord);
+            // Wake regularly so the destructor does not wait long
+            if (!WaitReadable(handle, 200))
+                continue;
+            auto client = accept(handle, nullptr, nullptr);
+#ifdef _WIN32
+            if (client == INVALID_SOCKET)
+                continue;
+#else
+            if (client < 0)
+                continue;
+#endif
+            // Any request gets the metrics; the request itself is not parsed
+            char request[2048];
+            if (WaitReadable(client, 500))
+                recv(client, request, sizeof(request), 0);
+            string body = metrics.Format();
+            string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                              to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+            size_t sent = 0;
+            while (sent < response.size())
+            {
+#ifdef _WIN32
+                int written = send(client, response.data() + sent, (int)(response.size() - sent), 0);
+#else
+                ssize_t written = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+#endif
+                if (written <= 0)
+                    break;
+                sent += written;
+            }
+            CloseSocket(client);
         }
-
-        Sleep(400);
     }
 
-    // Final display
-    SetConsoleCursorPosition(hConsole, {(SHORT)startX, (SHORT)startY});
-    cout << gameOverText;
-    Sleep((1000));
-
-    // Restore cursor and colors
-    SetConsoleCursorInfo(hConsole, &cursorInfo);
-    SetConsoleTextAttribute(hConsole, csbi.wAttributes);
+public:
+    ~MetricsServer()
+    {
+        stopping = true;
+        if (worker.joinable())
+            worker.join();
+#ifdef _WIN32
+        if (handle != INVALID_SOCKET)
+            closesocket(handle);
+#else
+        if (handle >= 0)
+            close(handle);
+        if (!socketPath.empty())
+            unlink(socketPath.c_str());
+#endif
+    }
 
+    // Listens on "PORT" (127.0.0.1 only), "HOST:PORT" or "unix:PATH" and
+    // starts serving.
+    bool Open(const char *address)
+    {
+        string text = address;
+#ifdef _WIN32
+        static WSADATA wsaData;
+        static bool started = WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+        if (!started || text.compare(0, 5, "unix:") == 0)
+            return false;
 #else
-    // Linux version (using ncurses)
-    initscr();
-    noecho();
-    curs_set(0);
-    start_color();
-    init_pair(11, COLOR_RED, COLOR_BLACK);
+        if (text.compare(0, 5, "unix:") == 0)
+        {
+            sockaddr_un local = {};
+            local.sun_family = AF_UNIX;
+            socketPath = text.substr(5);
+            if (socketPath.empty() || socketPath.size() >= sizeof(local.sun_path))
+                return false;
+            memcpy(local.sun_path, socketPath.c_str(), socketPath.size() + 1);
+            unlink(socketPath.c_str()); // left over from a previous run
+            handle = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (handle < 0 || bind(handle, (const sockaddr *)&local, sizeof(local)) != 0 || listen(handle, 8) != 0)
+                return false;
+            worker = thread(&MetricsServer::Serve, this);
+            return true;
+        }
+#endif
+        size_t colon = text.rfind(':');
+        string host = colon == string::npos ? "127.0.0.1" : text.substr(0, colon);
+        int port = atoi(text.c_str() + (colon == string::npos ? 0 : colon + 1));
+        sockaddr_in local = {};
+        local.sin_family = AF_INET;
+        local.sin_port = htons(port);
+        if (port <= 0 || port > 65535 || inet_pton(AF_INET, host.c_str(), &local.sin_addr) != 1)
+            return false;
+        handle = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        int reuse = 1;
+        setsockopt(handle, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
+        if (bind(handle, (const sockaddr *)&local, sizeof(local)) != 0 || listen(handle, 8) != 0)
+            return false;
+        worker = thread(&MetricsServer::Serve, this);
+        return true;
+    }
+};
 
-    int startX = COLS / 2 - 5;
-    int startY = LINES / 2;
+// Settings from the command line that change how a game is played or shown.
+struct GameOptions
+{
+    const char *broadcastName = nullptr; // shared memory channel for spectators
+    int versusPlayers = 0, versusPlayer = 0; // versus mode when there are players
+    sockaddr_in versusAddresses[VERSUS_MAX_PLAYERS];
+    int versusDelay = 0; // ms added to every outgoing versus packet
+    double speed = 1;    // simulated time per unit of real time
+    int frameRate = 30;  // frames drawn per second at most
+    bool bot = false;    // attract mode: the bot plays, game after game
+    int previewCount = 1; // queued pieces shown beside the field
+    int das = 17, arr = 3; // keyboard auto-repeat, in ticks
+    bool quick = false;    // kiosk mode: no intro screens, straight into play
+    bool debug = false;    // time-travel keys over the last few thousand locks
+    const char *metricsAddress = nullptr; // where to serve metrics, if anywhere
+};
 
-    const char *gameOverText = "GAME OVER";
-    system("ffplay -nodisp -autoexit game_over.mp3 2>/dev/null &");
-    for (int i = 0; i < 5; i++)
+// Turns wall-clock time into simulation ticks at any multiple of real time,
+// independently of how often frames are drawn.
+class SimulationClock
+{
+private:
+    double speed;
+    double owedTicks = 0;
+    chrono::steady_clock::time_point last = chrono::steady_clock::now();
+
+public:
+    explicit SimulationClock(double timeScale) : speed(timeScale) {}
+
+    // Ticks that have come due since the last call. A machine that cannot
+    // keep up drops the backlog beyond a quarter of a second instead of
+    // spiralling.
+    long TicksDue()
     {
-        clear();
-        attron(COLOR_PAIR(11) | A_BOLD);
-        if (i % 2 == 0)
-            attron(A_BLINK);
-        mvprintw(startY, startX, "%s", gameOverText);
-        attroff(A_BLINK);
-        refresh();
-        this_thread::sleep_for(chrono::milliseconds(400));
+        auto now = chrono::steady_clock::now();
+        owedTicks += chrono::duration<double, milli>(now - last).count() * speed / TICK_MS;
+        owedTicks = min(owedTicks, 250.0 * speed / TICK_MS);
+        last = now;
+        long ticks = (long)owedTicks;
+        owedTicks -= ticks;
+        return ticks;
     }
 
-    this_thread::sleep_for(chrono::milliseconds(1000));
-    endwin();
-#endif
-}
+    // Real time until the next tick comes due.
+    chrono::microseconds UntilNextTick() const
+    {
+        return chrono::microseconds((long long)((1 - owedTicks) * TICK_MS * 1000 / speed));
+    }
+};
 
-class Tetris
+// Runs one game on the given board type and returns the final score.
+template <class BoardT>
+int PlayGame(const GameOptions &options)
 {
-private:
-    vector<vector<int>> field{FIELD_HEIGHT, vector<int>(FIELD_WIDTH, 0)};
-    int currentPiece, nextPiece, currentRotation;
-    int currentX, currentY;
-    int score, level, speed, linesCleared;
-    bool isGameOver, isPaused;
-#ifdef _WIN32
-    ConsoleBuffer screenBuffer;
+    Tetris<BoardT>::SetPreviewCount(options.previewCount);
+    Tetris<BoardT> game;
+    game.ReportMetrics(true);
+    metrics.gamesStarted.fetch_add(1, memory_order_relaxed);
+    AutoRepeat input(options.das, options.arr);
+    InputQueue events;
+#ifndef _WIN32
+    GameView view;
+    unique_ptr<SpectatorPublisher> publisher;
+    if (options.broadcastName)
+        publisher.reset(new SpectatorPublisher(options.broadcastName));
 #endif
-
+    FrameBuffer frame(game.ScreenWidth(), game.ScreenHeight());
 #ifdef _WIN32
-    HANDLE hConsole;
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
+    ConsoleBackend backend(frame.Width(), frame.Height());
+#else
+    CursesBackend backend(frame.Width(), frame.Height());
 #endif
 
-    int Rotate(int px, int py, int r)
+    PlaySoundEffect(SOUND_GAME_START);
+    if (!options.quick)
+        ShowCountdownAnimation();
+
+    // The game advances in ticks at options.speed times real time, while
+    // frames show the latest state at no more than options.frameRate.
+    SimulationClock clock(options.speed);
+    auto frameInterval = chrono::microseconds(1000000 / max(options.frameRate, 1));
+    auto nextFrame = chrono::steady_clock::now();
+    unique_ptr<Bot<BoardT>> bot;
+    if (options.bot)
+        bot.reset(new Bot<BoardT>(3));
+    int bestScore = 0, gamesPlayed = 0;
+    bool quit = false, finished = false;
+    char rulesLabel[48];
+    snprintf(rulesLabel, sizeof(rulesLabel), "Rules: %.31s", Tetris<BoardT>::GetRules().name);
+    bool keyWaiting = false; // a key read since the last frame, for input latency
+    chrono::steady_clock::time_point keyTime;
+
+    // Debugging: every lock goes into a history that [ and ] step through
+    // while the game is frozen, and Enter plays on from the lock shown. A
+    // finished game stays up so it can be rewound, until Esc or Q.
+    unique_ptr<LockHistory<BoardT>> history;
+    Tetris<BoardT> shown; // the lock being looked at
+    bool reviewing = false;
+    uint64_t reviewed = 0;
+    int recordedLocks = 0;
+    if (options.debug)
     {
-        switch (r % 4)
-        {
-        case 0:
-            return py * TETROMINO_SIZE + px;
-        case 1:
-            return 12 + py - (px * TETROMINO_SIZE);
-        case 2:
-            return 15 - (py * TETROMINO_SIZE) - px;
-        case 3:
-            return 3 - py + (px * TETROMINO_SIZE);
-        }
-        return 0;
+        history.reset(new LockHistory<BoardT>());
+        history->Record(game);
     }
-
-    bool DoesPieceFit(int piece, int rotation, int posX, int posY)
+    auto recordLocks = [&]()
     {
-        for (int px = 0; px < TETROMINO_SIZE; px++)
+        if (history && game.PiecesLocked() != recordedLocks)
         {
-            for (int py = 0; py < TETROMINO_SIZE; py++)
-            {
-                int pi = Rotate(px, py, rotation);
-                if (TETROMINOS[piece][pi] == L'.')
-                    continue;
-
-                int fx = posX + px;
-                int fy = posY + py;
-
-                if (fx < 0 || fx >= FIELD_WIDTH || fy < 0 || fy >= FIELD_HEIGHT)
-                    return false;
-                if (field[fy][fx] != 0)
-                    return false;
-            }
+            history->Record(game);
+            recordedLocks = game.PiecesLocked();
         }
-        return true;
-    }
+    };
 
-    void ClearLines()
+    // Main game loop
+    while (!quit)
     {
-        int linesClearedThisTurn = 0;
-        for (int y = FIELD_HEIGHT - 2; y >= 1; y--)
+        // Moves go through auto-repeat and are applied on the next tick;
+        // other keys act at once
+        ReadKeys(events);
+        InputEvent event;
+        while (events.Pop(event))
         {
-            bool isLineComplete = true;
-            for (int x = 1; x < FIELD_WIDTH - 1; x++)
+            int ch = event.key;
+            if (event.released)
             {
-                if (field[y][x] == 0)
-                {
-                    isLineComplete = false;
-                    break;
-                }
+                RouteKey(game, input, event);
+                continue;
             }
-
-            if (isLineComplete)
+#ifndef _WIN32
+            if (ch == KEY_RESIZE)
             {
-                // Play sound (platform independent)
-#ifdef _WIN32
-                Beep(2000, 500);
-#else
-                if (linesCleared == 0)
+                backend.Resize(COLS, LINES);
+                continue;
+            }
+#endif
+            if (!keyWaiting)
+            {
+                keyWaiting = true;
+                keyTime = chrono::steady_clock::now();
+            }
+            if ((bot || finished) && (ch == 27 || ch == 'q' || ch == 'Q'))
+                quit = true;
+            if (history && (ch == '[' || ch == ']'))
+            {
+                // Stepping on past the newest lock goes back to the game
+                if (!reviewing)
                 {
-                    system("ffplay -nodisp -autoexit beep.wav 2>/dev/null &");
+                    reviewing = ch == '[';
+                    reviewed = history->Newest();
                 }
-#endif
-
-                // Clear the line
-                for (int x = 1; x < FIELD_WIDTH - 1; x++)
-                    field[y][x] = 0;
-
-                // Shift lines down
-                for (int yy = y - 1; yy >= 1; yy--)
+                else if (ch == '[' && reviewed > history->Oldest())
+                    reviewed--;
+                else if (ch == ']')
+                    reviewing = ++reviewed <= history->Newest();
+                if (reviewing)
+                    history->Restore(reviewed, shown);
+                continue;
+            }
+            if (reviewing)
+            {
+                if (ch == '\n' || ch == '\r')
                 {
-                    for (int x = 1; x < FIELD_WIDTH - 1; x++)
-                    {
-                        field[yy + 1][x] = field[yy][x];
-                        field[yy][x] = 0;
-                    }
+                    // The locks after the one shown are forgotten
+                    history->Truncate(reviewed);
+                    history->Restore(reviewed, game);
+                    recordedLocks = game.PiecesLocked();
+                    reviewing = false;
+                    input.Clear();
+                    if (finished)
+                        metrics.gamesStarted.fetch_add(1, memory_order_relaxed);
+                    finished = false;
                 }
-                linesClearedThisTurn++;
-                y++; // Re-check this line
+                continue;
             }
+            RouteKey(game, input, event);
         }
 
-        // Update score
-        switch (linesClearedThisTurn)
+        for (long ticks = clock.TicksDue(); ticks > 0 && !game.IsGameOver() && !reviewing; ticks--)
+            PlayTick(game, input, bot.get(), recordLocks);
+        if (game.IsGameOver() && !finished)
         {
-        case 1:
-            score += 100 * level;
-            break;
-        case 2:
-            score += 300 * level;
-            break;
-        case 3:
-            score += 500 * level;
-            break;
-        case 4:
-            score += 800 * level;
-            break;
+            bestScore = max(bestScore, game.GetScore());
+            gamesPlayed++;
+            metrics.gamesFinished.fetch_add(1, memory_order_relaxed);
+            finished = true;
+            if (bot)
+            {
+                game.Reset(); // attract mode plays on until a key is pressed
+                metrics.gamesStarted.fetch_add(1, memory_order_relaxed);
+                finished = false;
+                if (history)
+                {
+                    history->Clear();
+                    history->Record(game);
+                    recordedLocks = 0;
+                }
+            }
+            else if (!history)
+                break;
         }
-        linesCleared += linesClearedThisTurn;
 
-        // Level up
-        if (linesCleared >= 5)
+        auto now = chrono::steady_clock::now();
+        if (now >= nextFrame)
         {
-            level++;
-            linesCleared -= 5;
-            speed = max(5, speed - 2);
-#ifdef _WIN32
-            Beep(880, 200);
-#else
-            system("ffplay -nodisp -autoexit beep.wav 2>/dev/null &");
+            nextFrame = max(nextFrame + frameInterval, now);
+#ifndef _WIN32
+            // Spectators get what this screen shows, once per frame rather
+            // than once per tick. At demo speeds a frame can hold hundreds
+            // of ticks, which would lap the ring before a viewer could read
+            // it, so states that come and go between frames are not sent.
+            if (publisher)
+            {
+                game.GetView(view);
+                publisher->Publish(view);
+            }
 #endif
+            (reviewing ? shown : game).Draw(frame);
+            frame.Write(Tetris<BoardT>::PANEL_X, 22, rulesLabel, SCREEN_TEXT);
+            if (bot || history)
+            {
+                char banner[64] = "";
+                if (reviewing)
+                    snprintf(banner, sizeof(banner), "REWIND lock %d of %d  [ ]: step  Enter: play on",
+                             shown.PiecesLocked(), game.PiecesLocked());
+                else if (bot)
+                    snprintf(banner, sizeof(banner), "DEMO x%g  game %d  best %d", options.speed, gamesPlayed + 1,
+                             bestScore);
+                else if (finished)
+                    snprintf(banner, sizeof(banner), "GAME OVER  [: rewind  Esc: quit");
+                int length = strlen(banner);
+                frame.Write(1, 0, banner, SCREEN_TITLE, true);
+                frame.Fill(1 + length, 0, frame.Width() - 1 - length, 1, ' ', SCREEN_TEXT);
+            }
+            backend.Present(frame);
+            auto presented = chrono::steady_clock::now();
+            metrics.frameTime.Observe(chrono::duration_cast<chrono::microseconds>(presented - now).count());
+            if (keyWaiting)
+            {
+                metrics.inputLatency.Observe(chrono::duration_cast<chrono::microseconds>(presented - keyTime).count());
+                keyWaiting = false;
+            }
         }
+
+        // Sleep until whichever comes first: the next tick or the next frame,
+        // but wake at least every few ms to read keys
+        auto wake = min(nextFrame - chrono::steady_clock::now(), chrono::steady_clock::duration(clock.UntilNextTick()));
+        wake = min(wake, chrono::steady_clock::duration(chrono::milliseconds(5)));
+        if (wake > chrono::steady_clock::duration::zero())
+            this_thread::sleep_for(wake);
     }
+    ShowGameOverAnimation();
+    return bot ? max(bestScore, game.GetScore()) : game.GetScore();
+}
 
-public:
-    Tetris() : currentPiece(rand() % 7), nextPiece(rand() % 7), currentRotation(0),
-               currentX(FIELD_WIDTH / 2 - 2), currentY(1), score(0), level(1),
-               speed(10), linesCleared(0), isGameOver(false), isPaused(false)
+// Runs a versus match against the peers in options and returns the local
+// player's score, or -1 if the UDP port could not be opened.
+template <class BoardT>
+int PlayVersus(const GameOptions &options)
+{
+    Tetris<BoardT>::SetPreviewCount(options.previewCount);
+    auto session = make_unique<VersusSession<BoardT>>();
+    const sockaddr_in &localAddress = options.versusAddresses[options.versusPlayer];
+    if (!session->Open(options.versusPlayers, options.versusPlayer, localAddress, options.versusDelay))
+        return -1;
+    for (int p = 0; p < options.versusPlayers; p++)
+        session->SetPeer(p, options.versusAddresses[p]);
+
+    int gameWidth = Tetris<BoardT>::ScreenWidth(), gameHeight = Tetris<BoardT>::ScreenHeight();
+    FrameBuffer board(gameWidth, gameHeight);
+    FrameBuffer frame(gameWidth * options.versusPlayers, gameHeight);
 #ifdef _WIN32
-               ,
-               screenBuffer(FIELD_WIDTH * 2 + 30, FIELD_HEIGHT + 2)
+    ConsoleBackend backend(frame.Width(), frame.Height());
+#else
+    CursesBackend backend(frame.Width(), frame.Height());
 #endif
-    {
 
-        // Initialize borders
-        for (int y = 0; y < FIELD_HEIGHT; y++)
+    // Keys are fed to the match one move per tick
+    AutoRepeat input(options.das, options.arr);
+    InputQueue events;
+    bool quit = false;
+    auto nextTick = chrono::steady_clock::now();
+    // Rollback replays ticks, so versus games count only starts and ends
+    metrics.gamesStarted.fetch_add(1, memory_order_relaxed);
+    uint32_t theirRules, ourRules;
+    while (!quit && !session->IsFinished() && !session->PeerLost() &&
+           session->OtherRules(theirRules, ourRules) < 0)
+    {
+        ReadKeys(events);
+        InputEvent event;
+        while (events.Pop(event))
         {
-            field[y][0] = 8;
-            field[y][FIELD_WIDTH - 1] = 8;
+            int ch = event.key;
+            Move move;
+            if (event.released)
+            {
+                if (KeyToMove(ch, move))
+                    input.KeyUp(move);
+                continue;
+            }
+#ifndef _WIN32
+            if (ch == KEY_RESIZE)
+                backend.Resize(COLS, LINES);
+#endif
+            if (ch == 27)
+                quit = true;
+            else if (KeyToMove(ch, move))
+                input.KeyEvent(move);
         }
-        for (int x = 0; x < FIELD_WIDTH; x++)
+
+        session->Poll();
+        auto now = chrono::steady_clock::now();
+        if (now < nextTick)
         {
-            field[0][x] = 8;
-            field[FIELD_HEIGHT - 1][x] = 8;
+            this_thread::sleep_for(chrono::milliseconds(1));
+            continue;
         }
+        nextTick = max(nextTick + chrono::milliseconds(TICK_MS), now - chrono::milliseconds(100));
 
-#ifdef _WIN32
-        hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-        GetConsoleScreenBufferInfo(hConsole, &csbi);
-#endif
-    }
+        if (session->CanAdvance() && !session->ShouldWait())
+        {
+            Move move;
+            const Tetris<BoardT> &local = session->State().games[options.versusPlayer];
+            if (input.Next(move, local.SoftDropInterval()))
+                session->Advance(move + 1);
+            else
+                session->Advance(INPUT_NONE);
+        }
+        else
+        {
+            session->SendInputs();
+        }
 
-    void ProcessInput(int ch)
-    {
-        if (isPaused)
+        auto drawStart = chrono::steady_clock::now();
+        frame.Clear();
+        if (!session->IsStarted())
         {
-            if (ch == 's' || ch == 'S')
-                isPaused = false;
-            return;
+            frame.Write(2, gameHeight / 2, "Waiting for the other players...", SCREEN_TITLE, true);
         }
-#ifdef _WIN32
-        FlushInputBuffer(); // Clear any buffered input when unpausing
-#endif
-        switch (ch)
+        else
         {
-#ifdef _WIN32
-        case 75: // Left arrow
-#else
-        case KEY_LEFT:
-#endif
-            if (DoesPieceFit(currentPiece, currentRotation, currentX - 1, currentY))
-                currentX--;
-            break;
-#ifdef _WIN32
-        case 77: // Right arrow
-#else
-        case KEY_RIGHT:
-#endif
-            if (DoesPieceFit(currentPiece, currentRotation, currentX + 1, currentY))
-                currentX++;
-            break;
-#ifdef _WIN32
-        case 72: // Up arrow
-#else
-        case KEY_UP:
-#endif
-            if (DoesPieceFit(currentPiece, currentRotation + 1, currentX, currentY))
-                currentRotation++;
-            break;
-#ifdef _WIN32
-        case 80: // Down arrow
-#else
-        case KEY_DOWN:
-#endif
-            if (DoesPieceFit(currentPiece, currentRotation, currentX, currentY + 1))
-                currentY++;
-            break;
-        case ' ':
-            while (DoesPieceFit(currentPiece, currentRotation, currentX, currentY + 1))
-                currentY++;
-            break;
-        case 's':
-        case 'S':
-            isPaused = true;
-            break;
+            const VersusState<BoardT> &state = session->State();
+            for (int p = 0; p < state.players; p++)
+            {
+                state.games[p].Draw(board);
+                frame.Blit(board, p * gameWidth, 0);
+                char label[32];
+                snprintf(label, sizeof(label), "PLAYER %d%s%s", p + 1, p == options.versusPlayer ? " (YOU)" : "",
+                         state.games[p].IsGameOver() ? " - OUT" : "");
+                frame.Write(p * gameWidth + 1, 0, label, SCREEN_TITLE, true);
+            }
         }
-#ifdef _WIN32
-        // Clear any additional buffered input after processing
-        FlushInputBuffer();
-#endif
+        backend.Present(frame);
+        metrics.frameTime.Observe(
+            chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - drawStart).count());
     }
+    metrics.gamesFinished.fetch_add(1, memory_order_relaxed);
 
-    void AppleGravity()
+    // Keep sending for a moment so the others get our last inputs too
+    auto lingerUntil = chrono::steady_clock::now() + chrono::milliseconds(500);
+    while (chrono::steady_clock::now() < lingerUntil)
     {
-        // Create a visited matrix to track which cells we've processed
-        vector<vector<bool>> visited(FIELD_HEIGHT, vector<bool>(FIELD_WIDTH, false));
+        session->Poll();
+        session->SendInputs();
+        this_thread::sleep_for(chrono::milliseconds(TICK_MS));
+    }
 
-        // Process from bottom to top (skip borders)
-        for (int y = FIELD_HEIGHT - 2; y >= 1; y--)
-        {
-            for (int x = 1; x < FIELD_WIDTH - 1; x++)
-            {
-                if (field[y][x] != 0 && !visited[y][x])
-                {
-                    int pieceID = field[y][x];
-                    vector<pair<int, int>> cluster;
-                    queue<pair<int, int>> toVisit;
-                    toVisit.push(make_pair(y, x));
+    char result[64] = "MATCH ABANDONED";
+    int otherPlayer = session->OtherRules(theirRules, ourRules);
+    bool lost = session->State().games[options.versusPlayer].IsGameOver();
+    if (session->IsFinished())
+        snprintf(result, sizeof(result), "%s", lost ? "YOU LOSE" : "YOU WIN!");
+    else if (session->PeerLost())
+        snprintf(result, sizeof(result), "CONNECTION LOST");
+    else if (otherPlayer >= 0)
+        snprintf(result, sizeof(result), "RULES DIFFER: P%d %08x, YOU %08x", otherPlayer + 1, theirRules, ourRules);
+    frame.Write(options.versusPlayer * gameWidth + 5, gameHeight / 2, result, SCREEN_WALL, true);
+    backend.Present(frame);
+    this_thread::sleep_for(chrono::seconds(2));
 
-                    // Find all connected blocks of the same type
-                    while (!toVisit.empty())
-                    {
-                        pair<int, int> current = toVisit.front();
-                        toVisit.pop();
-                        int cy = current.first;
-                        int cx = current.second;
+    ShowGameOverAnimation();
+    return session->IsStarted() ? session->State().games[options.versusPlayer].GetScore() : 0;
+}
 
-                        if (cy < 1 || cy >= FIELD_HEIGHT - 1 || cx < 1 || cx >= FIELD_WIDTH - 1)
-                            continue;
+// Board variants selectable at runtime with --board WIDTHxHEIGHT (playfield
+// size, walls excluded). Each is a separate instantiation, so the inner loops
+// never see a runtime dimension.
+using ClassicBoard = Board<FIELD_WIDTH, FIELD_HEIGHT>; // 10x20
+using PartyBoard = Board<18, 42>;                       // 16x40
 
-                        if (visited[cy][cx] || field[cy][cx] != pieceID)
-                            continue;
+template <class BoardT>
+struct BoardTag
+{
+    using type = BoardT;
+};
 
-                        visited[cy][cx] = true;
-                        cluster.push_back(make_pair(cy, cx));
+template <class Fn>
+int WithBoard(const string &size, Fn fn)
+{
+    if (size == "16x40")
+        return fn(BoardTag<PartyBoard>());
+    return fn(BoardTag<ClassicBoard>());
+}
 
-                        // Check all 4-directional neighbors
-                        if (cy > 1 && !visited[cy - 1][cx])
-                            toVisit.push(make_pair(cy - 1, cx));
-                        if (cy < FIELD_HEIGHT - 2 && !visited[cy + 1][cx])
-                            toVisit.push(make_pair(cy + 1, cx));
-                        if (cx > 1 && !visited[cy][cx - 1])
-                            toVisit.push(make_pair(cy, cx - 1));
-                        if (cx < FIELD_WIDTH - 2 && !visited[cy][cx + 1])
-                            toVisit.push(make_pair(cy, cx + 1));
-                    }
+// The board logic written the slow, obvious way: plain cells, no bit masks,
+// pieces read straight from TETROMINOS. Fuzz runs check Board against it, so
+// faster versions of the collision test, line clearing and gravity can land
+// with confidence. It keeps the same rules, including the order in which
+// ApplyGravity settles clusters.
+template <int W, int H>
+class ReferenceBoard
+{
+public:
+    int cells[H][W];
 
-                    // Check if this cluster is floating
-                    bool isFloating = true;
-                    for (const auto &block : cluster)
-                    {
-                        int belowY = block.first + 1;
-                        // If we hit bottom or a non-empty, non-matching block below
-                        if (belowY >= FIELD_HEIGHT - 1 ||
-                            (field[belowY][block.second] != 0 && field[belowY][block.second] != pieceID))
-                        {
-                            isFloating = false;
-                            break;
-                        }
-                    }
+    ReferenceBoard()
+    {
+        for (int y = 0; y < H; y++)
+        {
+            for (int x = 0; x < W; x++)
+                cells[y][x] = x == 0 || x == W - 1 || y == 0 || y == H - 1 ? 8 : 0;
+        }
+    }
 
-                    // If floating, move the entire cluster down as far as possible
-                    if (isFloating && !cluster.empty())
-                    {
-                        // Find how far we can drop the cluster
-                        int maxDrop = FIELD_HEIGHT;
-                        for (const auto &block : cluster)
-                        {
-                            int drop = 0;
-                            while (block.first + drop + 1 < FIELD_HEIGHT - 1 &&
-                                   field[block.first + drop + 1][block.second] == 0)
-                            {
-                                drop++;
-                            }
-                            maxDrop = min(maxDrop, drop);
-                        }
+    template <class BoardT>
+    void CopyFrom(const BoardT &board)
+    {
+        for (int y = 0; y < H; y++)
+        {
+            for (int x = 0; x < W; x++)
+                cells[y][x] = board[y][x];
+        }
+    }
 
-                        // Sort cluster by bottom blocks first to prevent overwriting
-                        sort(cluster.begin(), cluster.end(), [](const pair<int, int> &a, const pair<int, int> &b)
-                             { return a.first > b.first; });
+    // Whether cell (px, py) of a turned piece's 4x4 box is a block: the cell
+    // is turned back counter-clockwise inside the piece's box to where it
+    // was at spawn.
+    static bool PieceCell(int piece, int rotation, int px, int py)
+    {
+        int box = piece == PIECE_I ? 4 : piece == PIECE_O ? 0 : 3;
+        for (int turn = 0; box > 0 && turn < (rotation & 3); turn++)
+        {
+            int spawnX = py;
+            py = box - 1 - px;
+            px = spawnX;
+        }
+        return px >= 0 && px < TETROMINO_SIZE && py >= 0 && py < TETROMINO_SIZE &&
+               TETROMINOS[piece][py * TETROMINO_SIZE + px] != L'.';
+    }
 
-                        // Move each block down by maxDrop
-                        for (auto &block : cluster)
-                        {
-                            field[block.first + maxDrop][block.second] = pieceID;
-                            field[block.first][block.second] = 0;
-                        }
-                    }
-                }
+    bool Fits(int piece, int rotation, int posX, int posY) const
+    {
+        for (int py = 0; py < TETROMINO_SIZE; py++)
+        {
+            for (int px = 0; px < TETROMINO_SIZE; px++)
+            {
+                if (!PieceCell(piece, rotation, px, py))
+                    continue;
+                int x = posX + px, y = posY + py;
+                if (x < 0 || x >= W || y < 0 || y >= H || cells[y][x] != 0)
+                    return false;
             }
         }
+        return true;
     }
-    void Update()
-    {
-        if (isPaused || isGameOver)
-            return;
-
-        static auto lastUpdate = chrono::steady_clock::now();
-        auto now = chrono::steady_clock::now();
-        auto elapsed = chrono::duration_cast<chrono::milliseconds>(now - lastUpdate).count();
 
-        // Calculate speed based on level (faster as level increases)
-        int currentSpeed = max(50, 500 - (level * 30)); // Adjust these values as needed
+    int DropDistance(int piece, int rotation, int posX, int posY) const
+    {
+        int distance = 0;
+        while (Fits(piece, rotation, posX, posY + distance + 1))
+            distance++;
+        return distance;
+    }
 
-        if (elapsed >= currentSpeed)
+    void Lock(int piece, int rotation, int posX, int posY)
+    {
+        for (int py = 0; py < TETROMINO_SIZE; py++)
         {
-            lastUpdate = now;
-
-            if (DoesPieceFit(currentPiece, currentRotation, currentX, currentY + 1))
+            for (int px = 0; px < TETROMINO_SIZE; px++)
             {
-                currentY++;
+                if (PieceCell(piece, rotation, px, py))
+                    cells[posY + py][posX + px] = piece + 1;
             }
-            else
-            {
-#ifdef _WIN32
-                Beep(420, 200);
-#else
-                system("ffplay -nodisp -autoexit beep-07a.wav 2>/dev/null &");
-#endif
-                score += 10 * level;
-
-                // Lock piece
-                for (int px = 0; px < TETROMINO_SIZE; px++)
-                {
-                    for (int py = 0; py < TETROMINO_SIZE; py++)
-                    {
-                        if (TETROMINOS[currentPiece][Rotate(px, py, currentRotation)] != L'.')
-                        {
-                            field[currentY + py][currentX + px] = currentPiece + 1;
-                        }
-                    }
-                }
-
-                // Game over check
-                if (currentY <= 1)
-                {
-                    isGameOver = true;
-                    return;
-                }
-
-                ClearLines();
-                AppleGravity();
+        }
+    }
 
-                // New piece
-                currentX = FIELD_WIDTH / 2 - 2;
-                currentY = 1;
-                currentRotation = 0;
-                currentPiece = nextPiece;
-                nextPiece = rand() % 7;
+    bool IsFull(int y) const
+    {
+        for (int x = 1; x < W - 1; x++)
+        {
+            if (cells[y][x] == 0)
+                return false;
+        }
+        return true;
+    }
 
-                if (!DoesPieceFit(currentPiece, currentRotation, currentX, currentY))
-                {
-                    isGameOver = true;
-                }
+    int ClearLines()
+    {
+        int lines = 0;
+        for (int y = H - 2; y >= 1; y--)
+        {
+            if (!IsFull(y))
+                continue;
+            for (int above = y; above > 1; above--)
+            {
+                for (int x = 1; x < W - 1; x++)
+                    cells[above][x] = cells[above - 1][x];
             }
+            for (int x = 1; x < W - 1; x++)
+                cells[1][x] = 0;
+            lines++;
+            y++; // the row that moved down needs checking too
+        }
+        return lines;
+    }
+
+    bool AddGarbage(int count, int hole)
+    {
+        count = min(count, H - 2);
+        bool fits = true;
+        for (int y = 1; y <= count; y++)
+        {
+            for (int x = 1; x < W - 1; x++)
+                fits = fits && cells[y][x] == 0;
+        }
+        for (int y = 1; y + count < H - 1; y++)
+        {
+            for (int x = 1; x < W - 1; x++)
+                cells[y][x] = cells[y + count][x];
+        }
+        for (int y = H - 1 - count; y < H - 1; y++)
+        {
+            for (int x = 1; x < W - 1; x++)
+                cells[y][x] = x == hole ? 0 : 8;
         }
+        return fits;
     }
-    void Draw()
+
+    // A cluster's blocks, found from one cell; the fill also uses it as its
+    // worklist. Fixed size, so checking a board never allocates.
+    struct Cluster
     {
-#ifdef _WIN32
-        // Clear the buffer
-        screenBuffer.Clear();
+        int color, size;
+        int ys[(H - 2) * (W - 2)], xs[(H - 2) * (W - 2)];
+    };
 
-        // Draw border and field
-        for (int y = 0; y < FIELD_HEIGHT; y++)
+    // Fills cluster with the same-coloured blocks around (x, y), marking
+    // them in seen.
+    void FindCluster(int x, int y, bool seen[H][W], Cluster &cluster) const
+    {
+        cluster.color = cells[y][x];
+        cluster.size = 0;
+        auto add = [&](int ax, int ay)
         {
-            for (int x = 0; x < FIELD_WIDTH; x++)
+            if (ax >= 1 && ax < W - 1 && ay >= 1 && ay < H - 1 && !seen[ay][ax] && cells[ay][ax] == cluster.color)
             {
-                int cell = field[y][x];
-                if (cell > 0 && cell < 8)
-                {
-                    screenBuffer.Write(x * 2, y, "[]", cell + 8);
-                }
-                else if (cell == 8)
-                {
-                    screenBuffer.Write(x * 2, y, "##", 15);
-                }
+                seen[ay][ax] = true;
+                cluster.ys[cluster.size] = ay;
+                cluster.xs[cluster.size++] = ax;
             }
+        };
+        add(x, y);
+        for (int i = 0; i < cluster.size; i++)
+        {
+            int bx = cluster.xs[i], by = cluster.ys[i];
+            add(bx, by - 1);
+            add(bx, by + 1);
+            add(bx - 1, by);
+            add(bx + 1, by);
         }
+    }
 
-        // Draw current piece
-        for (int px = 0; px < TETROMINO_SIZE; px++)
+    // How far a cluster can fall as one piece before a block of it would
+    // leave the field or hit a cell that is not its own.
+    int FallDistance(const Cluster &cluster) const
+    {
+        bool own[H][W] = {};
+        for (int i = 0; i < cluster.size; i++)
+            own[cluster.ys[i]][cluster.xs[i]] = true;
+        for (int drop = 1;; drop++)
         {
-            for (int py = 0; py < TETROMINO_SIZE; py++)
+            for (int i = 0; i < cluster.size; i++)
             {
-                if (TETROMINOS[currentPiece][Rotate(px, py, currentRotation)] != L'.')
-                {
-                    screenBuffer.Write((currentX + px) * 2, currentY + py, "[]", currentPiece + 9);
-                }
+                int y = cluster.ys[i] + drop, x = cluster.xs[i];
+                if (y >= H - 1 || (cells[y][x] != 0 && !own[y][x]))
+                    return drop - 1;
             }
         }
+    }
 
-        // Draw next piece preview border
-        screenBuffer.Write(FIELD_WIDTH * 2 + 4, 0, "#############", 15);
-        for (int y = 1; y <= 6; y++)
+    bool HasFloatingCluster() const
+    {
+        bool seen[H][W] = {};
+        Cluster cluster;
+        for (int y = H - 2; y >= 1; y--)
         {
-            screenBuffer.Write(FIELD_WIDTH * 2 + 4, y, "#", 15);
-            screenBuffer.Write(FIELD_WIDTH * 2 + 16, y, "#", 15);
+            for (int x = 1; x < W - 1; x++)
+            {
+                if (cells[y][x] == 0 || seen[y][x])
+                    continue;
+                FindCluster(x, y, seen, cluster);
+                if (FallDistance(cluster) > 0)
+                    return true;
+            }
         }
-        screenBuffer.Write(FIELD_WIDTH * 2 + 4, 7, "#############", 15);
-
-        // Draw next piece title
-        screenBuffer.Write(FIELD_WIDTH * 2 + 7, 1, "NEXT", 15);
-
-        // Clear preview area
-        screenBuffer.Fill(FIELD_WIDTH * 2 + 5, 2, 10, 5, ' ', 0);
+        return false;
+    }
 
-        // Draw next piece (centered)
-        int baseX = FIELD_WIDTH * 2 + 8;
-        int baseY = 4;
-        for (int px = 0; px < TETROMINO_SIZE; px++)
+    void ApplyGravity()
+    {
+        Cluster cluster;
+        for (bool moved = true; moved;)
         {
-            for (int py = 0; py < TETROMINO_SIZE; py++)
+            moved = false;
+            bool seen[H][W] = {};
+            for (int y = H - 2; y >= 1; y--)
             {
-                if (TETROMINOS[nextPiece][Rotate(px, py, 0)] != L'.')
+                for (int x = 1; x < W - 1; x++)
                 {
-                    int drawX = baseX + (px - 1) * 2;
-                    int drawY = baseY + (py - 1);
-                    screenBuffer.Write(drawX, drawY, "[]", nextPiece + 9);
+                    if (cells[y][x] == 0 || seen[y][x])
+                        continue;
+                    FindCluster(x, y, seen, cluster);
+                    int drop = FallDistance(cluster);
+                    if (drop == 0)
+                        continue;
+                    for (int i = 0; i < cluster.size; i++)
+                        cells[cluster.ys[i]][cluster.xs[i]] = 0;
+                    for (int i = 0; i < cluster.size; i++)
+                    {
+                        cells[cluster.ys[i] + drop][cluster.xs[i]] = cluster.color;
+                        seen[cluster.ys[i] + drop][cluster.xs[i]] = true;
+                    }
+                    moved = true;
                 }
             }
         }
+    }
+};
 
-        // Draw game info
-        screenBuffer.Write(FIELD_WIDTH * 2 + 5, 9, ("Score: " + to_string(score)).c_str(), 15);
-        screenBuffer.Write(FIELD_WIDTH * 2 + 5, 10, ("Level: " + to_string(level)).c_str(), 15);
-        screenBuffer.Write(FIELD_WIDTH * 2 + 5, 11, ("Lines: " + to_string(linesCleared)).c_str(), 15);
-
-        // Draw controls
-        screenBuffer.Write(FIELD_WIDTH * 2 + 5, 13, "Controls:", 15);
-        screenBuffer.Write(FIELD_WIDTH * 2 + 5, 15, "LEFT/RIGHT: Move", 15);
-        screenBuffer.Write(FIELD_WIDTH * 2 + 5, 16, "UP: Rotate", 15);
-        screenBuffer.Write(FIELD_WIDTH * 2 + 5, 17, "DOWN: Soft Drop", 15);
-        screenBuffer.Write(FIELD_WIDTH * 2 + 5, 18, "SPACE: Hard Drop", 15);
-        screenBuffer.Write(FIELD_WIDTH * 2 + 5, 19, "S: Pause", 15);
-        screenBuffer.Write(FIELD_WIDTH * 2 + 5, 20, "Ctrl + C: Quit", 15);
+// Checks that a board's bit masks agree with its cells and that its border
+// is whole; returns what is wrong, or nullptr.
+template <class BoardT>
+const char *CheckBoard(const BoardT &board)
+{
+    const int W = BoardT::FIELD_WIDTH, H = BoardT::FIELD_HEIGHT;
+    for (int y = 0; y < H; y++)
+    {
+        if ((board.Row(y) & BoardT::OUTSIDE_MASK) != BoardT::OUTSIDE_MASK)
+            return "row mask lost its outside bits";
+        for (int x = 0; x < W; x++)
+        {
+            bool filled = board[y][x] != 0;
+            if (filled != ((board.Row(y) >> (x + TETROMINO_SIZE)) & 1))
+                return "row mask out of step with the cells";
+            if (filled != ((board.Column(x) >> y) & 1))
+                return "column mask out of step with the cells";
+            bool isBorder = x == 0 || x == W - 1 || y == 0 || y == H - 1;
+            if (isBorder && board[y][x] != 8)
+                return "border broken";
+            if (board[y][x] > 8)
+                return "unknown cell colour";
+        }
+    }
+    return nullptr;
+}
 
-        if (isPaused)
+template <class BoardT>
+const char *CompareBoards(const BoardT &board, const ReferenceBoard<BoardT::FIELD_WIDTH, BoardT::FIELD_HEIGHT> &reference)
+{
+    if (const char *error = CheckBoard(board))
+        return error;
+    for (int y = 0; y < BoardT::FIELD_HEIGHT; y++)
+    {
+        for (int x = 0; x < BoardT::FIELD_WIDTH; x++)
         {
-            screenBuffer.Write(FIELD_WIDTH - 4, FIELD_HEIGHT / 2, "PAUSED", 15);
+            if (board[y][x] != reference.cells[y][x])
+                return "cells differ from the reference";
         }
+    }
+    return nullptr;
+}
 
-        // Draw everything at once
-        screenBuffer.Draw();
-#else
-        // Linux/Unix version using ncurses
-        erase();
+// Reads fuzz input a byte at a time; zeros once it runs out.
+class FuzzInput
+{
+private:
+    const uint8_t *data;
+    size_t size, position = 0;
 
-        // Draw border
-        attron(COLOR_PAIR(8));
-        for (int y = 0; y < FIELD_HEIGHT; y++)
+public:
+    FuzzInput(const uint8_t *bytes, size_t length) : data(bytes), size(length) {}
+    bool Done() const { return position >= size; }
+    int Next() { return position < size ? data[position++] : 0; }
+};
+
+// Differential run: board operations from the input go to Board and to
+// ReferenceBoard in step, and every result and cell has to agree. Pieces
+// can be locked in mid air, so gravity sees clusters of every shape.
+template <class BoardT>
+const char *FuzzBoard(FuzzInput &in)
+{
+    const int W = BoardT::FIELD_WIDTH, H = BoardT::FIELD_HEIGHT;
+    BoardT board;
+    ReferenceBoard<W, H> reference;
+    while (!in.Done())
+    {
+        int op = in.Next() % 7;
+        int piece = in.Next() % 7, rotation = in.Next() & 3;
+        int x = in.Next() % (W + TETROMINO_SIZE) - TETROMINO_SIZE, y = in.Next() % (H + TETROMINO_SIZE) - TETROMINO_SIZE;
+        switch (op)
         {
-            mvprintw(y + 1, 0, "  ");               // Left border
-            mvprintw(y + 1, FIELD_WIDTH * 2, "  "); // Right border
-        }
-        for (int x = 0; x <= FIELD_WIDTH * 2; x += 2)
+        case 0: // drop and lock a piece the way the game does
+        case 1: // lock it where it is
         {
-            mvprintw(0, x, "  ");            // Top border
-            mvprintw(FIELD_HEIGHT, x, "  "); // Bottom border
+            bool fits = board.DoesPieceFit(piece, rotation, x, y);
+            if (fits != reference.Fits(piece, rotation, x, y))
+                return "DoesPieceFit differs from the reference";
+            if (!fits)
+                break;
+            if (op == 0)
+            {
+                int drop = board.DropDistance(piece, rotation, x, y);
+                if (drop != reference.DropDistance(piece, rotation, x, y))
+                    return "DropDistance differs from the reference";
+                y += drop;
+            }
+            board.LockPiece(piece, rotation, x, y);
+            reference.Lock(piece, rotation, x, y);
+            if (board.ClearLines() != reference.ClearLines())
+                return "ClearLines differs from the reference";
+            break;
         }
-        attroff(COLOR_PAIR(8));
-
-        // Draw field contents
-        for (int y = 0; y < FIELD_HEIGHT; y++)
+        case 2:
+            board.ApplyGravity();
+            reference.ApplyGravity();
+            if (reference.HasFloatingCluster())
+                return "ApplyGravity left a floating cluster";
+            break;
+        case 3:
+            if (board.ClearLines() != reference.ClearLines())
+                return "ClearLines differs from the reference";
+            break;
+        case 4:
+            if (board.AddGarbage(1 + piece % 4, 1 + x % (W - 2)) != reference.AddGarbage(1 + piece % 4, 1 + x % (W - 2)))
+                return "AddGarbage differs from the reference";
+            break;
+        case 5: // paint one cell, for shapes pieces cannot make
+            if (x >= 1 && x < W - 1 && y >= 1 && y < H - 1)
+            {
+                board.Set(y, x, rotation == 0 ? 0 : piece + 1);
+                reference.cells[y][x] = rotation == 0 ? 0 : piece + 1;
+            }
+            break;
+        case 6: // settle, drop a piece and cascade; the board must end stable
         {
-            for (int x = 0; x < FIELD_WIDTH; x++)
+            board.ApplyGravity();
+            if (!board.DoesPieceFit(piece, rotation, x, y))
             {
-                int cell = field[y][x];
-                if (cell > 0 && cell < 8)
-                {
-                    attron(COLOR_PAIR(cell));
-                    mvprintw(y + 1, x * 2 + 1, "  ");
-                    attroff(COLOR_PAIR(cell));
-                }
-                else if (cell == 8)
-                {
-                    attron(COLOR_PAIR(8));
-                    mvprintw(y + 1, x * 2 + 1, "  ");
-                    attroff(COLOR_PAIR(8));
-                }
+                reference.ApplyGravity();
+                break;
             }
+            board.LockPiece(piece, rotation, x, y + board.DropDistance(piece, rotation, x, y));
+            int cells = board.FilledCells();
+            uint64_t seams = 0;
+            int lines = board.ClearLines(&seams);
+            board.Cascade(seams, [&lines](int more)
+                          { lines += more; });
+            reference.CopyFrom(board);
+            if (reference.HasFloatingCluster())
+                return "Cascade left a floating cluster";
+            if (reference.ClearLines() != 0)
+                return "Cascade left a full row";
+            if (board.FilledCells() != cells - lines * (W - 2))
+                return "Cascade lost or made blocks";
+            break;
         }
+        }
+        if (const char *error = CompareBoards(board, reference))
+            return error;
+    }
+    return nullptr;
+}
 
-        // Draw current piece
-        for (int px = 0; px < TETROMINO_SIZE; px++)
+// Game run: keys, ticks, garbage, resets and rewinds from the input go
+// through the full game logic, checking after every step that the board is
+// sound, the falling piece overlaps nothing, the score never goes down and
+// no cluster floats once a lock has settled the field. Garbage rises after
+// gravity, so it can leave a cluster over its hole until the next lock.
+// Every lock is recorded in a small LockHistory, and a replica restored
+// from its records has to play on exactly like the game; a rewind has to
+// bring back the game as it was.
+template <class BoardT>
+const char *FuzzGame(FuzzInput &in, uint32_t seed, const Ruleset &rules)
+{
+    const int W = BoardT::FIELD_WIDTH, H = BoardT::FIELD_HEIGHT;
+    const int HISTORY_SIZE = 64;
+    Tetris<BoardT> game, replica;
+    game.UseRules(rules);
+    replica.UseRules(rules);
+    game.Reset(seed);
+    ReferenceBoard<W, H> reference;
+    GameView view, previous, replicaView;
+    game.GetView(previous);
+    int lastScore = 0;
+    bool settled = true;
+    unique_ptr<LockHistory<BoardT, HISTORY_SIZE, 1536, 8>> history(new LockHistory<BoardT, HISTORY_SIZE, 1536, 8>());
+    vector<GameView> recorded(HISTORY_SIZE); // what each kept record should restore
+    int recordedLocks = 0;
+    auto sameView = [](const GameView &a, const GameView &b)
+    {
+        for (int y = 0; y < H; y++)
         {
-            for (int py = 0; py < TETROMINO_SIZE; py++)
+            if (memcmp(a.cells[y], b.cells[y], W) != 0)
+                return false;
+        }
+        return a.status == b.status;
+    };
+    auto record = [&]() -> const char *
+    {
+        history->Record(game);
+        recordedLocks = game.PiecesLocked();
+        game.GetView(recorded[history->Newest() % HISTORY_SIZE]);
+        // The replica plays a few locks on its own after each restore, which
+        // starts from another game so nothing carries over
+        if (history->Newest() % 4 == 0)
+        {
+            replica.Reset(~seed);
+            history->Restore(history->Newest(), replica);
+        }
+        // The oldest record kept has to survive the ring moving on
+        Tetris<BoardT> oldest;
+        GameView oldestView;
+        history->Restore(history->Oldest(), oldest);
+        oldest.GetView(oldestView);
+        if (!sameView(oldestView, recorded[history->Oldest() % HISTORY_SIZE]))
+            return "the oldest lock in the history no longer restores";
+        return nullptr;
+    };
+    if (const char *error = record())
+        return error;
+
+    while (!in.Done())
+    {
+        int action = in.Next();
+        int op = action & 15, argument = action >> 4;
+        int pendingBefore = game.PendingGarbage();
+        bool jumped = false; // to another game or another point of this one
+        int steps = op >= 7 && op < 12 ? 1 + argument * 4 : 1;
+        for (int step = 0; step < steps; step++)
+        {
+            for (Tetris<BoardT> *target : {&game, &replica})
             {
-                if (TETROMINOS[currentPiece][Rotate(px, py, currentRotation)] != L'.')
-                {
-                    attron(COLOR_PAIR(currentPiece + 1));
-                    mvprintw(currentY + py + 1, (currentX + px) * 2 + 1, "  ");
-                    attroff(COLOR_PAIR(currentPiece + 1));
-                }
+                if (op < 7)
+                    target->ApplyMove(Move(op));
+                else if (op < 12)
+                    target->Tick();
+                else if (op == 12)
+                    target->Fall();
+                else if (op == 13)
+                    target->ReceiveGarbage(1 + argument % 4);
+                else if (op == 14 && argument < 8)
+                    target->ProcessInput('s'); // pause or resume
+            }
+            if (game.PiecesLocked() != recordedLocks)
+            {
+                if (const char *error = record())
+                    return error;
             }
         }
-
-        // Draw next piece preview with border
-        attron(COLOR_PAIR(8));
-        // Top border
-        for (int x = FIELD_WIDTH * 2 + 5; x <= FIELD_WIDTH * 2 + 15; x++)
+        if (op == 14 && argument >= 8)
+        {
+            // Rewind up to 7 locks and play on from there
+            uint64_t back = min<uint64_t>(argument - 8, history->Newest() - history->Oldest());
+            uint64_t sequence = history->Newest() - back;
+            history->Restore(sequence, game);
+            history->Truncate(sequence);
+            game.GetView(view);
+            if (!sameView(view, recorded[sequence % HISTORY_SIZE]))
+                return "a rewind did not bring back the recorded lock";
+            replica.Reset(~seed);
+            history->Restore(sequence, replica);
+            recordedLocks = game.PiecesLocked();
+            lastScore = view.status.score;
+            settled = false;
+            jumped = true;
+        }
+        else if (op == 15)
         {
-            mvprintw(1, x, " ");
+            game.Reset(seed + argument);
+            replica.Reset(seed + argument);
+            if (const char *error = record()) // the history runs on across games
+                return error;
+            lastScore = 0;
+            settled = true;
+            jumped = true;
         }
-        // Bottom border
-        for (int x = FIELD_WIDTH * 2 + 5; x <= FIELD_WIDTH * 2 + 15; x++)
+
+        const BoardT &field = game.GetField();
+        game.GetView(view);
+        replica.GetView(replicaView);
+        if (!sameView(view, replicaView))
+            return "a game restored from the lock history played on differently";
+        if (view.status.score < lastScore)
+            return "score went down";
+        lastScore = view.status.score;
+        // Only a lock, a clear, risen garbage or a jump changes the field,
+        // so the whole-board checks wait for one
+        bool changed = jumped || memcmp(view.cells, previous.cells, sizeof(view.cells)) != 0;
+        if (changed && !jumped)
         {
-            mvprintw(7, x, " ");
+            // A lock that ends the game skips gravity, so it settles nothing;
+            // cascade rules settle risen garbage unless it ended the game
+            if (pendingBefore > 0 && game.PendingGarbage() == 0 && (!rules.cascade || view.status.isGameOver))
+                settled = false;
+            else if (!view.status.isGameOver)
+                settled = true;
         }
-        // Side borders
-        for (int y = 2; y <= 6; y++)
+        previous = view;
+
+        if (changed)
         {
-            mvprintw(y, FIELD_WIDTH * 2 + 5, " ");
-            mvprintw(y, FIELD_WIDTH * 2 + 15, " ");
+            if (const char *error = CheckBoard(field))
+                return error;
+            reference.CopyFrom(field);
+            if (settled && (rules.clusterGravity || rules.cascade) && reference.HasFloatingCluster())
+                return "a floating cluster was left after a lock";
+            if (settled && rules.cascade && !view.status.isGameOver && reference.ClearLines() != 0)
+                return "a cascade left a full row";
         }
-        attroff(COLOR_PAIR(8));
+        if (view.status.isGameOver)
+            continue;
+        if (!field.DoesPieceFit(view.status.piece, view.status.rotation, view.status.x, view.status.y) ||
+            !reference.Fits(view.status.piece, view.status.rotation, view.status.x, view.status.y))
+            return "the falling piece overlaps the field";
+        if (field.DropDistance(view.status.piece, view.status.rotation, view.status.x, view.status.y) !=
+            reference.DropDistance(view.status.piece, view.status.rotation, view.status.x, view.status.y))
+            return "DropDistance differs from the reference";
+    }
+    return nullptr;
+}
 
-        // Next piece title
-        attron(A_BOLD | COLOR_PAIR(15));
-        mvprintw(1, FIELD_WIDTH * 2 + 8, "NEXT");
-        attroff(A_BOLD | COLOR_PAIR(15));
+// Key run: presses, terminal repeats and releases from the input go through
+// InputQueue and AutoRepeat the way the game loop feeds them, and each
+// frame's moves have to match the timing AutoRepeat promises, for terminals
+// that only repeat and for consoles that report releases. In ticks since the
+// run began: presses act one per tick in order from the next tick, up to
+// QUEUE_SIZE waiting. A shift pressed at tick p repeats on each tick
+// p + das + k * arr after p while held, unless a press takes it, and the
+// direction pressed last wins; soft drop repeats on each p + k * interval
+// that nothing else takes. A key is held until its release, or without
+// releases until RELEASE_TICKS go by without an event for it. So a shift
+// held alone for n ticks moves once for the press and Repeats(n) times more.
+const char *FuzzKeys(FuzzInput &in)
+{
+#ifdef _WIN32
+    const int keyCodes[] = {75, 77, 80, 'x', 'z', ' ', 'c', 'q'};
+#else
+    const int keyCodes[] = {KEY_LEFT, KEY_RIGHT, KEY_DOWN, 'x', 'z', ' ', 'c', 'q'};
+#endif
+    int das = in.Next() % 20, arr = 1 + in.Next() % 5, softDropInterval = 1 + in.Next() % 4;
+    bool releases = in.Next() & 1;
+    AutoRepeat input(das, arr, releases);
+    InputQueue events;
 
-        // Clear preview area
-        for (int y = 2; y <= 6; y++)
+    auto Repeats = [&](long n)
+    {
+        long first = das;
+        while (first < 2) // the press has the first tick
+            first += arr;
+        return n >= first ? (n - first) / arr + 1 : 0;
+    };
+    struct Hold
+    {
+        bool down, alone; // alone: pressed with nothing else waiting or held, and no event since
+        long pressTick, eventTick, order, moves;
+    } holds[MOVE_HOLD + 1] = {};
+    Move pending[AutoRepeat::QUEUE_SIZE];
+    int pendingCount = 0;
+    long now = 0, presses = 0;
+    // A hold that ends after n ticks; a shift that had the keys to itself
+    // is checked, unless it was let go before its press could act
+    auto HoldEnds = [&](Move key, long n)
+    {
+        Hold &hold = holds[key];
+        hold.down = false;
+        return !hold.alone || key == MOVE_SOFT_DROP || n == 0 || hold.moves == 1 + Repeats(n);
+    };
+    while (!in.Done())
+    {
+        // A frame: a few keys, then the ticks until the next one
+        int action = in.Next();
+        for (int k = 0; k < (action & 3); k++)
         {
-            for (int x = FIELD_WIDTH * 2 + 6; x <= FIELD_WIDTH * 2 + 14; x++)
+            int choice = in.Next();
+            events.Push(keyCodes[choice & 7], choice & 8);
+        }
+        InputEvent event;
+        while (events.Pop(event))
+        {
+            Move move;
+            if (!KeyToMove(event.key, move))
+                continue;
+            for (Move key : {MOVE_LEFT, MOVE_RIGHT, MOVE_SOFT_DROP})
+                if (key != move)
+                    holds[key].alone = false;
+            Hold &hold = holds[move];
+            if (event.released)
+            {
+                input.KeyUp(move);
+                if (hold.down && !HoldEnds(move, now - hold.pressTick))
+                    return "a shift held alone moved a different number of times than das and arr give";
+                continue;
+            }
+            input.KeyEvent(move);
+            bool repeats = move == MOVE_LEFT || move == MOVE_RIGHT || move == MOVE_SOFT_DROP;
+            if (repeats && hold.down)
             {
-                mvprintw(y, x, " ");
+                hold.eventTick = now;
+                continue;
             }
+            if (pendingCount < AutoRepeat::QUEUE_SIZE)
+                pending[pendingCount++] = move;
+            bool others = holds[MOVE_LEFT].down || holds[MOVE_RIGHT].down || holds[MOVE_SOFT_DROP].down;
+            hold = {repeats, pendingCount == 1 && !others, now, now, ++presses, 0};
         }
 
-        // Draw next piece (centered)
-        int baseX = FIELD_WIDTH * 2 + 9;
-        int baseY = 4;
-        for (int px = 0; px < TETROMINO_SIZE; px++)
+        int ticks = 1 + (action >> 2) % 24, expectedMoves[24], actualMoves[24];
+        for (int tick = 0; tick < ticks; tick++)
         {
-            for (int py = 0; py < TETROMINO_SIZE; py++)
+            long t = ++now;
+            for (Move key : {MOVE_LEFT, MOVE_RIGHT, MOVE_SOFT_DROP})
+                if (holds[key].down && !releases && t - holds[key].eventTick > AutoRepeat::RELEASE_TICKS &&
+                    !HoldEnds(key, t - 1 - holds[key].pressTick))
+                    return "a shift held alone moved a different number of times than das and arr give";
+
+            const Hold &left = holds[MOVE_LEFT], &right = holds[MOVE_RIGHT], &drop = holds[MOVE_SOFT_DROP];
+            Move shift = MOVE_LEFT;
+            if (right.down && (!left.down || right.order > left.order))
+                shift = MOVE_RIGHT;
+            long held = t - holds[shift].pressTick;
+            expectedMoves[tick] = -1;
+            if (pendingCount > 0)
             {
-                if (TETROMINOS[nextPiece][Rotate(px, py, 0)] != L'.')
-                {
-                    int drawX = baseX + (px - 1) * 2;
-                    int drawY = baseY + (py - 1);
-                    attron(COLOR_PAIR(nextPiece + 1));
-                    mvprintw(drawY, drawX, "  ");
-                    attroff(COLOR_PAIR(nextPiece + 1));
-                }
+                expectedMoves[tick] = pending[0];
+                memmove(pending, pending + 1, sizeof(Move) * --pendingCount);
             }
+            else if (holds[shift].down && held >= das && (held - das) % arr == 0)
+                expectedMoves[tick] = shift;
+            else if (drop.down && (t - drop.pressTick) % softDropInterval == 0)
+                expectedMoves[tick] = MOVE_SOFT_DROP;
+
+            Move move;
+            actualMoves[tick] = input.Next(move, softDropInterval) ? (int)move : -1;
+            if (actualMoves[tick] >= 0)
+                holds[move].moves++;
         }
+        if (memcmp(expectedMoves, actualMoves, sizeof(int) * ticks) != 0)
+            return "auto-repeat gave different moves over a frame than its timing promises";
+    }
+    return nullptr;
+}
 
-        // Draw game info
-        attron(A_BOLD);
-        mvprintw(9, FIELD_WIDTH * 2 + 5, "Score: %d", score);
-        mvprintw(10, FIELD_WIDTH * 2 + 5, "Level: %d", level);
-        mvprintw(11, FIELD_WIDTH * 2 + 5, "Lines: %d", linesCleared);
-        attroff(A_BOLD);
+// One fuzz input: the first byte picks the board, the kind of run (board,
+// keys or game) and whether games use cascade rules, the next four seed the
+// game, the rest drive it. Returns the broken invariant, or nullptr.
+const char *FuzzOneInput(const uint8_t *data, size_t size)
+{
+    soundEnabled = false;
+    FuzzInput in(data, size);
+    int mode = in.Next();
+    uint32_t seed = 0;
+    for (int i = 0; i < 4; i++)
+        seed = seed << 8 | in.Next();
+    bool party = mode & 1, differential = mode & 2, cascade = mode & 4, keys = mode & 8;
+    if (differential)
+        return party ? FuzzBoard<PartyBoard>(in) : FuzzBoard<ClassicBoard>(in);
+    if (keys)
+        return FuzzKeys(in);
+
+    // The games get their rules directly; the startup rules stay as they are
+    Ruleset rules = party ? Tetris<PartyBoard>::GetRules() : Tetris<ClassicBoard>::GetRules();
+    if (cascade)
+        BuiltinRuleset("cascade", rules);
+    return party ? FuzzGame<PartyBoard>(in, seed, rules) : FuzzGame<ClassicBoard>(in, seed, rules);
+}
 
-        // Draw controls
-        mvprintw(13, FIELD_WIDTH * 2 + 5, "Controls:");
-        mvprintw(14, FIELD_WIDTH * 2 + 5, "LEFT/RIGHT: Move");
-        mvprintw(15, FIELD_WIDTH * 2 + 5, "UP: Rotate");
-        mvprintw(16, FIELD_WIDTH * 2 + 5, "DOWN: Soft Drop");
-        mvprintw(17, FIELD_WIDTH * 2 + 5, "SPACE: Hard Drop");
-        mvprintw(18, FIELD_WIDTH * 2 + 5, "S: Pause");
-        mvprintw(19, FIELD_WIDTH * 2 + 5, "ESC: Quit");
+#ifdef TETRIS_FUZZ
+// libFuzzer entry point; this build has no main() of its own.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (const char *error = FuzzOneInput(data, size))
+    {
+        fprintf(stderr, "Invariant broken: %s\n", error);
+        abort();
+    }
+    return 0;
+}
+#endif
 
-        if (isPaused)
+// Runs FuzzOneInput on random inputs without libFuzzer. A failing input is
+// saved so it can be replayed with --fuzz-input.
+int RunFuzz(long runs, uint32_t seed)
+{
+    uint32_t random = seed ? seed : 1;
+    vector<uint8_t> input;
+    input.reserve(4096);
+    for (long run = 0; run < runs; run++)
+    {
+        input.resize(5 + NextRandom(random, 4091));
+        for (uint8_t &byte : input)
+            byte = NextRandom(random, 256);
+        if (const char *error = FuzzOneInput(input.data(), input.size()))
         {
-            attron(A_BOLD | COLOR_PAIR(8));
-            mvprintw(FIELD_HEIGHT / 2 + 1, FIELD_WIDTH - 4, "PAUSED");
-            attroff(A_BOLD | COLOR_PAIR(8));
+            const char *path = "fuzz-crash.bin";
+            ofstream(path, ios::binary).write((const char *)input.data(), input.size());
+            cerr << "Run " << run << ": " << error << " (input saved to " << path << ")\n";
+            return 1;
         }
+    }
+    cout << runs << " fuzz runs, no invariant broken\n";
+    return 0;
+}
 
-        refresh();
-#endif
+// Replays one saved fuzz input.
+int RunFuzzInput(const char *path)
+{
+    ifstream file(path, ios::binary);
+    if (!file.is_open())
+    {
+        cerr << "Cannot read " << path << "\n";
+        return 1;
     }
-    bool IsGameOver() const { return isGameOver; }
-    int GetScore() const { return score; }
-};
+    vector<uint8_t> input((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    if (const char *error = FuzzOneInput(input.data(), input.size()))
+    {
+        cerr << error << "\n";
+        return 1;
+    }
+    cout << "No invariant broken\n";
+    return 0;
+}
 
-int main()
+#ifndef _WIN32
+// Renders a broadcast game until the viewer presses q or Esc.
+template <class BoardT>
+int RunSpectatorView(SpectatorReader &reader, GameView &view)
 {
-    // Initialize random seed
-    srand(time(0));
+    Tetris<BoardT> game;
+    FrameBuffer frame(game.ScreenWidth(), game.ScreenHeight());
+    CursesBackend backend(frame.Width(), frame.Height());
+    game.SetView(view);
+    game.Draw(frame);
+    backend.Present(frame);
+
+    while (true)
+    {
+        int ch = getch();
+        if (ch == 'q' || ch == 'Q' || ch == 27)
+            return 0;
+        if (ch == KEY_RESIZE)
+        {
+            backend.Resize(COLS, LINES);
+            backend.Present(frame);
+        }
+        if (reader.Poll(view))
+        {
+            if (view.status.width != BoardT::FIELD_WIDTH || view.status.height != BoardT::FIELD_HEIGHT)
+                return 2; // board size changed, caller picks the new variant
+            game.SetView(view);
+            game.Draw(frame);
+            backend.Present(frame);
+        }
+        usleep(16000);
+    }
+}
 
-#ifdef _WIN32
-    // Windows initialization
-    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-    CONSOLE_CURSOR_INFO cursorInfo;
-    GetConsoleCursorInfo(hConsole, &cursorInfo);
-    cursorInfo.bVisible = false;
-    SetConsoleCursorInfo(hConsole, &cursorInfo);
+int RunSpectator(const char *channelName)
+{
+    SpectatorReader reader;
+    if (!reader.Open(channelName))
+    {
+        cerr << "No game is broadcasting on " << channelName << "\n";
+        return 1;
+    }
 
-    // Set console title
-    SetConsoleTitleA("Tetris Game");
+    GameView view = {};
+    while (!reader.Poll(view))
+        usleep(16000);
 
-    // Set console size
-    SMALL_RECT windowSize = {0, 0, 79, 49}; // 80x50
-    SetConsoleWindowInfo(hConsole, TRUE, &windowSize);
-#else
-    // Linux initialization (ncurses)
     initscr();
-    ShowGameInstructions();
     noecho();
     curs_set(0);
     nodelay(stdscr, TRUE);
     keypad(stdscr, TRUE);
     start_color();
+    InitColorPairs();
 
-    // Initialize color pairs
-    init_pair(1, COLOR_BLACK, COLOR_CYAN);    // I
-    init_pair(2, COLOR_BLACK, COLOR_BLUE);    // J
-    init_pair(3, COLOR_BLACK, 208);           // L (using yellow for orange)
-    init_pair(4, COLOR_BLACK, COLOR_YELLOW);  // O
-    init_pair(5, COLOR_BLACK, COLOR_GREEN);   // S
-    init_pair(6, COLOR_BLACK, COLOR_MAGENTA); // T
-    init_pair(7, COLOR_BLACK, COLOR_RED);     // Z
-    init_pair(8, COLOR_RED, COLOR_WHITE);     // Border
+    int result;
+    do
+    {
+        string size = to_string(view.status.width - 2) + "x" + to_string(view.status.height - 2);
+        result = WithBoard(size, [&](auto tag)
+                           { return RunSpectatorView<typename decltype(tag)::type>(reader, view); });
+    } while (result == 2);
+    endwin();
+    return result;
+}
 #endif
 
-    Tetris game;
+#ifndef TETRIS_FUZZ
+int main(int argc, char *argv[])
+{
+    // Initialize random seed
+    srand(time(0));
 
-    // Play start sound
-#ifdef _WIN32
-    ShowGameInstructions();
+    string boardSize = "10x20";
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        if (strcmp(argv[i], "--board") == 0)
+            boardSize = argv[i + 1];
+    }
+    if (boardSize != "10x20" && boardSize != "16x40")
+    {
+        cerr << "Unknown board size " << boardSize << " (available: 10x20, 16x40)\n";
+        return 1;
+    }
 
-    Beep(523, 200); // C note
-    Beep(659, 200); // E note
-    Beep(784, 200); // G note
-#else
-    system("ffplay -nodisp -autoexit game_start.mp3 2>/dev/null &");
+#if defined(TETRIS_SPECTATE) && !defined(_WIN32)
+    // Built as the tetris-spectate viewer
+    return RunSpectator(argc > 1 ? argv[1] : SPECTATE_DEFAULT_NAME);
 #endif
 
-    ShowCountdownAnimation();
+    // The rules are settled once, before any game or tool runs
+    Ruleset rules;
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        if (strcmp(argv[i], "--rules") == 0 && !LoadRuleset(argv[i + 1], rules))
+            return 1;
+    }
 
-    // Main game loop
-    while (!game.IsGameOver())
+    GameOptions options;
+    for (int i = 1; i < argc; i++)
     {
-#ifdef _WIN32
-        if (_kbhit())
+        if (strcmp(argv[i], "--broadcast") == 0)
+            options.broadcastName = i + 1 < argc && argv[i + 1][0] == '/' ? argv[i + 1] : SPECTATE_DEFAULT_NAME;
+        if (strcmp(argv[i], "--bot") == 0)
+            options.bot = true;
+        if (strcmp(argv[i], "--quick") == 0)
+            options.quick = true;
+        if (strcmp(argv[i], "--debug") == 0)
+            options.debug = true;
+        if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc)
+            options.metricsAddress = argv[i + 1];
+        if (strcmp(argv[i], "--preview") == 0 && i + 1 < argc)
+            options.previewCount = atoi(argv[i + 1]);
+        if (strcmp(argv[i], "--turbo") == 0 && i + 1 < argc)
+            options.speed = max(atof(argv[i + 1]), 0.01);
+        if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc)
+            options.frameRate = max(atoi(argv[i + 1]), 1);
+        if (strcmp(argv[i], "--delay") == 0 && i + 1 < argc)
+            options.versusDelay = atoi(argv[i + 1]);
+        // Times are given in ms and kept in ticks; lock resets are a count
+        if (strcmp(argv[i], "--das") == 0 && i + 1 < argc)
+            options.das = max(atoi(argv[i + 1]), 0) / TICK_MS;
+        if (strcmp(argv[i], "--arr") == 0 && i + 1 < argc)
+            options.arr = max(atoi(argv[i + 1]) / TICK_MS, 1);
+        if (strcmp(argv[i], "--lock-delay") == 0 && i + 1 < argc)
+            rules.lockDelay = max(atoi(argv[i + 1]) / TICK_MS, 1);
+        if (strcmp(argv[i], "--lock-resets") == 0 && i + 1 < argc)
+            rules.lockResets = max(atoi(argv[i + 1]), 0);
+        if (strcmp(argv[i], "--versus") == 0 && i + 2 < argc)
         {
-            int ch = _getch();
-            // Handle arrow keys (Windows returns two codes for arrows)
-            if (ch == 0 || ch == 224)
+            // --versus INDEX HOST:PORT,HOST:PORT[,...] lists every player, this one included
+            options.versusPlayer = atoi(argv[i + 1]);
+            stringstream list(argv[i + 2]);
+            string address;
+            while (getline(list, address, ','))
+            {
+                if (options.versusPlayers == VERSUS_MAX_PLAYERS ||
+                    !ParseAddress(address, options.versusAddresses[options.versusPlayers++]))
+                {
+                    cerr << "Bad versus player list " << argv[i + 2] << " (2 to 4 HOST:PORT entries)\n";
+                    return 1;
+                }
+            }
+            if (options.versusPlayers < 2 || options.versusPlayer < 0 || options.versusPlayer >= options.versusPlayers)
             {
-                ch = _getch(); // Get the actual key code
+                cerr << "Bad versus player list " << argv[i + 2] << " (2 to 4 HOST:PORT entries)\n";
+                return 1;
             }
-            game.ProcessInput(ch);
         }
-#else
-        int ch = getch();
-        if (ch != ERR)
+    }
+
+    Tetris<ClassicBoard>::SetRules(rules);
+    Tetris<PartyBoard>::SetRules(rules);
+
+    // Command line tools that run without the game UI
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--golden") == 0 && i + 1 < argc)
+        {
+            const char *path = argv[i + 1];
+            unsigned seed = i + 2 < argc && argv[i + 2][0] != '-' ? atoi(argv[i + 2]) : 1;
+            bool update = false;
+            for (int j = 1; j < argc; j++)
+                update = update || strcmp(argv[j], "--update-golden") == 0;
+            return WithBoard(boardSize, [&](auto tag)
+                             { return RunGoldenFrame<typename decltype(tag)::type>(path, seed, 400, update); });
+        }
+        if (strcmp(argv[i], "--bench-render") == 0)
+        {
+            long frames = i + 1 < argc ? atol(argv[i + 1]) : 0;
+            if (frames <= 0)
+                frames = 100000;
+            return WithBoard(boardSize, [&](auto tag)
+                             { return RunRenderBenchmark<typename decltype(tag)::type>(frames); });
+        }
+        if (strcmp(argv[i], "--alloc-check") == 0)
+        {
+            long frames = i + 1 < argc ? atol(argv[i + 1]) : 0;
+            if (frames <= 0)
+                frames = 100000;
+            return WithBoard(boardSize, [&](auto tag)
+                             { return RunAllocationCheck<typename decltype(tag)::type>(frames); });
+        }
+        if (strcmp(argv[i], "--versus-test") == 0)
+        {
+            int frames = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+            int delay = i + 2 < argc ? atoi(argv[i + 2]) : 50;
+            if (frames <= 0)
+                frames = 3000;
+            return WithBoard(boardSize, [&](auto tag)
+                             { return RunVersusTest<typename decltype(tag)::type>(frames, delay); });
+        }
+#ifndef _WIN32
+        if (strcmp(argv[i], "--spectate-test") == 0)
         {
-            game.ProcessInput(ch);
-            // Clear any additional buffered input
-            flushinp();
+            long frames = i + 1 < argc ? atol(argv[i + 1]) : 0;
+            if (frames <= 0)
+                frames = 20000;
+            return WithBoard(boardSize, [&](auto tag)
+                             { return RunSpectateTest<typename decltype(tag)::type>(frames); });
         }
 #endif
+        if (strcmp(argv[i], "--marathon") == 0)
+        {
+            // --marathon [PIECES] [--window N]
+            long pieces = 1000000, window = 100000;
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                pieces = atol(argv[i + 1]);
+            for (int j = i + 1; j + 1 < argc; j++)
+            {
+                if (strcmp(argv[j], "--window") == 0)
+                    window = atol(argv[j + 1]);
+            }
+            return WithBoard(boardSize, [&](auto tag)
+                             { return RunMarathon<typename decltype(tag)::type>(pieces, window); });
+        }
+        if (strcmp(argv[i], "--fuzz") == 0)
+        {
+            long runs = i + 1 < argc ? atol(argv[i + 1]) : 0;
+            uint32_t seed = i + 2 < argc ? strtoul(argv[i + 2], nullptr, 10) : time(0);
+            return RunFuzz(runs > 0 ? runs : 10000, seed);
+        }
+        if (strcmp(argv[i], "--fuzz-input") == 0 && i + 1 < argc)
+            return RunFuzzInput(argv[i + 1]);
+        if (strcmp(argv[i], "--sweep") == 0 && i + 2 < argc)
+        {
+            // --sweep FIRST COUNT [--threads N] [--top K] [--ticks T] [--out FILE]
+            uint32_t first = strtoul(argv[i + 1], nullptr, 10), count = strtoul(argv[i + 2], nullptr, 10);
+            int threads = thread::hardware_concurrency(), top = 100;
+            uint32_t maxTicks = 30000;
+            const char *path = "sweep.idx";
+            for (int j = i + 3; j + 1 < argc; j += 2)
+            {
+                if (strcmp(argv[j], "--threads") == 0)
+                    threads = atoi(argv[j + 1]);
+                else if (strcmp(argv[j], "--top") == 0)
+                    top = atoi(argv[j + 1]);
+                else if (strcmp(argv[j], "--ticks") == 0)
+                    maxTicks = strtoul(argv[j + 1], nullptr, 10);
+                else if (strcmp(argv[j], "--out") == 0)
+                    path = argv[j + 1];
+            }
+            return WithBoard(boardSize, [&](auto tag)
+                             { return RunSeedSweep<typename decltype(tag)::type>(first, count, threads, top, maxTicks, path); });
+        }
+        if (strcmp(argv[i], "--solve") == 0 && i + 1 < argc)
+        {
+            int threads = thread::hardware_concurrency();
+            double timeLimit = 60;
+            for (int j = i + 2; j + 1 < argc; j += 2)
+            {
+                if (strcmp(argv[j], "--threads") == 0)
+                    threads = atoi(argv[j + 1]);
+                else if (strcmp(argv[j], "--time") == 0)
+                    timeLimit = atof(argv[j + 1]);
+            }
+            const char *path = argv[i + 1];
+            return WithBoard(boardSize, [&](auto tag)
+                             { return RunSolver<typename decltype(tag)::type>(path, threads, timeLimit); });
+        }
+    }
+
+    MetricsServer metricsServer;
+    if (options.metricsAddress && !metricsServer.Open(options.metricsAddress))
+    {
+        cerr << "Cannot serve metrics on " << options.metricsAddress << "\n";
+        return 1;
+    }
 
-        game.Update();
-        game.Draw();
+    // Assets load while the terminal and the intro screens come up
+    AssetLoader assets;
+    assets.Start();
 
-        // Use proper sleep for Linux
 #ifdef _WIN32
-        Sleep(50);
+    // Windows initialization
+    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+    CONSOLE_CURSOR_INFO cursorInfo;
+    GetConsoleCursorInfo(hConsole, &cursorInfo);
+    cursorInfo.bVisible = false;
+    SetConsoleCursorInfo(hConsole, &cursorInfo);
+
+    // Set console title
+    SetConsoleTitleA("Tetris Game");
 
-        Beep(523, 200); // C note
-        Beep(659, 200); // E note
-        Beep(784, 200); // G note
+    // Set console size
+    SMALL_RECT windowSize = {0, 0, 79, 49}; // 80x50
+    SetConsoleWindowInfo(hConsole, TRUE, &windowSize);
 #else
-        usleep(50000); // 50ms in microseconds
+    // Linux initialization (ncurses), the only one for the whole game
+    initscr();
+    noecho();
+    curs_set(0);
+    nodelay(stdscr, TRUE);
+    keypad(stdscr, TRUE);
+    start_color();
+    InitColorPairs();
+#endif
+    if (!options.quick)
+        ShowGameInstructions();
+
+    int finalScore = WithBoard(boardSize, [&](auto tag)
+                               { return options.versusPlayers > 0 ? PlayVersus<typename decltype(tag)::type>(options)
+                                                                  : PlayGame<typename decltype(tag)::type>(options); });
+    if (finalScore < 0)
+    {
+#ifndef _WIN32
+        endwin();
 #endif
+        cerr << "Could not open the versus UDP port\n";
+        return 1;
     }
-    ShowGameOverAnimation();
 
     // Display final score and high scores
 #ifdef _WIN32
     system("cls");
     SetConsoleTextAttribute(hConsole, FOREGROUND_RED | FOREGROUND_INTENSITY);
-    cout << "Game Over! Final Score: " << game.GetScore() << endl;
+    cout << "Game Over! Final Score: " << finalScore << endl;
     SetConsoleTextAttribute(hConsole, FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE);
 #else
     endwin();
-    cout << "\033[31m" << "Game Over! Final Score: " << game.GetScore() << endl
+    cout << "\033[31m" << "Game Over! Final Score: " << finalScore << endl
          << "\033[0m";
 #endif
 
-    vector<HighScore> currentScores = readHighScores();
-    if (currentScores.size() < 5 || game.GetScore() > currentScores.back().score)
+    // Demo games played by the bot don't go on the table
+    const vector<HighScore> &currentScores = assets.HighScores();
+    if (!options.bot && (currentScores.size() < 5 || finalScore > currentScores.back().score))
     {
-        updateHighScores(game.GetScore());
+        updateHighScores(finalScore);
     }
     displayHighScores();
 
@@ -1221,3 +7813,4 @@ int main()
 
     return 0;
 }
+#endif